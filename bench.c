@@ -0,0 +1,275 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file bench.c Throughput benchmarks for the monitor
+ *
+ * Each result is printed on its own line as "name value unit" with an
+ * integer value, so runs from different builds and boards can be diffed
+ * or parsed by a script. All tests preserve memory and disk contents;
+ * the IORQ test resets the Z80. The disk test times its writes on the
+ * blocks of a scratch file, which it leaves on the card for the next run.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#include "bench.h"
+#include "timer.h"
+#include "bus.h"
+#include "z80.h"
+#include "iorq.h"
+#include "iox.h"
+#include "uart.h"
+#include "sioemu.h"
+#include "ff.h"
+#include "diskio.h"
+
+extern FATFS fs;
+
+#define BENCH_MEM_START 0xC000  // crosses a 64K boundary when paging is enabled
+#define BENCH_MEM_LEN 0x8000
+#define BENCH_DISK_BLOCKS 64
+#define BENCH_DISK_FILE "bench.tmp"
+#define BENCH_FILE_MAX 0x10000
+#define BENCH_IORQ_COUNT 1000
+#define BENCH_UART_BYTES 1000
+#define BENCH_IOX_OPS 1000
+
+/**
+ * Print a result as bytes transferred per millisecond, i.e. kB/s
+ */
+static void bench_kbps(const char *name, uint32_t bytes, uint32_t ticks)
+{
+    uint32_t us = timer_us(ticks);
+    printf_P(PSTR("%S %lu kB/s\n"), name, us ? bytes * 1000 / us : 0);
+}
+
+/**
+ * Print a result as operations per second
+ */
+static void bench_ops(const char *name, uint32_t ops, uint32_t ticks)
+{
+    uint32_t us = timer_us(ticks);
+    printf_P(PSTR("%S %lu ops/s\n"), name, us ? ops * 1000000 / us : 0);
+}
+
+/**
+ * Time external memory reads and writes; writes put back what was read
+ */
+static void bench_mem(void)
+{
+    uint8_t buf[256];
+    uint32_t addr, start, rd = 0, wr = 0;
+
+    for (addr = BENCH_MEM_START; addr < BENCH_MEM_START + BENCH_MEM_LEN; addr += sizeof buf) {
+        start = timer_ticks();
+        mem_read(addr, buf, sizeof buf);
+        rd += timer_ticks() - start;
+        start = timer_ticks();
+        mem_write(addr, buf, sizeof buf);
+        wr += timer_ticks() - start;
+    }
+    bench_kbps(PSTR("mem_read"), BENCH_MEM_LEN, rd);
+    bench_kbps(PSTR("mem_write"), BENCH_MEM_LEN, wr);
+
+    if (!bus_begin())
+        return;
+    start = timer_ticks();
+    for (addr = BENCH_MEM_START; addr < BENCH_MEM_START + BENCH_MEM_LEN; addr += sizeof buf)
+        mem_read(addr, buf, sizeof buf);
+    rd = timer_ticks() - start;
+    bus_end();
+    bench_kbps(PSTR("mem_read_session"), BENCH_MEM_LEN, rd);
+}
+
+/**
+ * Find the first SD block of a scratch file allocated in one fragment, so raw
+ * writes land on blocks that no other file or directory uses
+ */
+static DWORD bench_scratch(void)
+{
+    FIL fil;
+    DWORD clmt[4], lba = 0;
+
+    if (f_open(&fil, BENCH_DISK_FILE, FA_READ | FA_WRITE | FA_OPEN_ALWAYS) != FR_OK)
+        return 0;
+    if (f_lseek(&fil, (FSIZE_t)BENCH_DISK_BLOCKS * FF_MIN_SS) == FR_OK && f_sync(&fil) == FR_OK) {
+        // A link map with room for one fragment can only be built for a contiguous file
+        clmt[0] = 4;
+        fil.cltbl = clmt;
+        if (f_lseek(&fil, CREATE_LINKMAP) == FR_OK)
+            lba = fs.database + (clmt[2] - 2) * fs.csize;
+        fil.cltbl = NULL;
+    }
+    f_close(&fil);
+    return lba;
+}
+
+/**
+ * Time raw SD block reads and writes on the blocks of a scratch file;
+ * writes put back what was read
+ */
+static void bench_disk(void)
+{
+    uint8_t buf[FF_MIN_SS];
+    uint32_t start, ticks = 0;
+    DWORD lba = bench_scratch();
+    uint8_t i;
+
+    if (!lba || (disk_status(DRV_MMC) & STA_NOINIT)) {
+        printf_P(PSTR("disk_read error\n"));
+        return;
+    }
+    start = timer_ticks();
+    for (i = 0; i < BENCH_DISK_BLOCKS; i++)
+        if (disk_read(DRV_MMC, buf, lba + i, 1) != RES_OK)
+            break;
+    ticks = timer_ticks() - start;
+    bench_kbps(PSTR("disk_read"), (uint32_t)i * FF_MIN_SS, ticks);
+
+    ticks = 0;
+    for (i = 0; i < BENCH_DISK_BLOCKS / 4; i++) {
+        if (disk_read(DRV_MMC, buf, lba + i, 1) != RES_OK)
+            break;
+        start = timer_ticks();
+        if (disk_write(DRV_MMC, buf, lba + i, 1) != RES_OK)
+            break;
+        ticks += timer_ticks() - start;
+    }
+    bench_kbps(PSTR("disk_write"), (uint32_t)i * FF_MIN_SS, ticks);
+}
+
+/**
+ * Time reading a file through FatFs
+ */
+static void bench_file(char *filename)
+{
+    FIL fil;
+    UINT br;
+    uint8_t buf[FF_MIN_SS];
+    uint32_t total = 0, start, ticks;
+
+    if (f_open(&fil, filename, FA_READ) != FR_OK) {
+        printf_P(PSTR("f_read error\n"));
+        return;
+    }
+    start = timer_ticks();
+    while (total < BENCH_FILE_MAX && f_read(&fil, buf, sizeof buf, &br) == FR_OK && br > 0)
+        total += br;
+    ticks = timer_ticks() - start;
+    f_close(&fil);
+    bench_kbps(PSTR("f_read"), total, ticks);
+}
+
+/**
+ * Time IO request round trips with a Z80 stub that polls the SIO status
+ * port, wherever the ports command has mapped it
+ */
+static void bench_iorq(void)
+{
+    uint8_t stub[] = {
+        0xDB, SIO0_STATUS,      // loop: in a,(SIO0_STATUS)
+        0x18, 0xFC              //       jr loop
+    };
+    uint8_t saved[sizeof stub];
+    uint32_t start, ticks;
+    uint16_t n = 0;
+    uint8_t dev = iorq_find("sio");
+
+    if (dev != IORQ_NONE)
+        stub[1] = iorq_devices[dev].base;
+    mem_read(0, saved, sizeof saved);
+    mem_write(0, stub, sizeof stub);
+    z80_reset(0);
+    clk_run();
+    start = timer_ticks();
+    while (n < BENCH_IORQ_COUNT) {
+        if (!GET_IORQ) {
+            iorq_dispatch(0);
+            n++;
+        }
+    }
+    ticks = timer_ticks() - start;
+    clk_stop();
+    CLK_LO;
+    mem_write(0, saved, sizeof saved);
+    z80_reset(0);
+    printf_P(PSTR("iorq_roundtrip %lu ns\n"), timer_us(ticks) * 1000 / BENCH_IORQ_COUNT);
+    // Time the stub itself takes per pass: 23 T states
+    printf_P(PSTR("iorq_stub %lu ns\n"), 23000ul * clkdiv / (F_CPU / 1000000));
+}
+
+/**
+ * Time console UART transmission, overwriting the output with a carriage return
+ */
+static void bench_uart(void)
+{
+    uint32_t start, ticks;
+
+    uart_flush();
+    start = timer_ticks();
+    for (uint16_t i = 0; i < BENCH_UART_BYTES; i++)
+        uart_putc(0, ' ');
+    uart_flush();
+    ticks = timer_ticks() - start;
+    uart_putc(0, '\r');
+    bench_kbps(PSTR("uart_tx"), BENCH_UART_BYTES, ticks);
+}
+
+/**
+ * Time IO expander register accesses on a register that isn't shadowed
+ */
+static void bench_iox(void)
+{
+    uint32_t start, ticks;
+    uint8_t value;
+    uint16_t i;
+
+    start = timer_ticks();
+    for (i = 0; i < BENCH_IOX_OPS; i++)
+        value = iox_read(0, GPINTENA0);
+    ticks = timer_ticks() - start;
+    bench_ops(PSTR("iox_read"), BENCH_IOX_OPS, ticks);
+
+    start = timer_ticks();
+    for (i = 0; i < BENCH_IOX_OPS; i++)
+        iox_write(0, GPINTENA0, value);
+    ticks = timer_ticks() - start;
+    bench_ops(PSTR("iox_write"), BENCH_IOX_OPS, ticks);
+}
+
+/**
+ * Run all benchmarks; the file read test runs only if a filename is given
+ */
+void bench_run(char *filename)
+{
+    bench_mem();
+    bench_disk();
+    if (filename)
+        bench_file(filename);
+    bench_iorq();
+    bench_uart();
+    bench_iox();
+}
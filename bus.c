@@ -26,12 +26,15 @@
 
 #include "bus.h"
 #include "iox.h"
+#include "uart.h"
+#include "util.h"
 
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
 
 #include <stdio.h>
+#include <string.h>
 
 /**
  * Run the clock for a specified number of cycles
@@ -55,8 +58,16 @@ void clk_run(void)
     // Fast PWM mode with adjustable top and no prescaler
     TCCR2A |= (1 << COM2B1) | (1 << WGM21) | (1 << WGM20);
     TCCR2B |= (1 << WGM22) | (1 << CS20);
-    OCR2A = (clkdiv - 1);
-    OCR2B = (clkdiv - 1) >> 1;
+    clk_set(clkdiv);
+}
+
+/**
+ * Change the divider of the Z80's clock, taking effect at the next period if it is running
+ */
+void clk_set(uint8_t div)
+{
+    OCR2A = (div - 1);
+    OCR2B = (div - 1) >> 1;
 }
 
 /**
@@ -70,6 +81,15 @@ void clk_stop()
     OCR2B = 0;
 }
 
+/**
+ * Nesting depth of bus sessions; the bus stays mastered while nonzero
+ */
+static uint8_t bus_session = 0;
+
+#ifdef PAGE_BASE
+static uint8_t mem_pages_valid = 0;
+#endif
+
 /**
  *  Request control of the bus from the Z80
  */
@@ -77,6 +97,9 @@ uint8_t bus_master(void)
 {
     uint8_t i = 255;
 
+    if (bus_session)
+        return 1;
+
     BUSRQ_LO;           // request bus
     // wait for BUSACK to go low
     while (GET_BUSACK)  {
@@ -104,6 +127,8 @@ uint8_t bus_master(void)
  */
 void bus_slave(void)
 {
+    if (bus_session)
+        return;
     MREQ_INPUT;
     IORQ_INPUT;
     RD_INPUT;
@@ -113,6 +138,33 @@ void bus_slave(void)
     BUSRQ_HI;
 }
 
+/**
+ * Begin a bus session: master the bus and keep it across transfers until
+ * the matching bus_end. Sessions nest.
+ */
+uint8_t bus_begin(void)
+{
+    if (!bus_session) {
+        if (!bus_master())
+            return 0;
+#ifdef PAGE_BASE
+        // Only trust page registers written during this session
+        mem_pages_valid = 0;
+#endif
+    }
+    bus_session++;
+    return 1;
+}
+
+/**
+ * End a bus session, returning the bus to the Z80 when the outermost one ends
+ */
+void bus_end(void)
+{
+    if (bus_session && --bus_session == 0)
+        bus_slave();
+}
+
 /**
  * Retrieve the current bus status
  */
@@ -120,35 +172,44 @@ bus_stat bus_status()
 {
     bus_stat status;
     status.flags = GET_BFLAGS | GET_DFLAGS;
-    status.xflags = GET_XFLAGS;
+    uint16_t hiflags = GET_ADDRHI_XFLAGS;
+    status.xflags = (hiflags >> 8) & XFLAGS_MASK;
     status.data = GET_DATA;
-    status.addr = GET_ADDR;
+    status.addr = GET_ADDRLO | (hiflags << 8);
     return status;
 }
 
 /**
- * Log the bus status
+ * Log the bus status, formatting the line without printf
  */
 void bus_log(bus_stat status)
 {
-    printf_P(
-        PSTR("\t%04x %02x %c    %s %s    %s %s %s %s %s %s %s %s\n"),
-        status.addr,
-        status.data,
-        0x20 <= status.data && status.data <= 0x7e ? status.data : ' ',
-        !FLAG(status.flags, MREQ) ? "memrq" :
-        !FLAG(status.flags, IORQ) ? "iorq " : "     ",
-        !FLAG(status.flags, RD) ? "rd  " :
-        !FLAG(status.flags, WR) ? "wr  " :
-        !FLAG(status.xflags, RFSH) ? "rfsh" : "    ",
-        !FLAG(status.xflags, M1) ? "m1" : "  ",
-        !FLAG(status.flags, BUSRQ) ? "busrq" : "     ",
-        !FLAG(status.flags, BUSACK) ? "busack" : "      ",
-        (!FLAG(status.flags, IORQ) && FLAG(status.flags, BUSRQ)) ? "wait" : "    ",
-        !FLAG(status.xflags, HALT) ? "halt" : "    ", 
-        !FLAG(status.xflags, INTERRUPT) ? "int" : "   ",
-        !FLAG(status.xflags, NMI) ? "nmi" : "   ",
-        !FLAG(status.xflags, RESET) ? "reset" : "     ");
+    char line[80];
+    char *p = line;
+
+    *p++ = '\t';
+    p = fmt_hex(p, status.addr, 4);
+    *p++ = ' ';
+    p = fmt_hex(p, status.data, 2);
+    *p++ = ' ';
+    *p++ = 0x20 <= status.data && status.data <= 0x7e ? status.data : ' ';
+    p = fmt_str_P(p, PSTR("    "));
+    p = fmt_str_P(p, !FLAG(status.flags, MREQ) ? PSTR("memrq ") :
+        !FLAG(status.flags, IORQ) ? PSTR("iorq  ") : PSTR("      "));
+    p = fmt_str_P(p, !FLAG(status.flags, RD) ? PSTR("rd      ") :
+        !FLAG(status.flags, WR) ? PSTR("wr      ") :
+        !FLAG(status.xflags, RFSH) ? PSTR("rfsh    ") : PSTR("        "));
+    p = fmt_str_P(p, !FLAG(status.xflags, M1) ? PSTR("m1 ") : PSTR("   "));
+    p = fmt_str_P(p, !FLAG(status.flags, BUSRQ) ? PSTR("busrq ") : PSTR("      "));
+    p = fmt_str_P(p, !FLAG(status.flags, BUSACK) ? PSTR("busack ") : PSTR("       "));
+    p = fmt_str_P(p, (!FLAG(status.flags, IORQ) && FLAG(status.flags, BUSRQ)) ? PSTR("wait ") : PSTR("     "));
+    p = fmt_str_P(p, !FLAG(status.xflags, HALT) ? PSTR("halt ") : PSTR("     "));
+    p = fmt_str_P(p, !FLAG(status.xflags, INTERRUPT) ? PSTR("int ") : PSTR("    "));
+    p = fmt_str_P(p, !FLAG(status.xflags, NMI) ? PSTR("nmi ") : PSTR("    "));
+    p = fmt_str_P(p, !FLAG(status.xflags, RESET) ? PSTR("reset") : PSTR("     "));
+    *p++ = '\r';
+    *p++ = '\n';
+    uart_write(0, (uint8_t *)line, p - line);
 }
 
 /**
@@ -193,13 +254,11 @@ void bus_init(void)
 uint32_t base_addr = 0;
 
 /**
- * Read specified number of bytes from external memory to a buffer
+ * Read specified number of bytes from external memory to a buffer (bus must already be mastered)
  */
-void mem_read(uint32_t addr, uint8_t *buf, uint16_t len)
+void mem_read_bare(uint32_t addr, uint8_t *buf, uint16_t len)
 {
     addr += base_addr & 0xFC000;
-    if (!bus_master())
-        return;
 #ifdef PAGE_BASE
     DATA_OUTPUT;
     mem_page_bare(0, PAGE(addr & 0xF0000));
@@ -234,17 +293,25 @@ void mem_read(uint32_t addr, uint8_t *buf, uint16_t len)
     }
     RD_HI;
     MREQ_HI;
-    bus_slave();
 }
 
 /**
- *  Write specified number of bytes to external memory from a buffer
+ * Read specified number of bytes from external memory to a buffer
  */
-void _mem_write(uint32_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspace)
+void mem_read(uint32_t addr, uint8_t *buf, uint16_t len)
 {
-    addr += base_addr & 0xFC000;
     if (!bus_master())
         return;
+    mem_read_bare(addr, buf, len);
+    bus_slave();
+}
+
+/**
+ *  Write specified number of bytes to external memory from a buffer (bus must already be mastered)
+ */
+void _mem_write_bare(uint32_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspace)
+{
+    addr += base_addr & 0xFC000;
     DATA_OUTPUT;
 #ifdef PAGE_BASE
     mem_page_bare(0, PAGE(addr & 0xF0000));
@@ -280,9 +347,225 @@ void _mem_write(uint32_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspac
     }
     MREQ_HI;
     DATA_INPUT;
+}
+
+/**
+ *  Write specified number of bytes to external memory from a buffer
+ */
+void _mem_write(uint32_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspace)
+{
+    if (!bus_master())
+        return;
+    _mem_write_bare(addr, buf, len, pgmspace);
+    bus_slave();
+}
+
+/**
+ * Fill external memory with a single value (bus must already be mastered)
+ */
+void mem_fill_bare(uint32_t addr, uint32_t len, uint8_t value)
+{
+    addr += base_addr & 0xFC000;
+    DATA_OUTPUT;
+#ifdef PAGE_BASE
+    mem_page_bare(0, PAGE(addr & 0xF0000));
+    mem_page_bare(1, PAGE(addr & 0xF0000)+1);
+    mem_page_bare(2, PAGE(addr & 0xF0000)+2);
+    mem_page_bare(3, PAGE(addr & 0xF0000)+3);
+#endif
+    MREQ_LO;
+    SET_ADDR(addr & 0xFFFF);
+    SET_DATA(value);
+    while (len--) {
+        WR_LO;
+        WR_HI;
+        addr++;
+#ifdef PAGE_BASE
+        if ((addr & 0xFFFF) == 0) {
+            MREQ_HI;
+            mem_page_bare(0, PAGE(addr));
+            mem_page_bare(1, PAGE(addr)+1);
+            mem_page_bare(2, PAGE(addr)+2);
+            mem_page_bare(3, PAGE(addr)+3);
+            SET_DATA(value);
+            MREQ_LO;
+        }
+#endif
+        if ((addr & 0xFF) == 0) {
+            SET_ADDR(addr & 0xFFFF);
+        } else {
+            SET_ADDRLO(addr & 0xFF);
+        }
+    }
+    MREQ_HI;
+    DATA_INPUT;
+}
+
+/**
+ * Fill external memory with a single value
+ */
+void mem_fill(uint32_t addr, uint32_t len, uint8_t value)
+{
+    if (!bus_master())
+        return;
+    mem_fill_bare(addr, len, value);
     bus_slave();
 }
 
+/**
+ * Compare external memory against a buffer as it is read, returning the offset
+ * of the first difference or len if they match (bus must already be mastered)
+ */
+uint16_t mem_compare_bare(uint32_t addr, const uint8_t *buf, uint16_t len)
+{
+    uint16_t i;
+
+    addr += base_addr & 0xFC000;
+#ifdef PAGE_BASE
+    DATA_OUTPUT;
+    mem_page_bare(0, PAGE(addr & 0xF0000));
+    mem_page_bare(1, PAGE(addr & 0xF0000)+1);
+    mem_page_bare(2, PAGE(addr & 0xF0000)+2);
+    mem_page_bare(3, PAGE(addr & 0xF0000)+3);
+#endif
+    DATA_INPUT;
+    MREQ_LO;
+    RD_LO;
+    SET_ADDR(addr & 0xFFFF);
+    for (i = 0; i < len; i++) {
+        if (GET_DATA != buf[i])
+            break;
+        addr++;
+#ifdef PAGE_BASE
+        if ((addr & 0xFFFF) == 0) {
+            MREQ_HI;
+            DATA_OUTPUT;
+            mem_page_bare(0, PAGE(addr));
+            mem_page_bare(1, PAGE(addr)+1);
+            mem_page_bare(2, PAGE(addr)+2);
+            mem_page_bare(3, PAGE(addr)+3);
+            DATA_INPUT;
+            MREQ_LO;
+        }
+#endif
+        if ((addr & 0xFF) == 0) {
+            SET_ADDR(addr & 0xFFFF);
+        } else {
+            SET_ADDRLO(addr & 0xFF);
+        }
+    }
+    RD_HI;
+    MREQ_HI;
+    return i;
+}
+
+/**
+ * Compare external memory against a buffer, returning the offset of the first
+ * difference or len if they match
+ */
+uint16_t mem_compare(uint32_t addr, const uint8_t *buf, uint16_t len)
+{
+    if (!bus_master())
+        return 0;
+    len = mem_compare_bare(addr, buf, len);
+    bus_slave();
+    return len;
+}
+
+// Shortest pattern worth building a skip table for
+#define FIND_SKIP_MIN 4
+
+/**
+ * Read a byte during a search, only touching the address lines that changed
+ */
+static uint8_t find_peek(uint32_t addr, uint16_t *hi)
+{
+    if ((addr >> 8) != *hi) {
+#ifdef PAGE_BASE
+        if (((addr >> 8) ^ *hi) & 0xF00) {
+            RD_HI;
+            MREQ_HI;
+            DATA_OUTPUT;
+            mem_page_bare(0, PAGE(addr & 0xF0000));
+            mem_page_bare(1, PAGE(addr & 0xF0000)+1);
+            mem_page_bare(2, PAGE(addr & 0xF0000)+2);
+            mem_page_bare(3, PAGE(addr & 0xF0000)+3);
+            DATA_INPUT;
+            MREQ_LO;
+            RD_LO;
+        }
+#endif
+        *hi = addr >> 8;
+        SET_ADDRHI(*hi & 0xFF);
+    }
+    SET_ADDRLO(addr & 0xFF);
+    return GET_DATA;
+}
+
+/**
+ * Search external memory for a pattern, returning the offset of the first
+ * match or len if there is none (bus must already be mastered)
+ */
+uint32_t mem_find_bare(uint32_t addr, uint32_t len, const uint8_t *pat, uint8_t plen)
+{
+    uint8_t skip[256];
+    uint8_t last = plen - 1;
+    uint32_t i = 0;
+    uint16_t hi;
+    uint8_t c, j;
+
+    if (plen == 0 || len < plen)
+        return len;
+
+    // Horspool shifts: how far the window can move given its last byte
+    if (plen >= FIND_SKIP_MIN) {
+        memset(skip, plen, sizeof skip);
+        for (j = 0; j < last; j++)
+            skip[pat[j]] = last - j;
+    }
+
+    addr += base_addr & 0xFC000;
+#ifdef PAGE_BASE
+    DATA_OUTPUT;
+    mem_page_bare(0, PAGE(addr & 0xF0000));
+    mem_page_bare(1, PAGE(addr & 0xF0000)+1);
+    mem_page_bare(2, PAGE(addr & 0xF0000)+2);
+    mem_page_bare(3, PAGE(addr & 0xF0000)+3);
+#endif
+    DATA_INPUT;
+    MREQ_LO;
+    RD_LO;
+    SET_ADDR(addr & 0xFFFF);
+    hi = addr >> 8;
+    while (i + last < len) {
+        c = find_peek(addr + i + last, &hi);
+        if (c == pat[last]) {
+            for (j = last; j > 0; j--)
+                if (find_peek(addr + i + j - 1, &hi) != pat[j - 1])
+                    break;
+            if (j == 0)
+                break;
+        }
+        i += plen >= FIND_SKIP_MIN ? skip[c] : 1;
+    }
+    RD_HI;
+    MREQ_HI;
+    return i + last < len ? i : len;
+}
+
+/**
+ * Search external memory for a pattern, returning the offset of the first
+ * match or len if there is none
+ */
+uint32_t mem_find(uint32_t addr, uint32_t len, const uint8_t *pat, uint8_t plen)
+{
+    if (!bus_master())
+        return len;
+    len = mem_find_bare(addr, len, pat, plen);
+    bus_slave();
+    return len;
+}
+
 /**
  * Output value to an IO register
  */
@@ -336,7 +619,8 @@ void sn76489_mute()
     if (!bus_master())
         return;
     uint8_t oldclkdiv = clkdiv;
-    clkdiv = 4;
+    if (clkdiv < SN76489_CLKDIV)
+        clkdiv = SN76489_CLKDIV;
     clk_run();
     DATA_OUTPUT;
     SET_ADDRLO(SN76489_PORT);
@@ -365,14 +649,33 @@ void sn76489_mute()
 }
 
 #ifdef PAGE_BASE
-#define PAGE_ENABLE (PAGE_BASE + 4)     // enable paging
-
 uint8_t mem_pages[] = {0, 0, 0, 0};
+uint8_t mem_paging = 0;
+
+/**
+ * Track a page register write made by the Z80, so mem_pages and mem_paging
+ * keep holding what is really in the registers
+ */
+void mem_page_seen(uint8_t reg, uint8_t value)
+{
+    if (reg < 4)
+        mem_pages[reg] = value & 0x3f;
+    else
+        mem_paging = value & 1;
+}
 
 void mem_page_bare(uint8_t bank, uint8_t page)
 {
+    bank &= 3;
+    page &= 0x3f;
+    // Within a session nothing else can change the page registers
+    if (bus_session && (mem_pages_valid & (1 << bank)) && mem_pages[bank] == page)
+        return;
     io_out_bare(PAGE_ENABLE, 1);
-    io_out_bare(PAGE_BASE + (bank & 3), page & 0x3f);
+    mem_paging = 1;
+    io_out_bare(PAGE_BASE + bank, page);
+    mem_pages[bank] = page;
+    mem_pages_valid |= (1 << bank);
 }
 
 /**
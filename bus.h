@@ -99,6 +99,16 @@
 #define MREQ_HI PORTB |= (1 << MREQ)
 #define MREQ_LO PORTB &= ~(1 << MREQ)
 
+// IORQ is PCINT9, so it can raise a pin change interrupt while the Z80 runs
+#define IORQ_PCMSK PCMSK1
+#define IORQ_PCINT PCINT9
+#define IORQ_PCIE PCIE1
+#define IORQ_PCIF PCIF1
+#define IORQ_vect PCINT1_vect
+#define IORQ_INT_ENABLE PCICR |= (1 << IORQ_PCIE)
+#define IORQ_INT_DISABLE PCICR &= ~(1 << IORQ_PCIE)
+#define IORQ_INT_CLEAR PCIFR = (1 << IORQ_PCIF)
+
 #define IORQ_OUTPUT DDRB |= (1 << IORQ)
 #define IORQ_HI PORTB |= (1 << IORQ)
 #define IORQ_LO PORTB &= ~(1 << IORQ)
@@ -142,6 +152,7 @@
 #define CTRLX_IODIR IODIRB0
 #define CTRLX_GPPU GPPUB0
 #define CTRLX_GPIO GPIOB0
+#define CTRLX_OLAT OLATB0
 
 #define RFSH 1
 #define RESET 2
@@ -150,6 +161,8 @@
 #define HALT 5
 #define NMI 7
 
+// Direction, pullup and output latch reads are served from the IOX shadow,
+// so each of the macros below that changes a line costs one SPI write.
 #define RFSH_INPUT iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) | (1 << RFSH))
 #define GET_RFSH (iox_read(0, CTRLX_GPIO) & (1 << RFSH))
 
@@ -157,16 +170,21 @@
 #define RESET_INPUT iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) | (1 << RESET))
 #define RESET_PULLUP iox_write(0, CTRLX_GPPU, iox_read(0, CTRLX_GPPU) | (1 << RESET))
 #define GET_RESET (iox_read(0, CTRLX_GPIO) & (1 << RESET))
-#define RESET_LO (iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_GPIO) & ~(1 << RESET)), iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) & ~(1 << RESET)))
-#define RESET_HI (iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) | (1 << RESET)), iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_GPIO) | (1 << RESET)))
+#define RESET_LO (iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_OLAT) & ~(1 << RESET)), iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) & ~(1 << RESET)))
+#define RESET_HI (iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) | (1 << RESET)), iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_OLAT) | (1 << RESET)))
 
 #define INT_OUTPUT iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) & ~(1 << INTERRUPT))
+#define INT_INPUT iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) | (1 << INTERRUPT))
 #define GET_INT (iox_read(0, CTRLX_GPIO) & (1 << INTERRUPT))
-#define INT_LO iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_GPIO) & ~(1 << INTERRUPT))
-#define INT_HI iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_GPIO) | (1 << INTERRUPT))
+#define INT_LO iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_OLAT) & ~(1 << INTERRUPT))
+#define INT_HI iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_OLAT) | (1 << INTERRUPT))
+
+#define XFLAGS_MASK ((1<<RFSH) | (1<<RESET) | (1<<INTERRUPT) | (1<<M1) | (1<<HALT) | (1<<NMI))
+#define GET_XFLAGS (iox_read(0, CTRLX_GPIO) & XFLAGS_MASK)
 
-#define GET_XFLAGS (iox_read(0, CTRLX_GPIO) & ((1<<RFSH) | (1<<RESET) | (1<<INTERRUPT) | \
-                                        (1<<M1) | (1<<HALT) | (1<<NMI)))
+// Address high byte in the low byte and control flags in the high byte,
+// fetched in one sequential expander transaction (GPIOA then GPIOB)
+#define GET_ADDRHI_XFLAGS iox_read16(0, ADDRHI_GPIO)
 
 #define M1_INPUT iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) | (1 << M1))
 #define GET_M1 (iox_read(0, CTRLX_GPIO) & (1 << M1))
@@ -177,8 +195,8 @@
 
 #define NMI_OUTPUT iox_write(0, CTRLX_IODIR, iox_read(0, CTRLX_IODIR) & ~(1 << NMI))
 #define GET_NMI (iox_read(0, CTRLX_GPIO) & (1 << NMI))
-#define NMI_LO iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_GPIO) & ~(1 << NMI))
-#define NMI_HI iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_GPIO) | (1 << NMI))
+#define NMI_LO iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_OLAT) & ~(1 << NMI))
+#define NMI_HI iox_write(0, CTRLX_GPIO, iox_read(0, CTRLX_OLAT) | (1 << NMI))
 
 /**
  * Complete bus status all in one place
@@ -197,28 +215,49 @@ extern uint32_t base_addr;
 
 void clk_cycle(uint8_t cycles);
 void clk_run(void);
+void clk_set(uint8_t div);
 void clk_stop(void);
 uint8_t bus_master(void);
 void bus_slave(void);
+uint8_t bus_begin(void);
+void bus_end(void);
 bus_stat bus_status(void);
 void bus_log(bus_stat status);
 void bus_init(void);
 
+void mem_read_bare(uint32_t addr, uint8_t * buf, uint16_t len);
 void mem_read(uint32_t addr, uint8_t * buf, uint16_t len);
+void _mem_write_bare(uint32_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspace);
 void _mem_write(uint32_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspace);
 
+#define mem_write_bare(addr, buf, len) _mem_write_bare((addr), (buf), (len), 0);
+
 #define mem_write(addr, buf, len) _mem_write((addr), (buf), (len), 0);
 #define mem_write_P(addr, buf, len) _mem_write((addr), (buf), (len), 1);
 
+void mem_fill_bare(uint32_t addr, uint32_t len, uint8_t value);
+void mem_fill(uint32_t addr, uint32_t len, uint8_t value);
+uint16_t mem_compare_bare(uint32_t addr, const uint8_t *buf, uint16_t len);
+uint16_t mem_compare(uint32_t addr, const uint8_t *buf, uint16_t len);
+uint32_t mem_find_bare(uint32_t addr, uint32_t len, const uint8_t *pat, uint8_t plen);
+uint32_t mem_find(uint32_t addr, uint32_t len, const uint8_t *pat, uint8_t plen);
+
 void io_out_bare(uint8_t addr, uint8_t value);
 void io_out(uint8_t addr, uint8_t value);
 uint8_t io_in_bare(uint8_t addr);
 uint8_t io_in(uint8_t addr);
 
+// Fastest clock divider at which the SN76489 latches writes
+#define SN76489_CLKDIV 4
+
 void sn76489_mute(void);
 
 #ifdef PAGE_BASE
 #define PAGE(addr) ((addr) >> 14)
+#define PAGE_ENABLE (PAGE_BASE + 4)     // enable paging
+extern uint8_t mem_pages[];
+extern uint8_t mem_paging;
+void mem_page_seen(uint8_t reg, uint8_t value);
 void mem_page_bare(uint8_t bank, uint8_t page);
 void mem_page(uint8_t bank, uint8_t page);
 #endif
@@ -39,17 +39,37 @@
 #include "diskemu.h"
 #include "sioemu.h"
 #include "diskio.h"
+#include "mmc_avr.h"
 #include "uart.h"
 #include "xmodem.h"
+#include "sched.h"
+#include "timer.h"
+#include "iorq.h"
+#include "bench.h"
+#include "clktune.h"
+#include "snapshot.h"
+#include "intctl.h"
 #ifdef DS1306_RTC
 #include "rtc.h"
 #endif
+#ifdef MSX_KEY_BASE
+#include "msxkey.h"
+#endif
+#ifdef PROFILE_SHIFT
+#include "profile.h"
+#endif
+#if defined(TRACE_LEN) || defined(TRACE_FILE)
+#include "trace.h"
+#endif
 #ifdef TMS_BASE
 #include "tms.h"
 #endif
 #ifdef SST_FLASH
 #include "flash.h"
 #endif
+#ifdef HOSTLINK
+#include "hostlink.h"
+#endif
 
 /**
  * SD card filesystem
@@ -68,7 +88,6 @@ FILE uart_str = FDEV_SETUP_STREAM(uart_putchar, uart_getchar, _FDEV_SETUP_RW);
 void cli_loadhex(int argc, char *argv[])
 {
     FIL fil;
-    FILE file;
     FRESULT fr;
     ihex_res result;
     if (argc < 2) {
@@ -77,9 +96,7 @@ void cli_loadhex(int argc, char *argv[])
     } else {
         printf_P(PSTR("loading from %s\n"), argv[1]);
         if ((fr = f_open(&fil, argv[1], FA_READ)) == FR_OK) {
-            fdev_setup_stream(&file, fatfs_putchar, fatfs_getchar, _FDEV_SETUP_RW);
-            fdev_set_udata(&file, &fil);
-            result = load_ihex(&file);
+            result = load_ihex_file(&fil);
             if ((fr = f_close(&fil)) != FR_OK)
                 printf_P(PSTR("error closing file: %S\n"), strlookup(fr_text, fr));
         } else {
@@ -87,7 +104,7 @@ void cli_loadhex(int argc, char *argv[])
             return;
         }        
     }
-    printf_P(PSTR("loaded %d bytes total from %04x-%04x"), result.total, result.min, result.max);
+    printf_P(PSTR("loaded %lu bytes total from %04lx-%04lx"), result.total, result.min, result.max);
     if (result.errors > 0)
         printf_P(PSTR(" with %d errors"), result.errors);
     printf_P(PSTR("\n"));
@@ -99,19 +116,25 @@ void cli_loadhex(int argc, char *argv[])
 void cli_savehex(int argc, char *argv[])
 {
     FRESULT fr;
-    FILE file;
     FIL fil;
+    uint8_t reclen = IHEX_RECLEN;
     if (argc < 3) {
-        printf_P(PSTR("usage: savehex <start> <end> [file]\n"));
+        printf_P(PSTR("usage: savehex <start> <end> [file [reclen]]\n"));
         return;
     }
     uint32_t start = strtoul(argv[1], NULL, 16) & 0xfffff;
     uint32_t end = strtoul(argv[2], NULL, 16) & 0xfffff;
-    if (argc == 4) {
+    if (argc >= 5) {
+        uint32_t len = strtoul(argv[4], NULL, 10);
+        if (len < 1 || len > 255) {
+            printf_P(PSTR("error: record length must be 1-255\n"));
+            return;
+        }
+        reclen = len;
+    }
+    if (argc >= 4) {
         if ((fr = f_open(&fil, argv[3], FA_WRITE | FA_CREATE_ALWAYS)) == FR_OK) {
-            fdev_setup_stream(&file, fatfs_putchar, fatfs_getchar, _FDEV_SETUP_RW);
-            fdev_set_udata(&file, &fil);
-            if (save_ihex(start, end, &file) == EOF)
+            if (save_ihex_file(start, end, reclen, &fil) == EOF)
                 printf_P(PSTR("error writing file"));
             if ((fr = f_close(&fil)) != FR_OK)
                 printf_P(PSTR("error closing file: %S\n"), strlookup(fr_text, fr));
@@ -119,7 +142,7 @@ void cli_savehex(int argc, char *argv[])
             printf_P(PSTR("error opening file: %S\n"), strlookup(fr_text, fr));
         }        
     } else {
-        if (save_ihex(start, end, stdout) == EOF)
+        if (save_ihex(start, end, reclen, stdout) == EOF)
             printf_P(PSTR("error writing file"));
     }
 }
@@ -154,13 +177,20 @@ void cli_loadbin(int argc, char *argv[])
     } else if ((fr = f_lseek(&fil, offset)) != FR_OK) {
         printf_P(PSTR("seek error: %S\n"), strlookup(fr_text, fr));
     } else {
+        if (!bus_begin()) {
+            f_close(&fil);
+            return;
+        }
         while ((fr = f_read(&fil, buf, 256, &br)) == FR_OK) {
             if (br > len)
                 br = len;
 #ifdef SST_FLASH
-            if (flash)
-                flash_write(start, buf, br);
-            else
+            if (flash) {
+                if (!flash_write(start, buf, br)) {
+                    printf_P(PSTR("error: programming %05lx timed out\n"), start);
+                    break;
+                }
+            } else
 #endif
 #ifdef TMS_BASE
             if (tms)
@@ -173,6 +203,7 @@ void cli_loadbin(int argc, char *argv[])
             start += br;
             len -= br;
         }
+        bus_end();
         if (fr != FR_OK)
             printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
     }
@@ -196,7 +227,138 @@ void cli_erase(int argc, char *argv[])
         addr = 0x80000;
     else
         addr = strtoul(argv[1], NULL, 16);
-    flash_erase(addr);
+    if (!flash_erase(addr))
+        printf_P(PSTR("error: flash erase timed out\n"));
+}
+
+/**
+ * Compare flash with part of a file, as flash_compare does
+ */
+static uint8_t reflash_compare(FIL *fil, uint32_t ofs, uint32_t addr, uint32_t n, uint8_t *buf, FRESULT *fr)
+{
+    uint8_t status = 0;
+    UINT br;
+
+    if ((*fr = f_lseek(fil, ofs)) != FR_OK)
+        return 0;
+    for (uint32_t i = 0; i < n && !(status & FLASH_ERASE); i += br) {
+        if ((*fr = f_read(fil, buf, n - i < 256 ? n - i : 256, &br)) != FR_OK || br == 0)
+            break;
+        status |= flash_compare(addr + i, buf, br);
+    }
+    return status;
+}
+
+/**
+ * Check whether a range of flash is erased
+ */
+static uint8_t reflash_blank(uint32_t addr, uint32_t len)
+{
+    uint8_t ff[64];
+
+    memset(ff, 0xff, sizeof ff);
+    for (uint32_t i = 0; i < len; i += sizeof ff)
+        if (flash_compare(addr + i, ff, len - i < sizeof ff ? len - i : sizeof ff))
+            return 0;
+    return 1;
+}
+
+/**
+ * Flash a file to ROM, erasing and programming only the sectors that differ
+ *
+ * A sector the image covers only partly is erased only if its other bytes
+ * are already blank; otherwise nothing is written.
+ */
+void cli_reflash(int argc, char *argv[])
+{
+    FIL fil;
+    FRESULT fr;
+    UINT br;
+    uint8_t buf[256];
+    uint32_t offset = 0;
+    uint32_t len = 0x100000;
+    uint32_t addr, end, n, i;
+    uint16_t same = 0, programmed = 0, erased = 0;
+    uint8_t status;
+    if (argc < 3) {
+        printf_P(PSTR("usage: reflash <start addr> <filename> [offset] [length]\n"));
+        return;
+    }
+    uint32_t start = strtoul(argv[1], NULL, 16);
+    if (argc >= 4)
+        offset = strtoul(argv[3], NULL, 16);
+    if (argc >= 5)
+        len = strtoul(argv[4], NULL, 16);
+    if ((fr = f_open(&fil, argv[2], FA_READ)) != FR_OK) {
+        printf_P(PSTR("error opening file: %S\n"), strlookup(fr_text, fr));
+        return;
+    }
+    if (offset > f_size(&fil))
+        offset = f_size(&fil);
+    if (len > f_size(&fil) - offset)
+        len = f_size(&fil) - offset;
+    if (!bus_begin()) {
+        f_close(&fil);
+        return;
+    }
+    end = start + len;
+    // Refuse before writing anything if erasing a partial sector at either end would lose data
+    for (i = 0; i < 2 && len; i++) {
+        uint32_t sector = (i ? end - 1 : start) & ~(uint32_t)(FLASH_SECTOR - 1);
+        uint32_t lo = sector > start ? sector : start;
+        uint32_t hi = sector + FLASH_SECTOR < end ? sector + FLASH_SECTOR : end;
+        if (hi - lo < FLASH_SECTOR
+                && (reflash_compare(&fil, offset + lo - start, lo, hi - lo, buf, &fr) & FLASH_ERASE)
+                && !(reflash_blank(sector, lo - sector) && reflash_blank(hi, sector + FLASH_SECTOR - hi))) {
+            printf_P(PSTR("error: sector %05lx needs erasing but holds data outside the image\n"), sector);
+            bus_end();
+            f_close(&fil);
+            return;
+        }
+    }
+    for (addr = start; addr < end && fr == FR_OK; addr += n) {
+        // Bytes of the image within this sector
+        n = (addr | (FLASH_SECTOR - 1)) + 1 - addr;
+        if (n > end - addr)
+            n = end - addr;
+
+        // Find out whether the sector needs programming and erasing
+        status = reflash_compare(&fil, offset + addr - start, addr, n, buf, &fr);
+        if (fr != FR_OK)
+            break;
+        if (!status) {
+            same++;
+            continue;
+        }
+        if (status & FLASH_ERASE) {
+            if (!flash_erase(addr)) {
+                printf_P(PSTR("error: erasing sector %05lx timed out\n"), addr & ~(uint32_t)(FLASH_SECTOR - 1));
+                break;
+            }
+            erased++;
+        }
+
+        // Program the bytes that differ
+        if ((fr = f_lseek(&fil, offset + addr - start)) != FR_OK)
+            break;
+        for (i = 0; i < n; i += br) {
+            if ((fr = f_read(&fil, buf, n - i < sizeof buf ? n - i : sizeof buf, &br)) != FR_OK || br == 0)
+                break;
+            if (!flash_write_diff(addr + i, buf, br)) {
+                printf_P(PSTR("error: programming %05lx timed out\n"), addr + i);
+                break;
+            }
+        }
+        if (i < n)
+            break;
+        programmed++;
+    }
+    bus_end();
+    if (fr != FR_OK)
+        printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
+    printf_P(PSTR("%u sectors unchanged, %u programmed, %u erased\n"), same, programmed, erased);
+    if ((fr = f_close(&fil)) != FR_OK)
+        printf_P(PSTR("error closing file: %S\n"), strlookup(fr_text, fr));
 }
 #endif
 
@@ -218,6 +380,13 @@ void cli_savebin(int argc, char *argv[])
     uint32_t start = strtoul(argv[1], NULL, 16) & 0xfffff;
     uint32_t end = strtoul(argv[2], NULL, 16) & 0xfffff;
     if ((fr = f_open(&fil, argv[3], FA_WRITE | FA_CREATE_ALWAYS)) == FR_OK) {
+        // Allocate the file up front so the card can take it as one multi-block write
+        if (start <= end && f_lseek(&fil, end - start + 1) == FR_OK && f_lseek(&fil, 0) == FR_OK)
+            fatfs_preerase(&fil, end - start + 1);
+        if (!bus_begin()) {
+            f_close(&fil);
+            return;
+        }
         while (start <= end) {
             if (end - start + 1 < len)
                 len = end - start + 1;
@@ -228,6 +397,7 @@ void cli_savebin(int argc, char *argv[])
             }
             start += len;
         }
+        bus_end();
         if ((fr = f_close(&fil)) != FR_OK)
             printf_P(PSTR("error closing file: %S\n"), strlookup(fr_text, fr));
     } else {
@@ -236,7 +406,7 @@ void cli_savebin(int argc, char *argv[])
 }
 
 /**
- * Receive a file via xmodem
+ * Receive a file via xmodem to disk, or directly to memory or flash
  */
 void cli_xmrx(int argc, char *argv[])
 {
@@ -244,8 +414,29 @@ void cli_xmrx(int argc, char *argv[])
     FILE file;
     FIL fil;
     UINT bw;
-    if (argc < 2) {
-        printf_P(PSTR("usage: xmrx <file>\n"));
+    if (argc == 3 && strcmp_P(argv[1], PSTR("mem")) == 0) {
+        xm_receive_mem(strtoul(argv[2], NULL, 16) & 0xfffff, XM_MEM);
+        return;
+    }
+#ifdef SST_FLASH
+    if (argc == 3 && strcmp_P(argv[1], PSTR("flash")) == 0) {
+        uint32_t addr = strtoul(argv[2], NULL, 16) & 0xfffff;
+        // Sectors are erased as the data reaches them, so none may be shared with other contents
+        if (addr & (FLASH_SECTOR - 1)) {
+            printf_P(PSTR("error: flash address must be a multiple of %u\n"), FLASH_SECTOR);
+            return;
+        }
+        if (xm_receive_mem(addr, XM_FLASH) == -5)
+            printf_P(PSTR("error: flash timed out\n"));
+        return;
+    }
+#endif
+    if (argc != 2) {
+        printf_P(PSTR("usage: xmrx <file> | mem <addr>"
+#ifdef SST_FLASH
+            " | flash <addr>"
+#endif
+            "\n"));
         return;
     }
     char *filename =  argv[1];
@@ -282,6 +473,30 @@ void cli_xmtx(int argc, char *argv[])
         printf_P(PSTR("error closing file: %S\n"), strlookup(fr_text, fr));
 }
 
+/**
+ * Receive a batch of files via ymodem, streaming if the sender supports ymodem-g
+ */
+void cli_ymrx(int argc, char *argv[])
+{
+    if (argc > 1) {
+        printf_P(PSTR("usage: ymrx\n"));
+        return;
+    }
+    ym_receive();
+}
+
+/**
+ * Transmit a batch of files via ymodem, streaming if the receiver supports ymodem-g
+ */
+void cli_ymtx(int argc, char *argv[])
+{
+    if (argc < 2) {
+        printf_P(PSTR("usage: ymtx <file> [file...]\n"));
+        return;
+    }
+    ym_transmit(argc - 1, &argv[1]);
+}
+
 /**
  * Disassemble code from memory
  */
@@ -321,9 +536,17 @@ void cli_dump(int argc, char *argv[])
     uint8_t buflen = 16;
     uint32_t i = start;
     uint8_t j;
+    char line[80];
+    char *p;
 
+    if (!bus_begin())
+        return;
     while (i <= end) {
-        printf_P(PSTR("%05lX   "), base_addr + i);
+        p = fmt_HEX(line, (base_addr + i) >> 16, 1);
+        p = fmt_HEX(p, base_addr + i, 4);
+        *p++ = ' ';
+        *p++ = ' ';
+        *p++ = ' ';
 #ifdef TMS_BASE
         if (tms)
             tms_read(i, buf, buflen);
@@ -331,19 +554,23 @@ void cli_dump(int argc, char *argv[])
 #endif
             mem_read(i, buf, buflen);
         for (j = 0; j < buflen; j++) {
-            printf_P(PSTR("%02X "), buf[j]);
+            p = fmt_HEX(p, buf[j], 2);
+            *p++ = ' ';
             if (j % 4 == 3)
-                printf_P(PSTR(" "));
+                *p++ = ' ';
         }
-        printf_P(PSTR(" "));
+        *p++ = ' ';
         for (j = 0; j < buflen; j++, i++) {
             if (0x20 <= buf[j] && buf[j] <= 0x7e)
-                printf_P(PSTR("%c"), buf[j]);
+                *p++ = buf[j];
             else
-                printf_P(PSTR("."));
+                *p++ = '.';
         }
-        printf_P(PSTR("\n"));
+        *p++ = '\r';
+        *p++ = '\n';
+        uart_write(0, (uint8_t *)line, p - line);
     }
+    bus_end();
 }
 
 /**
@@ -394,19 +621,71 @@ void cli_step(int argc, char *argv[])
 }
 
 /**
- * Reduce the Z80 clock speed by the specified factor
+ * Run the processor at full speed for an exact number of clock cycles
  */
-void cli_clkdiv(int argc, char *argv[])
+void cli_cycles(int argc, char *argv[])
 {
-    uint8_t tmp = 0;
-    if (argc >= 2)
-        tmp = strtoul(argv[1], NULL, 10);
-    if (tmp > 1)
-        clkdiv = tmp;
+    if (argc != 2) {
+        printf_P(PSTR("usage: cycles <count>\n"));
+        return;
+    }
+    uint32_t cycles = strtoul(argv[1], NULL, 10);
+    uint32_t done = z80_run_cycles(cycles);
+    printf_P(PSTR("ran %lu cycles\n"), done);
+    if (done > cycles)
+        printf_P(PSTR("warning: overran by %lu cycles during an IO request\n"), done - cycles);
+}
+
+/**
+ * Run the processor at full speed until it fetches an opcode at an address
+ */
+void cli_until(int argc, char *argv[])
+{
+    if (argc != 2) {
+        printf_P(PSTR("usage: until <addr>\n"));
+        return;
+    }
+    uint16_t addr = strtoul(argv[1], NULL, 16);
+    if (z80_run_until(addr))
+        printf_P(PSTR("reached %04x\n"), addr);
     else
-        printf_P(PSTR("usage: clkdiv <divider>; minimum divider is 2\n"));
+        printf_P(PSTR("break\n"));
+}
+
+/**
+ * Reduce the Z80 clock speed by the specified factor, find the fastest
+ * reliable one, or set the slower clock used while a device is accessed
+ */
+void cli_clkdiv(int argc, char *argv[])
+{
+    uint32_t tmp = 0;
+    if (argc == 3) {
+        uint8_t dev = iorq_find(argv[1]);
+        if (dev == IORQ_NONE) {
+            printf_P(PSTR("error: unknown device %s\n"), argv[1]);
+            return;
+        }
+        tmp = strtoul(argv[2], NULL, 10);
+        if (tmp == 1 || tmp > 255) {
+            printf_P(PSTR("error: device divider must be 2-255, or 0 for none\n"));
+            return;
+        }
+        iorq_devices[dev].clkdiv = tmp;
+    } else if (argc == 2 && strcmp_P(argv[1], PSTR("auto")) == 0) {
+        clk_tune();
+    } else {
+        if (argc >= 2)
+            tmp = strtoul(argv[1], NULL, 10);
+        if (tmp > 1 && tmp <= 255)
+            clkdiv = tmp;
+        else
+            printf_P(PSTR("usage: clkdiv <divider> | auto | <device> <divider>; divider is 2-255\n"));
+    }
     uint16_t freq = F_CPU / clkdiv / 1000;
     printf_P(PSTR("current speed is %u.%03u MHz (clkdiv=%d)\n"), freq/1000, freq-(freq/1000)*1000, clkdiv);
+    for (uint8_t i = 0; i < iorq_ndevices; i++)
+        if (iorq_devices[i].clkdiv)
+            printf_P(PSTR("%S accessed at clkdiv=%d\n"), iorq_devices[i].name, iorq_devices[i].clkdiv);
 }
 
 /**
@@ -414,65 +693,138 @@ void cli_clkdiv(int argc, char *argv[])
  */
 void cli_breakwatch(int argc, char *argv[])
 {
-    range *ranges;
-    uint8_t type;
+    debug_set *sets;
+    uint8_t type, i;
+    char **args = argv + 1;
+    uint8_t nargs = argc - 1;
+    uint8_t del = 0;
 
     if (strcmp_P(argv[0], PSTR("break")) == 0)
-        ranges = breaks;
+        sets = breaks;
     else
-        ranges = watches;
-    
+        sets = watches;
+
     // If no parameters given, show current status
-    if (argc == 1) {
+    if (argc == 1 || (argc == 2 && strcmp_P(argv[1], PSTR("list")) == 0)) {
         printf_P(PSTR("%s status:\n"), argv[0]);
-        for (uint8_t i = 0; i < DEBUGCNT; i++) {
-            if (!ENABLED(ranges, i))
-                printf_P(PSTR("\t%S\tdisabled\n"), strlookup(debug_names, i));
-            else
-                printf_P(PSTR("\t%S\t%04x-%04x\n"), strlookup(debug_names, i), ranges[i].start, ranges[i].end);
+        for (type = 0; type < DEBUGCNT; type++) {
+            if (!ENABLED(sets, type))
+                printf_P(PSTR("\t%S\tdisabled\n"), strlookup(debug_names, type));
+            for (i = 0; i < sets[type].count; i++)
+                printf_P(PSTR("\t%S\t%04x-%04x\n"), strlookup(debug_names, type), 
+                    sets[type].ranges[i].start, sets[type].ranges[i].end);
+        }
+        if (argc == 1) {
+            printf_P(PSTR("\nusage:\n\t%s [add] <type> [start] [end]\n"), argv[0]);
+            printf_P(PSTR("\t%s del <type> [start] to delete one or all of type\n"), argv[0]);
+            printf_P(PSTR("\t%s <type> off to disable type\n"), argv[0]);
+            printf_P(PSTR("\t%s off to disable all\n"), argv[0]);
+            printf_P(PSTR("\t%s list to show ranges\n"), argv[0]);
+            printf_P(PSTR("\tup to %d ranges per type\n"), DEBUG_RANGES);
         }
-        printf_P(PSTR("\nusage:\n\t%s <type> [start] [end]\n"), argv[0]);
-        printf_P(PSTR("\t%s <type> off to disable type\n"), argv[0]);
-        printf_P(PSTR("\t%s off to disable all\n"), argv[0]);
         return;
     }
     if (strcmp_P(argv[1], PSTR("off")) == 0) {
         // turn off all ranges
-        for (uint8_t i = 0; i < DEBUGCNT; i++) {
-            ranges[i].start = 0xffff;
-            ranges[i].end = 0;
-        }
+        for (type = 0; type < DEBUGCNT; type++)
+            debug_clear(sets, type);
+        return;
+    }
+    if (strcmp_P(args[0], PSTR("add")) == 0) {
+        args++;
+        nargs--;
+    } else if (strcmp_P(args[0], PSTR("del")) == 0) {
+        args++;
+        nargs--;
+        del = 1;
+    }
+    if (nargs == 0) {
+        printf_P(PSTR("error: missing type\n"));
         return;
+    }
+    // find the debugging type that the user specified
+    for (type = 0; type < DEBUGCNT; type++)
+        if (strcmp_P(args[0], strlookup(debug_names, type)) == 0)
+            break;
+    if (type == DEBUGCNT) {
+        printf_P(PSTR("error: unknown type\n"));
+        return;
+    }
+    if (nargs >= 2 && strcmp_P(args[1], PSTR("off")) == 0) {
+        debug_clear(sets, type);
+    } else if (del) {
+        if (nargs == 1)
+            debug_clear(sets, type);
+        else if (!debug_del(sets, type, strtoul(args[1], NULL, 16)))
+            printf_P(PSTR("error: no range starts at %s\n"), args[1]);
     } else {
-        // find the debugging type that the user specified
-        for (type = 0; type < DEBUGCNT; type++)
-            if (strcmp_P(argv[1], strlookup(debug_names, type)) == 0)
-                break;
-        if (type == DEBUGCNT) {
-            printf_P(PSTR("error: unknown type\n"));
-            return;
+        uint16_t start = 0, end = 0xffff;
+        if (nargs >= 2) {
+            // get starting address; if no ending address, start and end are the same
+            start = end = strtoul(args[1], NULL, 16);
+            if (nargs >= 3)
+                end = strtoul(args[2], NULL, 16);
         }
-        if (argc == 2) {
-            // no range specified, enable for 0x0000-0xffff
-            ranges[type].start = 0;
-            ranges[type].end = 0xffff;
-        } else if (argc >= 3) {
-            if (strcmp_P(argv[2], PSTR("off")) == 0) {
-                ranges[type].start = 0xffff;
-                ranges[type].end = 0;
-            } else {
-                // get starting address
-                ranges[type].start = strtoul(argv[2], NULL, 16);
-                if (argc >= 4)
-                    // get ending address if specified
-                    ranges[type].end = strtoul(argv[3], NULL, 16);
-                else
-                    // if no ending address, start and end are the same
-                    ranges[type].end = ranges[type].start;
-            }
+        if (end < start) {
+            uint16_t tmp = start;
+            start = end;
+            end = tmp;
         }
+        if (!debug_add(sets, type, start, end))
+            printf_P(PSTR("error: too many ranges\n"));
+    }
+}
+
+#ifdef TRACE_LEN
+/**
+ * Capture bus cycles matched by watches in RAM, or print the captured trace
+ */
+void cli_trace(int argc, char *argv[])
+{
+    if (argc == 1) {
+        trace_print();
+    } else if (strcmp_P(argv[1], PSTR("on")) == 0) {
+        uint16_t pre = TRACE_LEN, post = 0;
+        if (argc >= 3)
+            pre = strtoul(argv[2], NULL, 10);
+        if (argc >= 4)
+            post = strtoul(argv[3], NULL, 10);
+        trace_start(pre, post);
+    } else if (strcmp_P(argv[1], PSTR("off")) == 0) {
+        trace_capture = 0;
+    } else {
+        printf_P(PSTR("usage: trace [on [pre] [post] | off]\n"));
+        printf_P(PSTR("\tcapture up to %u watched cycles; a breakpoint triggers\n"), TRACE_LEN);
+    }
+}
+#endif
+
+#ifdef TRACE_FILE
+/**
+ * Stream executed instructions to a file, or disassemble a recorded trace;
+ * the file is closed when the next debug or step run ends
+ */
+void cli_itrace(int argc, char *argv[])
+{
+    FRESULT fr;
+    if (argc >= 3 && strcmp_P(argv[1], PSTR("show")) == 0) {
+        uint32_t skip = 0, count = 0;
+        if (argc >= 4)
+            skip = strtoul(argv[3], NULL, 10);
+        if (argc >= 5)
+            count = strtoul(argv[4], NULL, 10);
+        itrace_show(argv[2], skip, count);
+    } else if (argc == 2 && strcmp_P(argv[1], PSTR("off")) == 0) {
+        itrace_close();
+    } else if (argc == 2 || (argc == 3 && strcmp_P(argv[2], PSTR("flags")) == 0)) {
+        itrace_close();
+        if ((fr = itrace_open(argv[1], argc == 3)) != FR_OK)
+            printf_P(PSTR("error opening file: %S\n"), strlookup(fr_text, fr));
+    } else {
+        printf_P(PSTR("usage: itrace <file> [flags] | off | show <file> [skip] [count]\n"));
     }
 }
+#endif
 
 /**
  * Show a directory of files on the SD Card
@@ -521,23 +873,27 @@ void cli_dir(int argc, char *argv[])
  */
 int verify_mem(uint16_t start, uint16_t end, uint8_t *src, uint8_t log)
 {
-    uint8_t buf[256];
     int errors = 0;
-    uint16_t j = 0, buflen = 256;
+    uint16_t len, ofs;
     uint32_t i = start;
+    uint8_t value;
 
+    if (!bus_begin())
+        return -1;
     while (i <= end) {
-        if (end - i + 1 < buflen)
-            buflen = end - i + 1;
-        mem_read(start, buf, buflen);
-        for (j = 0; j < buflen; i++, j++) {
-            if (buf[j] != src[i]) {
-                if (log)
-                    printf_P(PSTR("%04x: expected %02x but read %02x\n"), start+i, src[i], buf[j]);
-                errors++;
-            }
+        len = end - i < 0x8000 ? end - i + 1 : 0x8000;
+        ofs = mem_compare(i, &src[i - start], len);
+        i += ofs;
+        if (ofs == len)
+            continue;
+        if (log) {
+            mem_read(i, &value, 1);
+            printf_P(PSTR("%04lx: expected %02x but read %02x\n"), i, src[i - start], value);
         }
+        errors++;
+        i++;
     }
+    bus_end();
     return errors;
 }
 
@@ -553,6 +909,10 @@ void cli_fill(int argc, char*argv[]) {
     uint32_t start = strtoul(argv[1], NULL, 16) & 0xfffff;
     uint32_t end = strtoul(argv[2], NULL, 16) & 0xfffff;
     uint8_t buf[256];
+    if (end < start) {
+        printf_P(PSTR("error: end is before start\n"));
+        return;
+    }
     if (strcmp_P(argv[3], PSTR("asc")) == 0) {
         for (uint16_t i = 0; i < 256; i++)
             buf[i] = i;
@@ -561,10 +921,20 @@ void cli_fill(int argc, char*argv[]) {
             buf[i] = 255 - i;
     } else {
         uint8_t value = strtoul(argv[3], NULL, 16) & 0xff;
+#ifdef TMS_BASE
+        if (!tms) {
+#endif
+            mem_fill(start, end - start + 1, value);
+            return;
+#ifdef TMS_BASE
+        }
+#endif
         for (uint16_t i = 0; i < 256; i++)
             buf[i] = value;
     }
     
+    if (!bus_begin())
+        return;
     for (;;) {
         if (end - start > 256) {
 #ifdef TMS_BASE
@@ -584,6 +954,56 @@ void cli_fill(int argc, char*argv[]) {
             break;
         }
     }
+    bus_end();
+}
+
+/**
+ * Search memory for a byte sequence or quoted string and print matching addresses
+ */
+void cli_find(int argc, char *argv[])
+{
+    uint8_t pat[64];
+    uint8_t plen = 0;
+    uint32_t ofs;
+
+    if (argc < 4) {
+        printf_P(PSTR("usage: find <start> <end> <bytes...|\"string\">\n"));
+        return;
+    }
+    uint32_t start = strtoul(argv[1], NULL, 16) & 0xfffff;
+    uint32_t end = strtoul(argv[2], NULL, 16) & 0xfffff;
+    if (argv[3][0] == '"') {
+        // The tokenizer split the string on whitespace, so put single spaces back
+        for (uint8_t i = 3; i < argc; i++) {
+            char *s = argv[i] + (i == 3);
+            if (i > 3 && plen < sizeof pat)
+                pat[plen++] = ' ';
+            while (*s && plen < sizeof pat)
+                pat[plen++] = *s++;
+        }
+        if (plen > 0 && pat[plen - 1] == '"')
+            plen--;
+    } else {
+        for (uint8_t i = 3; i < argc && plen < sizeof pat; i++)
+            pat[plen++] = strtoul(argv[i], NULL, 16) & 0xff;
+    }
+    if (plen == 0 || end < start) {
+        printf_P(PSTR("nothing to find\n"));
+        return;
+    }
+
+    if (!bus_begin())
+        return;
+    while (end - start + 1 >= plen) {
+        ofs = mem_find(start, end - start + 1, pat, plen);
+        if (ofs > end - start)
+            break;
+        printf_P(PSTR("%05lX\n"), base_addr + start + ofs);
+        if (start + ofs == end)
+            break;
+        start += ofs + 1;
+    }
+    bus_end();
 }
 
 /**
@@ -705,10 +1125,13 @@ void cli_base(int argc, char *argv[])
  */
 void cli_boot(int argc, char*argv[])
 {
-    if (argc == 2) {
-        drive_mount(0, argv[1]);
+    uint16_t end = 0;
+    if (argc >= 2) {
+        drive_mount(0, argv[1], 0);
     }
-    if(drive_bootload()) {
+    if (argc >= 3)
+        end = strtoul(argv[2], NULL, 16);
+    if(drive_bootload(end)) {
         z80_reset(0);
         z80_run();
     }
@@ -727,13 +1150,31 @@ void cli_bus(int argc, char *argv[])
  */
 void cli_mount(int argc, char *argv[])
 {
+    uint8_t flags = 0;
+    while (argc > 1 && argv[1][0] == '-') {
+#if DISK_RAM_SIZE > 0
+        if (strcmp_P(argv[1], PSTR("-ram")) == 0)
+            flags |= MOUNT_RAM;
+        else
+#endif
+        if (strcmp_P(argv[1], PSTR("-hd")) == 0)
+            flags |= MOUNT_HD512;
+        else
+            break;
+        argc--;
+        argv++;
+    }
     if (argc != 3) {
-        printf_P(PSTR("usage: mount <drive #> <filename>\n"));
+#if DISK_RAM_SIZE > 0
+        printf_P(PSTR("usage: mount [-ram] [-hd] <drive #> <filename>\n"));
+#else
+        printf_P(PSTR("usage: mount [-hd] <drive #> <filename>\n"));
+#endif
         return;
     }
     uint8_t drv = strtoul(argv[1], NULL, 10);
     char *filename = argv[2];
-    drive_mount(drv, filename);
+    drive_mount(drv, filename, flags);
 }
 
 /**
@@ -749,6 +1190,147 @@ void cli_unmount(int argc, char *argv[])
     drive_unmount(drv);
 }
 
+/**
+ * Display or clear disk sector cache statistics
+ */
+void cli_dcache(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp_P(argv[1], PSTR("clear")) == 0) {
+        drive_cache_hits = drive_cache_misses = 0;
+        return;
+    } else if (argc != 1) {
+        printf_P(PSTR("usage: dcache [clear]\n"));
+        return;
+    }
+    uint32_t total = drive_cache_hits + drive_cache_misses;
+    printf_P(PSTR("%d sectors cached, %lu hits, %lu misses"), DISK_CACHE_SECTORS, drive_cache_hits, drive_cache_misses);
+    if (total)
+        printf_P(PSTR(" (%lu%% hit rate)"), drive_cache_hits * 100 / total);
+    printf_P(PSTR("\n"));
+}
+
+#ifdef IORQ_STATS
+/**
+ * Display or reset IO request statistics
+ */
+void cli_stats(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp_P(argv[1], PSTR("reset")) == 0) {
+        iorq_stats_reset();
+        return;
+    } else if (argc != 1) {
+        printf_P(PSTR("usage: stats [reset]\n"));
+        return;
+    }
+    printf_P(PSTR("port      reads     writes\n"));
+    for (uint16_t i = 0; i < 256; i++)
+        if (iorq_reads[i] || iorq_writes[i])
+            printf_P(PSTR("%02X  %10lu %10lu\n"), i, iorq_reads[i], iorq_writes[i]);
+    printf_P(PSTR("\ndevice    count    avg us    max us\n"));
+    for (uint8_t i = 0; i <= IORQ_DEVICES; i++) {
+        iorq_dev_stat *s = &iorq_dev_stats[i];
+        if (!s->count)
+            continue;
+        printf_P(PSTR("%-6S %8lu %9lu %9lu\n"), i < iorq_ndevices ? iorq_devices[i].name : PSTR("other"), s->count,
+            timer_us(s->total / s->count), timer_us(s->max));
+        printf_P(PSTR("       "));
+        for (uint8_t j = 0; j < IORQ_HIST_BUCKETS; j++) {
+            if (j < IORQ_HIST_BUCKETS - 1)
+                printf_P(PSTR("<%u:%lu "), pgm_read_word(&iorq_hist_us[j]), s->hist[j]);
+            else
+                printf_P(PSTR(">=%u:%lu\n"), pgm_read_word(&iorq_hist_us[j-1]), s->hist[j]);
+        }
+    }
+}
+#endif
+
+/**
+ * List emulated IO devices or move one to a new base port
+ */
+void cli_ports(int argc, char *argv[])
+{
+    if (argc == 3) {
+        uint8_t dev = iorq_find(argv[1]);
+        if (dev == IORQ_NONE) {
+            printf_P(PSTR("error: unknown device %s\n"), argv[1]);
+            return;
+        }
+        if (!iorq_map(dev, strtoul(argv[2], NULL, 16)))
+            printf_P(PSTR("error: ports in use\n"));
+    } else if (argc != 1) {
+        printf_P(PSTR("usage: ports [<device> <base>]\n"));
+        return;
+    }
+    for (uint8_t i = 0; i < iorq_ndevices; i++) {
+        iorq_device *d = &iorq_devices[i];
+        printf_P(PSTR("%-6S %02X-%02X%S\n"), d->name, d->base, d->base + d->count - 1,
+            iorq_ports[d->base] == i + 1 ? PSTR("") : PSTR(" (unmapped)"));
+    }
+}
+
+#ifdef PROFILE_SHIFT
+/**
+ * Enable, disable or report PC sampling during full-speed runs
+ */
+void cli_profile(int argc, char *argv[])
+{
+    if (argc == 2 && strcmp_P(argv[1], PSTR("on")) == 0) {
+        profile_clear();
+        profile_on = 1;
+    } else if (argc == 2 && strcmp_P(argv[1], PSTR("off")) == 0) {
+        profile_on = 0;
+    } else if (argc == 2 && strcmp_P(argv[1], PSTR("clear")) == 0) {
+        profile_clear();
+    } else if (argc <= 3 && (argc < 3 || strcmp_P(argv[2], PSTR("disasm")) == 0)) {
+        uint8_t top = 10;
+        if (argc >= 2)
+            top = strtoul(argv[1], NULL, 10);
+        profile_print(top, argc == 3);
+    } else {
+        printf_P(PSTR("usage: profile [on | off | clear | <top> [disasm]]\n"));
+    }
+}
+#endif
+
+#ifdef PAGE_BASE
+/**
+ * Save, update, or restore a snapshot of paged memory
+ */
+void cli_snapshot(int argc, char *argv[])
+{
+    if (argc == 3 && strcmp_P(argv[1], PSTR("save")) == 0) {
+        snapshot_save(argv[2], 0);
+    } else if (argc == 3 && strcmp_P(argv[1], PSTR("update")) == 0) {
+        snapshot_save(argv[2], 1);
+    } else if (argc == 3 && strcmp_P(argv[1], PSTR("load")) == 0) {
+        snapshot_load(argv[2]);
+    } else {
+        printf_P(PSTR("usage: snapshot save | update | load <file>\n"));
+    }
+}
+#endif
+
+/**
+ * Run the throughput benchmarks
+ */
+void cli_bench(int argc, char *argv[])
+{
+    if (argc > 2) {
+        printf_P(PSTR("usage: bench [file]\n"));
+        return;
+    }
+    bench_run(argc == 2 ? argv[1] : NULL);
+}
+
+/**
+ * Write pending disk image changes to the SD card
+ */
+void cli_sync(int argc, char *argv[])
+{
+    drive_writeback(0xff);
+    drive_sync();
+}
+
 /**
  * Display or set the date on the RTC
  */
@@ -815,6 +1397,25 @@ void cli_baud(int argc, char *argv[]) {
     uart_init(uart, ubrr);
 }
 
+#ifdef HOSTLINK
+/**
+ * Hand a UART over to the binary host link protocol
+ */
+void cli_hostlink(int argc, char *argv[])
+{
+    uint8_t uart = argc >= 2 ? strtoul(argv[1], NULL, 10) & 1 : 0;
+#ifdef UART_FLOW
+    if (uart == 1) {
+        printf_P(PSTR("error: UART 1 pins are used for flow control\n"));
+        return;
+    }
+#endif
+    printf_P(PSTR("host link on UART %u; Ctrl-] to exit\n"), uart);
+    uart_flush();
+    hostlink(uart);
+}
+#endif
+
 /**
  * Enable or disable halt
  */
@@ -892,15 +1493,18 @@ const char cli_cmd_names[] PROGMEM =
     "base\0"
 #endif
     "baud\0"
+    "bench\0"
     "boot\0"
     "bus\0"
     "break\0"
     "c\0"
     "clkdiv\0"
     "cls\0"
+    "cycles\0"
 #ifdef DS1306_RTC
     "date\0"
 #endif
+    "dcache\0"
     "debug\0"
     "dir\0"
     "disasm\0"
@@ -910,12 +1514,19 @@ const char cli_cmd_names[] PROGMEM =
     "erase\0"
 #endif
     "fill\0"
+    "find\0"
 #ifdef SST_FLASH
     "flash\0"
 #endif
     "halt\0"
     "help\0"
+#ifdef HOSTLINK
+    "hostlink\0"
+#endif
     "in\0"
+#ifdef TRACE_FILE
+    "itrace\0"
+#endif
     "ioxread\0"
     "ioxwrite\0"
     "loadbin\0"
@@ -923,21 +1534,41 @@ const char cli_cmd_names[] PROGMEM =
     "mount\0"
     "out\0"
     "poke\0"
+    "ports\0"
+#ifdef PROFILE_SHIFT
+    "profile\0"
+#endif
+#ifdef SST_FLASH
+    "reflash\0"
+#endif
     "run\0"
     "reset\0"
     "savebin\0"
     "savehex\0"
     "s\0"
+#ifdef PAGE_BASE
+    "snapshot\0"
+#endif
+#ifdef IORQ_STATS
+    "stats\0"
+#endif
     "step\0"
+    "sync\0"
 #ifdef TMS_BASE
     "tmsdump\0"
     "tmsfill\0"
     "tmslbin\0"
+#endif
+#ifdef TRACE_LEN
+    "trace\0"
 #endif
     "unmount\0"
+    "until\0"
     "watch\0"
     "xmrx\0"
-    "xmtx";
+    "xmtx\0"
+    "ymrx\0"
+    "ymtx";
 
 /**
  * Lookup table of help text for monitor commands
@@ -948,15 +1579,18 @@ const char cli_cmd_help[] PROGMEM =
     "set the base memory address\0"                 // base
 #endif
     "configure UART baud rate\0"                    // baud
-    "boot from specified disk image\0"              // boot
+    "run throughput benchmarks\0"                   // bench
+    "boot from disk image, loading below end\0"     // boot
     "display low-level bus status\0"                // bus
     "set breakpoints\0"                             // break
     "shorthand to continue debugging\0"             // c
-    "set Z80 clock divider\0"                       // clkdiv
+    "set or auto-tune Z80 clock divider\0"          // clkdiv
     "clear screen\0"                                // cls
+    "run for a number of clock cycles\0"            // cycles
 #ifdef DS1306_RTC
     "display or set the date on the rtc\0"          // date
 #endif
+    "show or clear disk cache statistics\0"         // dcache
     "debug code at address\0"                       // debug
     "shows directory listing\0"                     // dir
     "disassembles memory location\0"                // disasm
@@ -966,12 +1600,19 @@ const char cli_cmd_help[] PROGMEM =
     "erase flash ROM\0"                             // erase
 #endif
     "fill memory with byte\0"                       // fill
+    "search memory for bytes or a string\0"         // find
 #ifdef SST_FLASH
     "flash file to ROM\0"                           // flash
 #endif
     "enable or disable halt\0"                      // halt
     "list available commands\0"                     // help
+#ifdef HOSTLINK
+    "serve binary host link protocol\0"             // hostlink
+#endif
     "read a value from a port\0"                    // in
+#ifdef TRACE_FILE
+    "stream or replay an instruction trace\0"       // itrace
+#endif
     "read a value from an io expander\0"            // ioxread
     "write a value to an io expander\0"             // ioxwrite
     "load binary file to memory\0"                  // loadbin
@@ -979,21 +1620,41 @@ const char cli_cmd_help[] PROGMEM =
     "mount a disk image\0"                          // mount
     "write a value to a port\0"                     // out
     "poke values into memory\0"                     // poke
+    "list or remap emulated io devices\0"           // ports
+#ifdef PROFILE_SHIFT
+    "sample the pc during run\0"                    // profile
+#endif
+#ifdef SST_FLASH
+    "flash only changed sectors of a file to ROM\0" // reflash
+#endif
     "execute code at address\0"                     // run
     "reset the processor, with optional vector\0"   // reset
     "save binary file from memory\0"                // savebin
     "save intel hex file from memory\0"             // savehex
     "shorthand for step\0"                          // s
+#ifdef PAGE_BASE
+    "save or restore all paged memory\0"            // snapshot
+#endif
+#ifdef IORQ_STATS
+    "show or reset io request statistics\0"         // stats
+#endif
     "step processor N cycles\0"                     // step
+    "write pending disk changes to SD card\0"       // sync
 #ifdef TMS_BASE
     "dump tms memory in hex and ascii\0"            // tmsdump
     "fill tms memory with byte\0"                   // tmsfill
     "load binary file to tms memory\0"              // tmslbin
+#endif
+#ifdef TRACE_LEN
+    "capture or print a bus trace\0"                // trace
 #endif
     "unmount a disk image\0"                        // unmount
+    "run until an opcode fetch at an address\0"     // until
     "set watch points\0"                            // watch
     "receive a file via xmodem\0"                   // xmrx
-    "send a file via xmodem";                       // xmtx
+    "send a file via xmodem\0"                      // xmtx
+    "receive files via ymodem(-g)\0"                // ymrx
+    "send files via ymodem(-g)";                    // ymtx
 
 void cli_help(int argc, char *argv[]);
 
@@ -1006,15 +1667,18 @@ void * const cli_cmd_functions[] PROGMEM = {
     &cli_base,
 #endif
     &cli_baud,
+    &cli_bench,
     &cli_boot,
     &cli_bus,
     &cli_breakwatch,
     &cli_debug,     // c
     &cli_clkdiv,
     &cli_cls,
+    &cli_cycles,
 #ifdef DS1306_RTC
     &cli_date,
 #endif
+    &cli_dcache,
     &cli_debug,
     &cli_dir,
     &cli_disasm,
@@ -1024,12 +1688,19 @@ void * const cli_cmd_functions[] PROGMEM = {
     &cli_erase,
 #endif
     &cli_fill,
+    &cli_find,
 #ifdef SST_FLASH
     &cli_loadbin,   // flash
 #endif
     &cli_halt,
     &cli_help,
+#ifdef HOSTLINK
+    &cli_hostlink,
+#endif
     &cli_in,
+#ifdef TRACE_FILE
+    &cli_itrace,
+#endif
     &cli_ioxread,
     &cli_ioxwrite,
     &cli_loadbin,
@@ -1037,21 +1708,41 @@ void * const cli_cmd_functions[] PROGMEM = {
     &cli_mount,
     &cli_out,
     &cli_poke,
+    &cli_ports,
+#ifdef PROFILE_SHIFT
+    &cli_profile,
+#endif
+#ifdef SST_FLASH
+    &cli_reflash,
+#endif
     &cli_run,
     &cli_reset,
     &cli_savebin,
     &cli_savehex,
     &cli_step,      // s
+#ifdef PAGE_BASE
+    &cli_snapshot,
+#endif
+#ifdef IORQ_STATS
+    &cli_stats,
+#endif
     &cli_step,
+    &cli_sync,
 #ifdef TMS_BASE
     &cli_dump,      // tmsdump
     &cli_fill,      // tmsfill
     &cli_loadbin,   // tmslbin
+#endif
+#ifdef TRACE_LEN
+    &cli_trace,
 #endif
     &cli_unmount,
+    &cli_until,
     &cli_breakwatch,
     &cli_xmrx,
-    &cli_xmtx
+    &cli_xmtx,
+    &cli_ymrx,
+    &cli_ymtx
 };
 
 #define NUM_CMDS (sizeof(cli_cmd_functions)/sizeof(void *))
@@ -1112,6 +1803,8 @@ void cli_loop(void)
         printf_P(PSTR("z80ctrl>"));
         if (fgets(buf, sizeof buf - 1, stdin) != NULL) {
             cli_dispatch(buf);
+            // Keep disk images current for monitor commands
+            drive_sync();
         }
     }
 }
@@ -1133,6 +1826,25 @@ int main(void)
 
     bus_init();
     iox_extcs_init(1);
+    timer_init();
+
+    iorq_init();
+#ifdef INTCTL_BASE
+    intctl_init();
+#endif
+    sio_init();
+    drive_init();
+#ifdef MSX_KEY_BASE
+    msx_init();
+#endif
+#ifdef TMS_BASE
+    tms_init();
+#endif
+
+    sched_add(z80_halt_task, 1);
+    sched_add(z80_break_task, 1);
+    sched_add(drive_sync, 100);
+    sched_add(mmc_disk_idle, 10);
 
     cli_exec(AUTOEXEC);
     cli_loop();
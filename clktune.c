@@ -0,0 +1,235 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file clktune.c Clock divider auto-tuning
+ *
+ * Runs a self-checking Z80 program at each divider from fastest to slowest
+ * and keeps the fastest at which every pass succeeds. The program exercises
+ * memory with an address pattern, block moves and a mix of ALU and stack
+ * instructions, and IO round trips through a port answered here rather than
+ * by the emulated devices, so a program crashed by a too-fast clock can't
+ * reach them. Tuning resets the Z80 and overwrites 0000-2FFF.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#include "clktune.h"
+#include "bus.h"
+#include "timer.h"
+#include "z80.h"
+
+#define TUNE_PORT 0x00          // echo port; TUNE_PORT+1 reports completion
+#define TUNE_SEED 0x00F0        // data addresses are fixed in the program
+#define TUNE_RESULT 0x00F1      // memory errors, pattern sum, copy sum
+#define TUNE_START 0x1000
+#define TUNE_LEN 0x1000
+#define TUNE_PASSES 4
+#define TUNE_MAXDIV 16
+
+static const uint8_t tune_prog[] PROGMEM = {
+    0xF3,                   // di
+    0x31, 0x00, 0x10,       // ld sp,1000h
+    // Fill 1000-1FFF with a pattern of the address and the seed
+    0x3A, 0xF0, 0x00,       // ld a,(00F0h)
+    0x57,                   // ld d,a
+    0x21, 0x00, 0x10,       // ld hl,1000h
+    0x01, 0x00, 0x10,       // ld bc,1000h
+    0x7D,                   // fill: ld a,l
+    0xAC,                   // xor h
+    0xAA,                   // xor d
+    0x77,                   // ld (hl),a
+    0x23,                   // inc hl
+    0x0B,                   // dec bc
+    0x78,                   // ld a,b
+    0xB1,                   // or c
+    0x20, 0xF6,             // jr nz,fill
+    // Check it, counting mismatches in E and summing what was read in HL'
+    0x21, 0x00, 0x10,       // ld hl,1000h
+    0x01, 0x00, 0x10,       // ld bc,1000h
+    0x1E, 0x00,             // ld e,0
+    0xD9,                   // exx
+    0x21, 0x00, 0x00,       // ld hl,0
+    0xD9,                   // exx
+    0x7D,                   // verify: ld a,l
+    0xAC,                   // xor h
+    0xAA,                   // xor d
+    0xBE,                   // cp (hl)
+    0x28, 0x01,             // jr z,ok
+    0x1C,                   // inc e
+    0x7E,                   // ok: ld a,(hl)
+    0xD9,                   // exx
+    0x29,                   // add hl,hl
+    0x30, 0x01,             // jr nc,$+3
+    0x2C,                   // inc l
+    0x85,                   // add a,l
+    0x6F,                   // ld l,a
+    0x30, 0x01,             // jr nc,$+3
+    0x24,                   // inc h
+    0xD9,                   // exx
+    0x23,                   // inc hl
+    0x0B,                   // dec bc
+    0x78,                   // ld a,b
+    0xB1,                   // or c
+    0x20, 0xE7,             // jr nz,verify
+    0x7B,                   // ld a,e
+    0x32, 0xF1, 0x00,       // ld (00F1h),a
+    0xD9,                   // exx
+    0x22, 0xF2, 0x00,       // ld (00F2h),hl
+    0xD9,                   // exx
+    // Copy it to 2000-2FFF and sum the copy with a different instruction mix
+    0x21, 0x00, 0x10,       // ld hl,1000h
+    0x11, 0x00, 0x20,       // ld de,2000h
+    0x01, 0x00, 0x10,       // ld bc,1000h
+    0xED, 0xB0,             // ldir
+    0x21, 0x00, 0x20,       // ld hl,2000h
+    0x01, 0x00, 0x10,       // ld bc,1000h
+    0x11, 0x00, 0x00,       // ld de,0
+    0x7E,                   // mix: ld a,(hl)
+    0xE5,                   // push hl
+    0x07,                   // rlca
+    0x6F,                   // ld l,a
+    0x26, 0x00,             // ld h,0
+    0x19,                   // add hl,de
+    0x19,                   // add hl,de
+    0xEB,                   // ex de,hl
+    0xE1,                   // pop hl
+    0xED, 0xA1,             // cpi
+    0xEA, 0x5B, 0x00,       // jp pe,mix
+    0xED, 0x53, 0xF4, 0x00, // ld (00F4h),de
+    // Write each byte value to TUNE_PORT and read back its complement
+    0x06, 0x00,             // ld b,0
+    0x0E, 0x00,             // ld c,0
+    0x78,                   // io: ld a,b
+    0xD3, TUNE_PORT,        // out (TUNE_PORT),a
+    0xDB, TUNE_PORT,        // in a,(TUNE_PORT)
+    0x2F,                   // cpl
+    0xB8,                   // cp b
+    0x28, 0x01,             // jr z,$+3
+    0x0C,                   // inc c
+    0x10, 0xF4,             // djnz io
+    // Report the IO error count and stop
+    0x79,                   // ld a,c
+    0xD3, TUNE_PORT+1,      // out (TUNE_PORT+1),a
+    0x76,                   // halt
+    0x18, 0xFD,             // jr $-1
+};
+
+static uint8_t tune_latch;
+static uint8_t tune_done;
+static uint8_t tune_ioerrs;
+
+/**
+ * Answer an IO request from the test program; mirrors iorq_dispatch
+ */
+static void tune_io(void)
+{
+    uint8_t port = GET_ADDRLO;
+
+    if (!GET_RD) {
+        SET_DATA(port == TUNE_PORT ? ~tune_latch : 0xFF);
+        DATA_OUTPUT;
+    } else if (!GET_WR) {
+        if (port == TUNE_PORT) {
+            tune_latch = GET_DATA;
+        } else if (port == TUNE_PORT + 1) {
+            tune_ioerrs = GET_DATA;
+            tune_done = 1;
+        }
+    }
+    BUSRQ_LO;
+    while (!GET_IORQ)
+        CLK_TOGGLE;
+    DATA_INPUT;
+    IORQ_INT_CLEAR;
+    BUSRQ_HI;
+}
+
+/**
+ * Run the test program once at the current divider.
+ * Returns NULL if it passed or the name of the first check that failed.
+ */
+static const char *tune_pass(uint8_t seed)
+{
+    uint8_t result[5];
+    uint16_t sum = 0, mix = 0;
+    uint32_t start, timeout = TIMER_HZ / 4 * clkdiv;
+
+    for (uint16_t a = TUNE_START; a < TUNE_START + TUNE_LEN; a++) {
+        uint8_t b = (a & 0xFF) ^ (a >> 8) ^ seed;
+        sum = ((sum << 1) | (sum >> 15)) + b;
+        mix = (mix << 1) + (uint8_t)((b << 1) | (b >> 7));
+    }
+    mem_write(TUNE_SEED, &seed, 1);
+    tune_done = 0;
+    z80_reset(0);
+    clk_run();
+    start = timer_ticks();
+    while (!tune_done && timer_ticks() - start < timeout) {
+        if (!GET_IORQ)
+            tune_io();
+    }
+    clk_stop();
+    CLK_LO;
+    if (!tune_done)
+        return PSTR("timeout");
+    mem_read(TUNE_RESULT, result, sizeof result);
+    if (result[0])
+        return PSTR("memory");
+    if ((result[1] | (result[2] << 8)) != sum || (result[3] | (result[4] << 8)) != mix)
+        return PSTR("instructions");
+    if (tune_ioerrs)
+        return PSTR("io");
+    return NULL;
+}
+
+/**
+ * Find the fastest divider that passes repeatedly and set clkdiv to it.
+ * If a faster divider failed, the next slower one is chosen for margin.
+ */
+void clk_tune(void)
+{
+    uint8_t olddiv = clkdiv;
+    const char *fail = NULL;
+    uint8_t div;
+
+    mem_write_P(0, tune_prog, sizeof tune_prog);
+    for (div = 2; div <= TUNE_MAXDIV; div++) {
+        clkdiv = div;
+        for (uint8_t i = 0; i < TUNE_PASSES; i++)
+            if ((fail = tune_pass(div * TUNE_PASSES + i)))
+                break;
+        printf_P(PSTR("clkdiv %d: %S\n"), div, fail ? fail : PSTR("pass"));
+        if (!fail)
+            break;
+    }
+    if (div > TUNE_MAXDIV) {
+        printf_P(PSTR("no divider passed; keeping clkdiv=%d\n"), olddiv);
+        clkdiv = olddiv;
+    } else if (div > 2 && div < TUNE_MAXDIV) {
+        clkdiv = div + 1;
+    }
+    z80_reset(0);
+}
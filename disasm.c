@@ -22,6 +22,8 @@
 
 #include "disasm.h"
 #include "bus.h"
+#include "uart.h"
+#include "util.h"
 
 #include <avr/pgmspace.h>
 #include <stdint.h>
@@ -35,6 +37,28 @@
  * in http://www.z80.info/decoding.htm.
  */
 
+/**
+ * Mnemonic fragments, fixed width so they can be indexed in program memory
+ */
+static const char registers[][5] PROGMEM = {"b", "c", "d", "e", "h", "l", "(hl)", "a", "ixh", "ixl", "iyh", "iyl"};
+static const char register_pairs[][3] PROGMEM = {"bc", "de", "hl", "sp", "af", "ix", "iy"};
+static const char conditions[][3] PROGMEM = {"nz", "z", "nc", "c", "po", "pe", "p", "m"};
+static const char alu_ops[][7] PROGMEM = {"add a,", "adc a,", "sub ", "sbc a,", "and ", "xor ", "or ", "cp "};
+static const char rot_ops[][4] PROGMEM = {"rlc", "rrc", "rl", "rr", "sla", "sra", "sll", "srl"};
+static const char bit_ops[][4] PROGMEM = {"bit", "res", "set"};
+static const char int_modes[] PROGMEM = "0012";
+static const char misc_ops[][7] PROGMEM = {
+    "ld i,a", "ld r,a", "ld a,i", "ld a,r", "rrd", "rld", "nop", "nop"
+};
+static const char block_ops[][5] PROGMEM = {
+    "ldi", "ldd", "ldir", "lddr", 
+    "cpi", "cpd", "cpir", "cpdr", 
+    "ini", "ind", "inir", "indr", 
+    "outi", "outd", "otir", "otdr"
+};
+static const char ld_ops[][10] PROGMEM = {"ld (bc),a", "ld a,(bc)", "ld (de),a", "ld a,(de)"};
+static const char af_ops[][5] PROGMEM = {"rlca", "rrca", "rla", "rra", "daa", "cpl", "scf", "ccf"};
+
 /**
  * disassemble a single instruction
  */
@@ -81,10 +105,6 @@ uint8_t disasm(uint8_t (*input)(), char *output)
     uint8_t zy = ((z & 3) << 2) | (y & 3);  // zy = {opcode[1:0], opcode[4:3]}
 
     // choose registers based on index mode and y/z/p opcode fields
-    const char *registers[] = {"b", "c", "d", "e", "h", "l", "(hl)", "a", "ixh", "ixl", "iyh", "iyl"};
-
-    const char *register_pairs[] = {"bc", "de", "hl", "sp", "af", "ix", "iy"};
-
     const char *rp, *hli, *ry, *ryi, *rz, *rzi;
     rp = register_pairs[p == HL ? im : p];
     ry = registers[y];
@@ -103,46 +123,41 @@ uint8_t disasm(uint8_t (*input)(), char *output)
         rzi = rz;
     }
 
-    const char *conditions[] = {"nz", "z", "nc", "c", "po", "pe", "p", "m"};
-    const char *alu_ops[] = {"add a,", "adc a,", "sub ", "sbc a,", "and ", "xor ", "or ", "cp "};
-
     // Big ugly nested if tree to decode opcode
     if (prefix == 0xCB) {
         if (x == 0) {
             // Roll/shift register or memory location
-            const char *rot_ops[] = {"rlc", "rrc", "rl", "rr", "sla", "sra", "sll", "srl"};
             if (im == HL) {
-                sprintf_P(output, PSTR("%s %s"), rot_ops[y], rz);
+                sprintf_P(output, PSTR("%S %S"), rot_ops[y], rz);
             } else {
-                sprintf_P(output, PSTR("%s (%s+%02xh)"), rot_ops[y], hli, displ);
+                sprintf_P(output, PSTR("%S (%S+%02xh)"), rot_ops[y], hli, displ);
             }
         } else {
             // Bit operations (test reset, set)
-            const char *bit_ops[] = {"bit", "res", "set"};
             if (im == HL) {
-                sprintf_P(output, PSTR("%s %x,%s"), bit_ops[x-1], y, rz);
+                sprintf_P(output, PSTR("%S %x,%S"), bit_ops[x-1], y, rz);
             } else {
-                sprintf_P(output, PSTR("%s %x,(%s+%02xh)"), bit_ops[x-1], y, hli, displ);
+                sprintf_P(output, PSTR("%S %x,(%S+%02xh)"), bit_ops[x-1], y, hli, displ);
             }
         }
     } else if (prefix == 0xED) {
         if (x == 1) {
             if (z == 0) {
                 // Input from port
-                sprintf_P(output, (y == 6) ? PSTR("in (c)") : PSTR("in %s,(c)"), ry);
+                sprintf_P(output, (y == 6) ? PSTR("in (c)") : PSTR("in %S,(c)"), ry);
             } else if (z == 1) {
                 // Output to port
-                sprintf_P(output, (y == 6) ? PSTR("out (c)") : PSTR("out (c),%s"), ry);
+                sprintf_P(output, (y == 6) ? PSTR("out (c)") : PSTR("out (c),%S"), ry);
             } else if (z == 2) {
                 // 16-bit add/subtract with carry
-                sprintf_P(output, (q == 0) ? PSTR("sbc hl,%s") : PSTR("adc hl,%s"), rp);
+                sprintf_P(output, (q == 0) ? PSTR("sbc hl,%S") : PSTR("adc hl,%S"), rp);
             } else if (z == 3) {
                 // Retrieve/store register pair from/to immediate address
                 operand = input() | (input() << 8);
                 if (q == 0) {
-                    sprintf_P(output, PSTR("ld (%04xh),%s"), operand, rp);
+                    sprintf_P(output, PSTR("ld (%04xh),%S"), operand, rp);
                 } else {
-                    sprintf_P(output, PSTR("ld %s,(%04xh)"), rp, operand);
+                    sprintf_P(output, PSTR("ld %S,(%04xh)"), rp, operand);
                 }
             } else if (z == 4) {
                 // Negate accumulator
@@ -152,24 +167,14 @@ uint8_t disasm(uint8_t (*input)(), char *output)
                 strcpy_P(output, (y == 1) ? PSTR("reti") : PSTR("retn"));
             } else if (z == 6) {
                 // Set interrupt mode
-                const char *int_modes[] = {"0", "0", "1", "2"};
-                sprintf_P(output, PSTR("im %s"), int_modes[y&0x3]);
+                sprintf_P(output, PSTR("im %c"), pgm_read_byte(&int_modes[y&0x3]));
             } else if (z == 7) {
                 // Assorted ops
-                const char *misc_ops[] = {
-                    "ld i,a", "ld r,a", "ld a,i", "ld a,r", "rrd", "rld", "nop", "nop"
-                };
-                strcpy(output, misc_ops[y]);
+                strcpy_P(output, misc_ops[y]);
             }
         } else if (x == 2 && z <= 3 && y >= 4) {
             // block operations
-            const char *block_ops[] = {
-                "ldi", "ldd", "ldir", "lddr", 
-                "cpi", "cpd", "cpir", "cpdr", 
-                "ini", "ind", "inir", "indr", 
-                "outi", "outd", "otir", "otdr"
-            };
-            strcpy(output, block_ops[zy]);
+            strcpy_P(output, block_ops[zy]);
         } else {
             strcpy_P(output, PSTR("?"));
         }
@@ -189,66 +194,64 @@ uint8_t disasm(uint8_t (*input)(), char *output)
                     } else if (y == 3) {
                         sprintf_P(output, PSTR("jr %d"), (int8_t)operand);
                     } else {
-                        sprintf_P(output, PSTR("jr %s,%d"), conditions[y-4], (int8_t)operand);
+                        sprintf_P(output, PSTR("jr %S,%d"), conditions[y-4], (int8_t)operand);
                     }
                 }
             } else if (z == 1) {
                 // 16-bit load immediate/add
                 if (q == 0) {
                     operand = input() | (input() << 8);
-                    sprintf_P(output, PSTR("ld %s,%04xh"), rp, operand);
+                    sprintf_P(output, PSTR("ld %S,%04xh"), rp, operand);
                 } else {
-                    sprintf_P(output, PSTR("add %s,%s"), hli, rp);
+                    sprintf_P(output, PSTR("add %S,%S"), hli, rp);
                 }
             } else if (z == 2) {
                 // Indirect loading
                 if (y < 4) {
-                    const char *ld_ops[] = {"ld (bc),a", "ld a,(bc)", "ld (de),a", "ld a,(de)"};
-                    strcpy(output, ld_ops[y]);
+                    strcpy_P(output, ld_ops[y]);
                 } else {
                     operand = input() | (input() << 8);
                     if (p == 3) {
-                        hli = "a";
+                        hli = registers[A];
                     }
                     if (q == 0) {
-                        sprintf_P(output, PSTR("ld (0%04xh),%s"), operand, hli); 
+                        sprintf_P(output, PSTR("ld (0%04xh),%S"), operand, hli); 
                     } else {
-                        sprintf_P(output, PSTR("ld %s,(0%04xh)"), hli, operand);
+                        sprintf_P(output, PSTR("ld %S,(0%04xh)"), hli, operand);
                     }
                 }
             } else if (z == 3) {
                 // 16-bit increment or decrement
-                sprintf_P(output, (q == 0) ? PSTR("inc %s") : PSTR("dec %s"), rp);
+                sprintf_P(output, (q == 0) ? PSTR("inc %S") : PSTR("dec %S"), rp);
             } else if (z == 4) {
                 // 8-bit increment
                 if (y == HLI && im != HL) {
                     displ = input();
-                    sprintf_P(output, PSTR("inc (%s+%02xh)"), hli, displ);
+                    sprintf_P(output, PSTR("inc (%S+%02xh)"), hli, displ);
                 } else {
-                    sprintf_P(output, PSTR("inc %s"), ry);
+                    sprintf_P(output, PSTR("inc %S"), ry);
                 }
             } else if (z == 5) {
                 // 8-bit decrement
                 if (y == HLI && im != HL) {
                     displ = input();
-                    sprintf_P(output, PSTR("dec (%s+%02xh)"), hli, displ);
+                    sprintf_P(output, PSTR("dec (%S+%02xh)"), hli, displ);
                 } else {
-                    sprintf_P(output, PSTR("dec %s"), ry);
+                    sprintf_P(output, PSTR("dec %S"), ry);
                 }
             } else if (z == 6) {
                 // 8-bit load immediate
                 if (y == HLI && im != HL) {
                     displ = input();
                     operand = input();
-                    sprintf_P(output, PSTR("ld (%s+%02xh),%02xh"), hli, displ, operand);
+                    sprintf_P(output, PSTR("ld (%S+%02xh),%02xh"), hli, displ, operand);
                 } else {
                     operand = input();
-                    sprintf_P(output, PSTR("ld %s,%02xh"), ry, operand);
+                    sprintf_P(output, PSTR("ld %S,%02xh"), ry, operand);
                 }
             } else if (z == 7) {
                 // Assorted operations on accumulator/flags
-                const char *af_ops[] = {"rlca", "rrca", "rla", "rra", "daa", "cpl", "scf", "ccf"};
-                strcpy(output, af_ops[y]);
+                strcpy_P(output, af_ops[y]);
             }
         } else if (x == 1) {
             if (z == HLI && y == HLI) {
@@ -258,42 +261,42 @@ uint8_t disasm(uint8_t (*input)(), char *output)
                 // 8-bit loading
                 displ = input();
                 if (y == HLI) {
-                    sprintf_P(output, PSTR("ld (%s+%02xh),%s"), hli, displ, rz);
+                    sprintf_P(output, PSTR("ld (%S+%02xh),%S"), hli, displ, rz);
                 } else {
-                    sprintf_P(output, PSTR("ld %s,(%s+%02xh)"), ry, hli, displ);
+                    sprintf_P(output, PSTR("ld %S,(%S+%02xh)"), ry, hli, displ);
                 }
             } else {
-                sprintf_P(output, PSTR("ld %s,%s"), ry, rz);
+                sprintf_P(output, PSTR("ld %S,%S"), ry, rz);
             }
         } else if (x == 2) {
             // ALU operation on accumulator and register/memory location
             if (z == 6 && im != HL) {
                 displ = input();
-                sprintf_P(output, PSTR("%s(%s+%02xh)"), alu_ops[y], hli, displ);
+                sprintf_P(output, PSTR("%S(%S+%02xh)"), alu_ops[y], hli, displ);
             } else {
-                sprintf_P(output, PSTR("%s%s"), alu_ops[y], rz);
+                sprintf_P(output, PSTR("%S%S"), alu_ops[y], rz);
             }
         } else if (x == 3) {
             if (z == 0) {
                 // Conditional return
-                sprintf_P(output, PSTR("ret %s"), conditions[y]);
+                sprintf_P(output, PSTR("ret %S"), conditions[y]);
             } else if (z == 1) {
                 // pop & various ops
                 if (q == 0) {
-                    sprintf_P(output, PSTR("pop %s"), p < _SP ? rp : register_pairs[AF]);
+                    sprintf_P(output, PSTR("pop %S"), p < _SP ? rp : register_pairs[AF]);
                 } else if (p == 0) {
                     strcpy_P(output, PSTR("ret"));
                 } else if (p == 1) {
                     strcpy_P(output, PSTR("exx"));
                 } else if (p == 2) {
-                    sprintf_P(output, PSTR("jp (%s)"), hli);
+                    sprintf_P(output, PSTR("jp (%S)"), hli);
                 } else if (p == 3) {
-                    sprintf_P(output, PSTR("ld sp,%s"), hli);
+                    sprintf_P(output, PSTR("ld sp,%S"), hli);
                 }
             } else if (z == 2) {
                 // Conditional jump
                 operand = input() | (input() << 8);
-                sprintf_P(output, PSTR("jp %s,%04xh"), conditions[y], operand);
+                sprintf_P(output, PSTR("jp %S,%04xh"), conditions[y], operand);
             } else if (z == 3) {
                 // Assorted operations
                 if (y == 0) {
@@ -308,7 +311,7 @@ uint8_t disasm(uint8_t (*input)(), char *output)
                     operand = input();
                     sprintf_P(output, PSTR("in a,(%02xh)"), operand);
                 } else if (y == 4) {
-                    sprintf_P(output, PSTR("ex (sp),%s"), hli);
+                    sprintf_P(output, PSTR("ex (sp),%S"), hli);
                 } else if (y == 5) {
                     strcpy_P(output, PSTR("ex de,hl"));
                 } else if (y == 6) {
@@ -319,11 +322,11 @@ uint8_t disasm(uint8_t (*input)(), char *output)
             } else if (z == 4) {
                 // Conditional call
                 operand = input() | (input() << 8);
-                sprintf_P(output, PSTR("call %s,%04xh"), conditions[y], operand);
+                sprintf_P(output, PSTR("call %S,%04xh"), conditions[y], operand);
             } else if (z == 5) {
                 // push & various ops
                 if (q == 0)
-                    sprintf_P(output, PSTR("push %s"), p < _SP ? rp : register_pairs[AF]);
+                    sprintf_P(output, PSTR("push %S"), p < _SP ? rp : register_pairs[AF]);
                 else if (p == 0) {
                     operand = input() | (input() << 8);
                     sprintf_P(output, PSTR("call %04xh"), operand);
@@ -331,7 +334,7 @@ uint8_t disasm(uint8_t (*input)(), char *output)
             } else if (z == 6) {
                 // ALU operation on accumulator and immediate operand
                 operand = input();
-                sprintf_P(output, PSTR("%s%02xh"), alu_ops[y], operand);
+                sprintf_P(output, PSTR("%S%02xh"), alu_ops[y], operand);
             } else if (z == 7) {
                 // Restart
                 sprintf_P(output, PSTR("rst %02xh"), y*8);
@@ -339,7 +342,7 @@ uint8_t disasm(uint8_t (*input)(), char *output)
         }
     }
 
-    //printf_P(PSTR("%s %02X %03o %04X\t"), register_pairs[im], prefix, opcode, operand);
+    //printf_P(PSTR("%S %02X %03o %04X\t"), register_pairs[im], prefix, opcode, operand);
 }
 
 uint8_t disasm_index = 0;   /**< index of next byte within 256 byte buffer */
@@ -349,13 +352,26 @@ uint8_t *disasm_buf;        /**< pointer to disassembly buffer */
 uint8_t instr_bytes[8];     /**< bytes contained in the current instruction */
 uint8_t instr_length = 0;   /**< length of the current construction */
 
+/**
+ * Bytes to read at a time from external RAM; must match the wrap of disasm_index
+ */
+#define DISASM_CHUNK 256
+
+/**
+ * Last address of the range being disassembled, to avoid reading past it
+ */
+static uint32_t disasm_end;
+
 /**
  * Return next byte for instruction from memory
  */
 uint8_t disasm_next_byte()
 {
-    if (disasm_index == 0)
-        mem_read(disasm_addr, disasm_buf, 256);
+    if (disasm_index == 0) {
+        // Read only what the range needs, plus room for a final instruction to run over
+        uint32_t len = disasm_end - disasm_addr + 4;
+        mem_read(disasm_addr, disasm_buf, len < DISASM_CHUNK ? len : DISASM_CHUNK);
+    }
     disasm_addr++;
     instr_bytes[instr_length] = disasm_buf[disasm_index++];
     return instr_bytes[instr_length++];
@@ -363,37 +379,61 @@ uint8_t disasm_next_byte()
 
 /**
  * Disassemble instructions from external memory to console
+ *
+ * Memory is read a chunk at a time within one bus session and each line is
+ * built in a buffer and queued for the console in one block, so a long
+ * listing is limited by the console rather than by bus handoffs or printf.
  */
 void disasm_mem(uint32_t start, uint32_t end)
 {
     char mnemonic[64];
-    uint8_t buf[256];
+    char line[128];
+    uint8_t buf[DISASM_CHUNK];
     uint8_t i;
+    char *p;
 
     disasm_addr = start;
+    disasm_end = end;
     disasm_index = 0;
     disasm_buf = buf;
 
+    if (!bus_begin())
+        return;
     while (start <= disasm_addr && disasm_addr <= end) {
+        uint32_t addr = disasm_addr + base_addr;
         instr_length = 0;
-        printf_P(PSTR("%05lx  "), disasm_addr + base_addr);
         disasm(disasm_next_byte, mnemonic);
-        for (i = 0; i < instr_length; i++) {
-            printf_P(PSTR("%02x "), instr_bytes[i]);
+        p = line;
+        p = fmt_hex(p, addr >> 16, 1);
+        p = fmt_hex(p, addr, 4);
+        *p++ = ' ';
+        *p++ = ' ';
+        for (i = 0; i < 5; i++) {
+            if (i < instr_length) {
+                p = fmt_hex(p, instr_bytes[i], 2);
+            } else {
+                *p++ = ' ';
+                *p++ = ' ';
+            }
+            *p++ = ' ';
         }
-        i = 5 - instr_length;
-        while (i--)
-            printf_P(PSTR("   "));
-        printf_P(PSTR("  "));
-        for (i = 0; i < instr_length; i++) {
-            if (0x20 <= instr_bytes[i] && instr_bytes[i] <= 0x7e)
-                printf_P(PSTR("%c"), instr_bytes[i]);
+        *p++ = ' ';
+        *p++ = ' ';
+        for (i = 0; i < 5; i++) {
+            if (i >= instr_length)
+                *p++ = ' ';
+            else if (0x20 <= instr_bytes[i] && instr_bytes[i] <= 0x7e)
+                *p++ = instr_bytes[i];
             else
-                printf_P(PSTR("."));
+                *p++ = '.';
         }
-        i = 5 - instr_length;
-        while (i--)
-            printf_P(PSTR(" "));
-        printf_P(PSTR("  %s\n"), mnemonic);
+        *p++ = ' ';
+        *p++ = ' ';
+        for (i = 0; mnemonic[i]; i++)
+            *p++ = mnemonic[i];
+        *p++ = '\r';
+        *p++ = '\n';
+        uart_write(0, (uint8_t *)line, p - line);
     }
-}
\ No newline at end of file
+    bus_end();
+}
@@ -120,8 +120,15 @@
 #include "bus.h"
 #include "diskemu.h"
 #include "ff.h"
+#include "diskio.h"
 #include "iorq.h"
 #include "simhboot.h"
+#ifdef HDSK_ASYNC
+#include "sched.h"
+#endif
+#ifdef INTCTL_BASE
+#include "intctl.h"
+#endif
 
 typedef struct _drive {
     FIL fp;
@@ -129,8 +136,25 @@ typedef struct _drive {
     uint8_t track;
     uint8_t sector;
     uint8_t byte;
+    uint8_t dirty;
+    uint8_t hd512;      // native HDSK image of 512-byte sectors rather than the SIMH layout
+#if DISK_CLMT_LEN > 0
+    uint8_t linkmap;
+    DWORD clmt[DISK_CLMT_LEN];
+#endif
+#if DISK_RAM_SIZE > 0
+    uint8_t ram_page;   // first 16KB physical page holding the image, or 0
+    uint8_t ram_pages;  // number of pages reserved
+    uint16_t ram_lo;    // first modified RAM_BLOCK not yet written back
+    uint16_t ram_hi;    // block after the last modified one
+#endif
 } drive;
 
+// Cluster link map states
+#define LM_NONE 0       // chain walking; map disabled or doesn't fit
+#define LM_OK 1         // fast seek using the map
+#define LM_STALE 2      // image grew, map must be rebuilt
+
 #define NUMTRACKS 254ul // Altair disk has 77 but SIMH allows disk images with more
 #define NUMSECTORS 32ul
 #define SECTORSIZE 137ul
@@ -170,54 +194,732 @@ uint8_t sectorbuf[SECTORSIZE+1];
 uint8_t dirtysector = 0;
 
 /**
- * Load a CPM boot sector directly from disk image mounted on drive 0
+ * LRU cache of recently used sectors, shared by all drives. Written sectors
+ * are held dirty in the cache and flushed to the image later in offset order,
+ * so adjacent sectors are merged into whole SD blocks by FatFs.
+ */
+typedef struct {
+    uint8_t drv;            // drive number + 1, or 0 if entry unused
+    uint8_t sector;
+    uint16_t track;
+    uint16_t used;          // LRU timestamp
+    uint8_t dirty;          // not yet written to the image
+    uint8_t data[SECTORSIZE];
+} cache_entry;
+
+#if DISK_CACHE_SECTORS > 0
+static cache_entry drive_cache[DISK_CACHE_SECTORS];
+static uint16_t cache_clock = 0;
+#endif
+
+uint32_t drive_cache_hits = 0;
+uint32_t drive_cache_misses = 0;
+
+/**
+ * Find a sector in the cache; returns NULL if not present
+ */
+static cache_entry *cache_find(uint8_t drv, uint16_t track, uint8_t sector)
+{
+#if DISK_CACHE_SECTORS > 0
+    for (uint8_t i = 0; i < DISK_CACHE_SECTORS; i++) {
+        cache_entry *e = &drive_cache[i];
+        if (e->drv == drv + 1 && e->track == track && e->sector == sector) {
+            e->used = ++cache_clock;
+            return e;
+        }
+    }
+#endif
+    return NULL;
+}
+
+/**
+ * Build the cluster link map for a mounted image so seeks don't walk the FAT
+ */
+static void drive_linkmap(uint8_t drv)
+{
+#if DISK_CLMT_LEN > 0
+    FIL *fp = &drives[drv].fp;
+    FSIZE_t ofs = f_tell(fp);
+    drives[drv].clmt[0] = DISK_CLMT_LEN;
+    fp->cltbl = drives[drv].clmt;
+    if (f_lseek(fp, CREATE_LINKMAP) == FR_OK) {
+        drives[drv].linkmap = LM_OK;
+    } else {
+        fp->cltbl = NULL;
+        drives[drv].linkmap = LM_NONE;
+    }
+    f_lseek(fp, ofs);
+#endif
+}
+
+#if DISK_RAW_LBA
+/**
+ * SD block buffers for the raw LBA path, shared by all drives in LRU order
+ * so images used alternately, as by a copy between drives, each keep their
+ * own. A block that FatFs currently holds in its window is written back and
+ * released there first so the two never disagree.
+ */
+typedef struct {
+    DWORD block;            // SD block held, or 0 if unused
+    uint8_t drv;            // drive the block belongs to
+    uint8_t dirty;
+    uint16_t used;          // LRU timestamp
+    uint8_t data[FF_MIN_SS];
+} raw_entry;
+
+static raw_entry raw_bufs[DISK_RAW_BUFS];
+static uint16_t raw_clock = 0;
+
+/**
+ * Write a block buffer back to the card if modified
+ */
+static FRESULT raw_writeback(raw_entry *r)
+{
+    if (r->dirty) {
+        if (disk_write(DRV_MMC, r->data, r->block, 1) != RES_OK)
+            return FR_DISK_ERR;
+        r->dirty = 0;
+    }
+    return FR_OK;
+}
+
+/**
+ * Write back a drive's block buffers, or all of them if drv is 0xff
+ */
+static FRESULT raw_flush(uint8_t drv)
+{
+    FRESULT fr, res = FR_OK;
+    for (uint8_t i = 0; i < DISK_RAW_BUFS; i++)
+        if ((drv == 0xff || raw_bufs[i].drv == drv) && (fr = raw_writeback(&raw_bufs[i])) != FR_OK)
+            res = fr;
+    return res;
+}
+
+/**
+ * Write back and forget a drive's block buffers before FatFs touches its image
+ */
+static FRESULT raw_invalidate(uint8_t drv)
+{
+    FRESULT fr = raw_flush(drv);
+    for (uint8_t i = 0; i < DISK_RAW_BUFS; i++)
+        if (drv == 0xff || raw_bufs[i].drv == drv)
+            raw_bufs[i].block = 0;
+    return fr;
+}
+
+/**
+ * Get a buffer holding an SD block of a drive's image, or NULL on error.
+ * Without fill a newly claimed buffer isn't read from the card, for a
+ * caller about to overwrite the whole block.
+ */
+static raw_entry *raw_get(uint8_t drv, FATFS *fs, DWORD block, uint8_t fill)
+{
+    raw_entry *r = &raw_bufs[0];
+    uint8_t i;
+
+    for (i = 0; i < DISK_RAW_BUFS; i++) {
+        if (raw_bufs[i].block == block) {
+            raw_bufs[i].used = ++raw_clock;
+            return &raw_bufs[i];
+        }
+    }
+    for (i = 0; i < DISK_RAW_BUFS; i++) {
+        raw_entry *c = &raw_bufs[i];
+        if (!c->block) {
+            r = c;
+            break;
+        }
+        if ((uint16_t)(raw_clock - c->used) > (uint16_t)(raw_clock - r->used))
+            r = c;
+    }
+    if (raw_writeback(r) != FR_OK)
+        return NULL;
+    r->block = 0;
+    if (f_syncwin(fs, block) != FR_OK)
+        return NULL;
+    if (fill && disk_read(DRV_MMC, r->data, block, 1) != RES_OK)
+        return NULL;
+    r->block = block;
+    r->drv = drv;
+    r->used = ++raw_clock;
+    return r;
+}
+
+/**
+ * Find the SD block holding an offset in an image using its link map
  */
-int drive_bootload()
+static DWORD raw_lba(uint8_t drv, uint32_t ofs)
 {
+    FATFS *fs = drives[drv].fp.obj.fs;
+    DWORD sect = ofs / FF_MIN_SS;
+    DWORD cl = sect / fs->csize;
+
+    // Fragments follow the table size as (length, first cluster) pairs
+    for (DWORD *t = &drives[drv].clmt[1]; t[0]; t += 2) {
+        if (cl < t[0])
+            return fs->database + (t[1] + cl - 2) * fs->csize + sect % fs->csize;
+        cl -= t[0];
+    }
+    return 0;
+}
+
+/**
+ * Transfer a sector of an image directly to or from SD blocks
+ */
+static FRESULT raw_transfer(uint8_t drv, uint32_t ofs, uint8_t *buf, uint8_t write)
+{
+    FATFS *fs = drives[drv].fp.obj.fs;
+    uint16_t pos = ofs % FF_MIN_SS;
+    uint16_t len = SECTORSIZE;
+
+    while (len) {
+        DWORD block = raw_lba(drv, ofs);
+        raw_entry *r = block ? raw_get(drv, fs, block, 1) : NULL;
+        if (!r)
+            return FR_DISK_ERR;
+        uint16_t n = FF_MIN_SS - pos;
+        if (n > len)
+            n = len;
+        if (write) {
+            memcpy(r->data + pos, buf, n);
+            r->dirty = 1;
+        } else {
+            memcpy(buf, r->data + pos, n);
+        }
+        buf += n;
+        ofs += n;
+        len -= n;
+        pos = 0;
+    }
+    return FR_OK;
+}
+
+/**
+ * Whether a sector can be reached by the raw LBA path
+ */
+static uint8_t raw_ok(uint8_t drv, uint32_t ofs, uint16_t len)
+{
+    return drives[drv].linkmap == LM_OK && ofs + len <= f_size(&drives[drv].fp);
+}
+#endif
+
+/**
+ * Seek to a sector in a drive's image
+ */
+static FRESULT drive_seek(uint8_t drv, FSIZE_t ofs)
+{
+    FIL *fp = &drives[drv].fp;
+#if DISK_RAW_LBA
     FRESULT fr;
-    UINT read;
-    uint8_t buf[SECTORSIZE+1];
-    uint16_t addr = 0;
-    uint8_t sector = 0;
-    uint8_t track = 0;
-    uint16_t end;
-    if (drives[0].status & (1 << S_MOUNTED)) {
-        if ((fr = f_read(&drives[0].fp, buf, 3, &read)) != FR_OK) {
-            printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
-            return 0;
+    if ((fr = raw_invalidate(drv)) != FR_OK)
+        return fr;
+#endif
+#if DISK_CLMT_LEN > 0
+    // Fast seek can't extend the file, so walk the chain until the map is rebuilt
+    if (fp->cltbl && ofs + SECTORSIZE > f_size(fp)) {
+        fp->cltbl = NULL;
+        drives[drv].linkmap = LM_STALE;
+    }
+#endif
+    if (f_tell(fp) == ofs)
+        return FR_OK;
+    return f_lseek(fp, ofs);
+}
+
+#if DISK_RAM_SIZE > 0
+#define RAM_PAGE_SIZE 0x4000ul
+#define RAM_BLOCK 512           // granularity of write-back tracking
+#define RAM_BUF 256
+#define RAM_MINSIZE OFFSET(77, 0)   // room for a standard 8" disk when the image is new
+#define RAM_START(drv) ((uint32_t)drives[drv].ram_page * RAM_PAGE_SIZE)
+#define RAM_LEN(drv) ((uint32_t)drives[drv].ram_pages * RAM_PAGE_SIZE)
+
+/**
+ * Copy between a buffer and a drive's image in physical RAM, recording
+ * written blocks for write-back. The page registers are restored afterwards
+ * to what the Z80 last wrote to them, as tracked by iorq_dispatch.
+ */
+static FRESULT ram_transfer(uint8_t drv, uint32_t ofs, uint8_t *buf, uint16_t len, uint8_t write)
+{
+    drive *d = &drives[drv];
+    uint32_t saved_base = base_addr;
+    uint8_t pages[4], paging = mem_paging;
+
+    if (ofs + len > RAM_LEN(drv))
+        return FR_DENIED;
+    if (!bus_begin())
+        return FR_NOT_READY;
+    memcpy(pages, mem_pages, 4);
+    base_addr = 0;
+    if (write) {
+        mem_write_bare(RAM_START(drv) + ofs, buf, len);
+        if (ofs / RAM_BLOCK < d->ram_lo)
+            d->ram_lo = ofs / RAM_BLOCK;
+        if ((ofs + len + RAM_BLOCK - 1) / RAM_BLOCK > d->ram_hi)
+            d->ram_hi = (ofs + len + RAM_BLOCK - 1) / RAM_BLOCK;
+    } else {
+        mem_read_bare(RAM_START(drv) + ofs, buf, len);
+    }
+    base_addr = saved_base;
+    // Put back what the Z80 last wrote to the page registers
+    DATA_OUTPUT;
+    for (uint8_t i = 0; i < 4; i++)
+        mem_page_bare(i, pages[i]);
+    if (!paging) {
+        io_out_bare(PAGE_ENABLE, 0);
+        mem_paging = 0;
+    }
+    DATA_INPUT;
+    bus_end();
+    return FR_OK;
+}
+
+/**
+ * Find free pages in the RAM disk area; returns the first page or 0
+ */
+static uint8_t ram_alloc(uint8_t pages)
+{
+    uint8_t first = PAGE(DISK_RAM_BASE);
+    uint8_t i = 0;
+
+    while (i < NUMDRIVES) {
+        drive *d = &drives[i++];
+        if (d->ram_page && d->ram_page < first + pages && first < d->ram_page + d->ram_pages) {
+            first = d->ram_page + d->ram_pages;
+            i = 0;
         }
-        if (buf[0] == 0xE5 && buf[1] == 0xE5 && buf[2] == 0xE5) {
-            // SIMH disks
-            sector = 8;
+    }
+    return first + pages <= PAGE(DISK_RAM_BASE + DISK_RAM_SIZE) ? first : 0;
+}
+
+/**
+ * Reserve RAM for a freshly opened image and copy the image into it
+ */
+static FRESULT ram_load(uint8_t drv)
+{
+    drive *d = &drives[drv];
+    FSIZE_t size = f_size(&d->fp);
+    uint32_t len = size > RAM_MINSIZE ? size : RAM_MINSIZE;
+    uint8_t buf[RAM_BUF];
+    FRESULT fr = FR_OK;
+    UINT br;
+
+    if (len > DISK_RAM_SIZE || !(d->ram_page = ram_alloc((len + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE)))
+        return FR_NOT_ENOUGH_CORE;
+    d->ram_pages = (len + RAM_PAGE_SIZE - 1) / RAM_PAGE_SIZE;
+    if ((fr = drive_seek(drv, 0)) != FR_OK || !bus_begin()) {
+        d->ram_page = 0;
+        return fr != FR_OK ? fr : FR_NOT_READY;
+    }
+    for (uint32_t ofs = 0; ofs < RAM_LEN(drv); ofs += RAM_BUF) {
+        br = 0;
+        if (ofs < size && (fr = f_read(&d->fp, buf, RAM_BUF, &br)) != FR_OK)
+            break;
+        // Space past the end of the image reads as erased, like a new SIMH disk
+        memset(buf + br, 0xE5, RAM_BUF - br);
+        if ((fr = ram_transfer(drv, ofs, buf, RAM_BUF, 1)) != FR_OK)
+            break;
+    }
+    bus_end();
+    if (fr != FR_OK)
+        d->ram_page = 0;
+    d->ram_lo = 0xFFFF;
+    d->ram_hi = 0;
+    return fr;
+}
+
+/**
+ * Write the modified part of a RAM disk back to its image file
+ */
+static FRESULT ram_writeback(uint8_t drv)
+{
+    drive *d = &drives[drv];
+    FIL *fp = &d->fp;
+    uint8_t buf[RAM_BUF];
+    uint32_t ofs = (uint32_t)d->ram_lo * RAM_BLOCK;
+    uint32_t end = (uint32_t)d->ram_hi * RAM_BLOCK;
+    FRESULT fr = FR_OK;
+    UINT bw;
+
+    if (d->ram_lo >= d->ram_hi)
+        return FR_OK;
+    // Seeking past the end would leave a gap of undefined data in the file
+    if (ofs > f_size(fp))
+        ofs = f_size(fp);
+#if DISK_CLMT_LEN > 0
+    if (fp->cltbl && end > f_size(fp)) {
+        fp->cltbl = NULL;
+        d->linkmap = LM_STALE;
+    }
+#endif
+    if ((fr = drive_seek(drv, ofs)) != FR_OK)
+        return fr;
+    fatfs_preerase(fp, end - ofs);
+    if (!bus_begin())
+        return FR_NOT_READY;
+    while (ofs < end) {
+        uint16_t n = end - ofs > RAM_BUF ? RAM_BUF : end - ofs;
+        if ((fr = ram_transfer(drv, ofs, buf, n, 0)) != FR_OK || (fr = f_write(fp, buf, n, &bw)) != FR_OK)
+            break;
+        ofs += n;
+    }
+    bus_end();
+    d->dirty = 1;
+    if (fr == FR_OK) {
+        d->ram_lo = 0xFFFF;
+        d->ram_hi = 0;
+    }
+    return fr;
+}
+
+/**
+ * 88-DISK transfers can't use the bus during the IO cycle that needs them,
+ * so RAM disk sectors are queued here and moved by ram_dma after the cycle.
+ */
+static uint8_t ram_store_drv = 0xff;    // drive to store sectorbuf to, or 0xff
+static uint32_t ram_store_ofs;
+static uint8_t ram_fetch_drv = 0xff;    // drive to fill sectorbuf from, or 0xff
+static uint32_t ram_fetch_ofs;
+static uint8_t ram_fetch_pos;
+static uint8_t ram_fetch_len;
+
+/**
+ * Move queued 88-DISK sectors between sectorbuf and RAM disks
+ */
+static void ram_dma(void)
+{
+    FRESULT fr;
+
+    if (ram_store_drv != 0xff &&
+            (fr = ram_transfer(ram_store_drv, ram_store_ofs, sectorbuf, SECTORSIZE, 1)) != FR_OK)
+        printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+    if (ram_fetch_drv != 0xff &&
+            (fr = ram_transfer(ram_fetch_drv, ram_fetch_ofs + ram_fetch_pos,
+                sectorbuf + ram_fetch_pos, ram_fetch_len, 0)) != FR_OK)
+        printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
+    ram_store_drv = ram_fetch_drv = 0xff;
+}
+
+/**
+ * Queue part of the selected drive's current sector to be read into sectorbuf
+ */
+static void ram_fetch(uint8_t pos, uint8_t len)
+{
+    if (selected->sector >= NUMSECTORS)
+        return;
+    ram_fetch_drv = selected - drives;
+    ram_fetch_ofs = OFFSET(selected->track, selected->sector);
+    ram_fetch_pos = pos;
+    ram_fetch_len = len;
+    dma_function = &ram_dma;
+}
+#endif
+
+/**
+ * Read a sector from a drive's image; br is set to the bytes actually read
+ */
+static FRESULT image_read(uint8_t drv, uint32_t ofs, uint8_t *buf, UINT *br)
+{
+    FRESULT fr;
+#if DISK_RAW_LBA
+    if (raw_ok(drv, ofs, SECTORSIZE)) {
+        *br = SECTORSIZE;
+        return raw_transfer(drv, ofs, buf, 0);
+    }
+#endif
+    if ((fr = drive_seek(drv, ofs)) != FR_OK)
+        return fr;
+    return f_read(&drives[drv].fp, buf, SECTORSIZE, br);
+}
+
+/**
+ * Write a sector to a drive's image
+ */
+static FRESULT image_write(uint8_t drv, uint32_t ofs, const uint8_t *buf)
+{
+    FRESULT fr;
+    UINT bw;
+#if DISK_RAW_LBA
+    if (raw_ok(drv, ofs, SECTORSIZE))
+        return raw_transfer(drv, ofs, (uint8_t *)buf, 1);
+#endif
+    if ((fr = drive_seek(drv, ofs)) != FR_OK)
+        return fr;
+    if ((fr = f_write(&drives[drv].fp, buf, SECTORSIZE, &bw)) != FR_OK)
+        return fr;
+    drives[drv].dirty = 1;
+    return FR_OK;
+}
+
+/**
+ * Write a drive's dirty sectors to its image in ascending offset order;
+ * sectors that fail to write stay dirty
+ */
+static FRESULT cache_flush(uint8_t drv)
+{
+    FRESULT res = FR_OK;
+#if DISK_CACHE_SECTORS > 0
+    FRESULT fr;
+    int32_t after = -1;
+
+    for (;;) {
+        cache_entry *next = NULL;
+        for (uint8_t i = 0; i < DISK_CACHE_SECTORS; i++) {
+            cache_entry *e = &drive_cache[i];
+            int32_t ofs = OFFSET(e->track, e->sector);
+            if (e->dirty && e->drv == drv + 1 && ofs > after &&
+                    (!next || ofs < (int32_t)OFFSET(next->track, next->sector)))
+                next = e;
+        }
+        if (!next)
+            break;
+        after = OFFSET(next->track, next->sector);
+        // Consecutive sectors need no seek and fill the same SD block buffer
+        if ((fr = image_write(drv, after, next->data)) != FR_OK)
+            res = fr;
+        else
+            next->dirty = 0;
+    }
+#endif
+    return res;
+}
+
+#if DISK_CACHE_SECTORS > 0
+/**
+ * Find a free entry, or else the least recently used one; with clean set,
+ * only entries without a pending write are considered
+ */
+static cache_entry *cache_victim(uint8_t clean)
+{
+    cache_entry *e = NULL;
+    for (uint8_t i = 0; i < DISK_CACHE_SECTORS; i++) {
+        cache_entry *c = &drive_cache[i];
+        if (c->drv == 0)
+            return c;
+        if (clean && c->dirty)
+            continue;
+        if (!e || (uint16_t)(cache_clock - c->used) > (uint16_t)(cache_clock - e->used))
+            e = c;
+    }
+    return e;
+}
+#endif
+
+/**
+ * Store a sector in the cache, replacing the least recently used clean
+ * entry. If every entry is dirty, the drive of the oldest is written back
+ * first; should that fail, the sector isn't stored and the error returned.
+ */
+static FRESULT cache_store(uint8_t drv, uint16_t track, uint8_t sector, const uint8_t *buf, uint8_t dirty)
+{
+    FRESULT fr = FR_OK;
+#if DISK_CACHE_SECTORS > 0
+    cache_entry *e = cache_find(drv, track, sector);
+    if (!e) {
+        if (!(e = cache_victim(1))) {
+            fr = cache_flush(cache_victim(0)->drv - 1);
+            if (!(e = cache_victim(1)))
+                return fr;
+        }
+        e->drv = drv + 1;
+        e->track = track;
+        e->sector = sector;
+        e->used = ++cache_clock;
+    }
+    memcpy(e->data, buf, SECTORSIZE);
+    e->dirty |= dirty;
+    fr = FR_OK;
+#endif
+    return fr;
+}
+
+/**
+ * Discard cached sectors for a drive, or all drives if drv is 0xff.
+ * Dirty sectors are written back first.
+ */
+void drive_cache_clear(uint8_t drv)
+{
+#if DISK_CACHE_SECTORS > 0
+    FRESULT fr;
+    for (uint8_t i = 0; i < NUMDRIVES; i++)
+        if ((drv == 0xff || drv == i) && (fr = cache_flush(i)) != FR_OK)
+            printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+    for (uint8_t i = 0; i < DISK_CACHE_SECTORS; i++)
+        if (drv == 0xff || drive_cache[i].drv == drv + 1)
+            drive_cache[i].drv = 0;
+#endif
+    if (drv == 0xff)
+        drive_cache_hits = drive_cache_misses = 0;
+}
+
+/**
+ * Read a sector from a disk image, using the cache when possible
+ */
+static FRESULT sector_read(uint8_t drv, uint16_t track, uint8_t sector, uint8_t *buf)
+{
+    FRESULT fr;
+    UINT br;
+    cache_entry *e;
+
+#if DISK_RAM_SIZE > 0
+    if (drives[drv].ram_page)
+        return ram_transfer(drv, OFFSET(track, sector), buf, SECTORSIZE, 0);
+#endif
+    if ((e = cache_find(drv, track, sector))) {
+        drive_cache_hits++;
+        memcpy(buf, e->data, SECTORSIZE);
+        return FR_OK;
+    }
+    drive_cache_misses++;
+    if ((fr = image_read(drv, OFFSET(track, sector), buf, &br)) != FR_OK)
+        return fr;
+    // Don't cache partial sectors past the end of the image; a read that
+    // finds no room is simply not cached
+    if (br == SECTORSIZE)
+        cache_store(drv, track, sector, buf, 0);
+    return FR_OK;
+}
+
+/**
+ * Write a sector to a disk image. With the cache enabled the write is
+ * deferred until the drive is flushed.
+ */
+static FRESULT sector_write(uint8_t drv, uint16_t track, uint8_t sector, const uint8_t *buf)
+{
+#if DISK_RAM_SIZE > 0
+    if (drives[drv].ram_page)
+        return ram_transfer(drv, OFFSET(track, sector), (uint8_t *)buf, SECTORSIZE, 1);
+#endif
+#if DISK_CACHE_SECTORS > 0
+    return cache_store(drv, track, sector, buf, 1);
+#else
+    return image_write(drv, OFFSET(track, sector), buf);
+#endif
+}
+
+/**
+ * Read a sector of a mounted drive by track and physical sector; returns a FatFs result
+ */
+uint8_t drive_sector_read(uint8_t drv, uint16_t track, uint8_t sector, uint8_t *buf)
+{
+    if (drv >= NUMDRIVES || !(drives[drv].status & (1 << S_MOUNTED)) || drives[drv].hd512)
+        return FR_NOT_READY;
+    if (track >= NUMTRACKS || sector >= NUMSECTORS)
+        return FR_INVALID_PARAMETER;
+    return sector_read(drv, track, sector, buf);
+}
+
+/**
+ * Write a sector of a mounted drive by track and physical sector; returns a FatFs result
+ */
+uint8_t drive_sector_write(uint8_t drv, uint16_t track, uint8_t sector, const uint8_t *buf)
+{
+    if (drv >= NUMDRIVES || !(drives[drv].status & (1 << S_MOUNTED)) || drives[drv].hd512)
+        return FR_NOT_READY;
+    if (track >= NUMTRACKS || sector >= NUMSECTORS)
+        return FR_INVALID_PARAMETER;
+    return sector_write(drv, track, sector, buf);
+}
+
+// Sectors read from the image at a time while booting
+#define BOOT_SECTORS 4
+#if NUMSECTORS % BOOT_SECTORS
+#error BOOT_SECTORS must divide NUMSECTORS
+#endif
+
+/**
+ * Read consecutive sectors of drive 0 for booting, from RAM or by continuing
+ * a sequential read of the image
+ */
+static FRESULT boot_read(uint16_t track, uint8_t sector, uint8_t *buf)
+{
+    FRESULT fr;
+    UINT br;
+
+#if DISK_RAM_SIZE > 0
+    if (drives[0].ram_page)
+        return ram_transfer(0, OFFSET(track, sector), buf, BOOT_SECTORS * SECTORSIZE, 0);
+#endif
+    if ((fr = f_read(&drives[0].fp, buf, BOOT_SECTORS * SECTORSIZE, &br)) != FR_OK)
+        return fr;
+    memset(buf + br, 0xE5, BOOT_SECTORS * SECTORSIZE - br);
+    return FR_OK;
+}
+
+/**
+ * Load the CP/M boot tracks of the disk image mounted on drive 0 into memory
+ * below end, or as far as the disk says if end is 0
+ *
+ * The boot tracks are interleaved two to one, so loading them in memory
+ * order would seek back and forth within each track. Instead each track is
+ * read front to back, a few sectors at a time, and the payloads are scattered
+ * to their addresses under one bus session per track.
+ */
+int drive_bootload(uint16_t end)
+{
+    FRESULT fr;
+    uint8_t buf[BOOT_SECTORS * SECTORSIZE];
+    uint8_t skip, sector, k;
+    uint16_t track, total, idx;
+    uint16_t loaded = 0;
+
+    if (!(drives[0].status & (1 << S_MOUNTED))) {
+        printf_P(PSTR("boot error: drive 0 not mounted\n"));
+        return 0;
+    }
+    if (drives[0].hd512) {
+        printf_P(PSTR("boot error: drive 0 is a 512-byte sector image\n"));
+        return 0;
+    }
+    if ((fr = sector_read(0, 0, 0, buf)) != FR_OK) {
+        printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
+        return 0;
+    }
+    if (buf[0] == 0xE5 && buf[1] == 0xE5 && buf[2] == 0xE5) {
+        // SIMH disks
+        skip = 4;
+        if (!end)
             end = 0x5c00;
-            // SIMH BIOS expects the bootloader to be there even though we don't use it
-            mem_write_P(0xff00, simhboot_bin, simhboot_bin_len);
-        } else {
-            // Other disks
-            sector = 0;
+        // SIMH BIOS expects the bootloader to be there even though we don't use it
+        mem_write_P(0xff00, simhboot_bin, simhboot_bin_len);
+    } else {
+        // Other disks
+        skip = 0;
+        if (!end)
             end = buf[1] | (buf[2] << 8);
-        }
-        for (addr = 0; addr < 0x5c00; addr += 0x80) {
-            if ((fr = f_lseek(&drives[0].fp, OFFSET(track, sector))) != FR_OK) {
-                printf_P(PSTR("seek error: %S\n"), strlookup(fr_text, fr));
-                return 0;
-            }
-            if ((fr = f_read(&drives[0].fp, buf, SECTORSIZE, &read)) != FR_OK) {
+        if (!end)
+            end = 0x5c00;
+    }
+    total = ((uint32_t)end + 0x7f) / 0x80;
+
+    // Pending writes must reach the image before reading it directly
+#if DISK_RAM_SIZE > 0
+    if (!drives[0].ram_page)
+#endif
+    if ((fr = cache_flush(0)) != FR_OK || (fr = drive_seek(0, 0)) != FR_OK) {
+        printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
+        return 0;
+    }
+    for (track = 0; loaded < total && track < NUMTRACKS; track++) {
+        if (!bus_begin())
+            return 0;
+        for (sector = 0; sector < NUMSECTORS; sector++) {
+            if (sector % BOOT_SECTORS == 0 && (fr = boot_read(track, sector, buf)) != FR_OK) {
+                bus_end();
                 printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
                 return 0;
             }
-            mem_write(addr, buf+3, 0x80);
-            sector += 2;
-            if (sector == NUMSECTORS)
-                sector = 1;
-            else if (sector > NUMSECTORS) {
-                sector = 0;
-                track++;
-            }
+            // Even sectors come first in memory, then odd ones
+            k = (sector & 1) ? NUMSECTORS / 2 + sector / 2 : sector / 2;
+            if (track == 0 && k < skip)
+                continue;
+            idx = track * NUMSECTORS + k - skip;
+            if (idx >= total)
+                continue;
+            mem_write_bare(idx * 0x80, &buf[(sector % BOOT_SECTORS) * SECTORSIZE + 3], 0x80);
+            loaded++;
         }
-    } else {
-        printf_P(PSTR("boot error: drive 0 not mounted\n"));
-        return 0;
+        bus_end();
     }
     return 1;
 }
@@ -232,16 +934,70 @@ void drive_unmount(uint8_t drv)
         return;
     }
     FRESULT fr;
+    drive_cache_clear(drv);
+#if DISK_RAM_SIZE > 0
+    if (drives[drv].ram_page && (fr = ram_writeback(drv)) != FR_OK)
+        printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+    drives[drv].ram_page = 0;
+#endif
+#if DISK_RAW_LBA
+    if ((fr = raw_invalidate(drv)) != FR_OK)
+        printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+    drives[drv].linkmap = LM_NONE;
+#endif
     if ((fr = f_close(&drives[drv].fp)) != FR_OK) {
         printf_P(PSTR("error unmounting disk: %S\n"), strlookup(fr_text, fr));
     }
     drives[drv].status &= ~(1 << S_MOUNTED);
+    drives[drv].dirty = 0;
+    drives[drv].hd512 = 0;
+}
+
+/**
+ * Write back cached sectors and sync disk images to the SD card
+ */
+void drive_sync(void)
+{
+    FRESULT fr;
+    for (uint8_t i = 0; i < NUMDRIVES; i++) {
+        if (!(drives[i].status & (1 << S_MOUNTED)))
+            continue;
+        if ((fr = cache_flush(i)) != FR_OK)
+            printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+#if DISK_CLMT_LEN > 0
+        if (drives[i].linkmap == LM_STALE)
+            drive_linkmap(i);
+#endif
+        if (!drives[i].dirty)
+            continue;
+        if ((fr = f_sync(&drives[i].fp)) != FR_OK)
+            printf_P(PSTR("sync error: %S\n"), strlookup(fr_text, fr));
+        else
+            drives[i].dirty = 0;
+    }
+#if DISK_RAW_LBA
+    if ((fr = raw_flush(0xff)) != FR_OK)
+        printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+#endif
 }
 
 /**
- * Mount a disk image
+ * Write modified RAM disks back to their images, for one drive or all if drv is 0xff
  */
-void drive_mount(uint8_t drv, char *filename) 
+void drive_writeback(uint8_t drv)
+{
+#if DISK_RAM_SIZE > 0
+    FRESULT fr;
+    for (uint8_t i = 0; i < NUMDRIVES; i++)
+        if ((drv == 0xff || drv == i) && drives[i].ram_page && (fr = ram_writeback(i)) != FR_OK)
+            printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+#endif
+}
+
+/**
+ * Mount a disk image, optionally copying it to paged RAM to serve sectors from there
+ */
+void drive_mount(uint8_t drv, char *filename, uint8_t flags) 
 {
     if (drv >= NUMDRIVES) {
         printf_P(PSTR("error: valid drive numbers are 0-%d\n"), NUMDRIVES-1);
@@ -250,11 +1006,20 @@ void drive_mount(uint8_t drv, char *filename)
     FRESULT fr;
     if (drives[drv].status & (1 << S_MOUNTED))
         drive_unmount(drv);
+    drive_cache_clear(drv);
     if ((fr = f_open(&drives[drv].fp, filename, FA_READ | FA_WRITE | FA_OPEN_ALWAYS)) != FR_OK) {
         printf_P(PSTR("error mounting disk: %S"), strlookup(fr_text, fr));
         return;
     }
     drives[drv].status |= 1 << S_MOUNTED;
+    drives[drv].hd512 = (flags & MOUNT_HD512) != 0;
+    drive_linkmap(drv);
+#if DISK_RAM_SIZE > 0
+    if ((flags & MOUNT_RAM) && (fr = ram_load(drv)) != FR_OK) {
+        printf_P(PSTR("error loading RAM disk: %S\n"), strlookup(fr_text, fr));
+        drive_unmount(drv);
+    }
+#endif
 }
 
 /**
@@ -263,7 +1028,6 @@ void drive_mount(uint8_t drv, char *filename)
 void write_sector(void) 
 {
     FRESULT fr;
-    UINT bw;
     uint8_t i;
 
     if (!selected)
@@ -272,12 +1036,17 @@ void write_sector(void)
     for (i = selected->byte; i < SECTORSIZE; i++)
         sectorbuf[i] = 0;
 
-    if ((fr = f_lseek(&selected->fp, OFFSET(selected->track, selected->sector))) != FR_OK) {
-        printf_P(PSTR("seek error: %S\n"), strlookup(fr_text, fr));
-    } else {
-        if ((fr = f_write(&selected->fp, sectorbuf, SECTORSIZE, &bw)) != FR_OK) {
-            printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
-        }
+#if DISK_RAM_SIZE > 0
+    if (selected->ram_page) {
+        ram_store_drv = selected - drives;
+        ram_store_ofs = OFFSET(selected->track, selected->sector);
+        dma_function = &ram_dma;
+    } else
+#endif
+    if ((fr = sector_write(selected - drives, selected->track, selected->sector, sectorbuf)) != FR_OK) {
+        printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+        // The 88-DISK has no error bit, so report the drive disabled until it is selected again
+        selected->status &= ~(1 << S_ENABLED);
     }
     selected->status &= ~(1 << S_WRITERDY);
     selected->byte = 0xff;
@@ -289,8 +1058,12 @@ void write_sector(void)
  */
 void drive_select(uint8_t newdrv) 
 {
+    FRESULT fr;
     if (dirtysector)
         write_sector();
+    if (selected && (newdrv >= NUMDRIVES || selected != &drives[newdrv]) &&
+            (fr = cache_flush(selected - drives)) != FR_OK)
+        printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
     if (selected) {
         selected->status &= (1 << S_MOUNTED);
         selected->sector = 0xff;
@@ -393,6 +1166,11 @@ uint8_t drive_sector(void)
             selected->sector = 0;
         }
         selected->byte = 0xff;
+#if DISK_RAM_SIZE > 0
+        // The first byte must be ready before the read that asks for it
+        if (selected->ram_page)
+            ram_fetch(0, 1);
+#endif
         return (selected->sector << 1);
     } else {
         return 0;
@@ -425,7 +1203,6 @@ void drive_write(uint8_t data)
 uint8_t drive_read(void) 
 {
     FRESULT fr;
-    UINT br;
     uint8_t i;
 
     if (!selected) {
@@ -437,12 +1214,15 @@ uint8_t drive_read(void)
         selected->byte++;
         return sectorbuf[i];
     } else {
-        if ((fr = f_lseek(&selected->fp, OFFSET(selected->track, selected->sector))) != FR_OK) {
-            printf_P(PSTR("seek error: %S\n"), strlookup(fr_text, fr));
-        } else {
-            if ((fr = f_read(&selected->fp, sectorbuf, SECTORSIZE, &br)) != FR_OK) {
-                printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
-            }
+#if DISK_RAM_SIZE > 0
+        if (selected->ram_page) {
+            ram_fetch(1, SECTORSIZE - 1);
+            selected->byte = 1;
+            return sectorbuf[0];
+        }
+#endif
+        if ((fr = sector_read(selected - drives, selected->track, selected->sector, sectorbuf)) != FR_OK) {
+            printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
         }
         selected->byte = 1;
         return sectorbuf[0];
@@ -491,6 +1271,38 @@ uint8_t drive_read(void)
         ld   (hsecsiz), a
         in   a,(hdskPort)   ; Read MSB of disk's physical sector size.
         ld   (hsecsiz+1), a
+    4.  Multi-sector read / write (z80ctrl extension)
+        Same as read / write, but the parameter block has one more byte
+        giving the number of consecutive sectors to transfer. Sectors
+        continue onto the next track after sector 31 and the DMA address
+        advances by 128 bytes per sector.
+        cmd:        db  HDSK_READ_MULTI or HDSK_WRITE_MULTI
+        hd:         db  0
+        sector:     db  0
+        track:      dw  0
+        dma:        dw  0
+        count:      db  32  ; 1 .. 255, number of sectors
+        ld  b,8             ; size of parameter block
+    5.  Asynchronous read / write (z80ctrl extension, needs HDSK_ASYNC)
+        Same parameter block as multi-sector read / write. The result only
+        says whether the command was accepted; the Z80 then runs on while
+        the sectors are transferred in the background, HDSK_ASYNC sectors
+        at a time. Poll the status port until it stops reporting busy:
+        0 when done, 1 on error, 80h while busy. Memory is only touched
+        while the Z80 is polling, so the BIOS must not change the buffer
+        until that. With the interrupt controller, the hdsk source is
+        pending whenever a poll would make progress or report the end.
+        cmd:        db  HDSK_READ_ASYNC or HDSK_WRITE_ASYNC
+    l:  in  a,(HDSK_STATUS)
+        or  a
+        jp  m,l             ; still busy
+    6.  Native 512-byte images (z80ctrl extension, mount -hd)
+        Sectors are 512 bytes, 16 to a track, up to 1024 tracks (8MB), and
+        unskewed, so each sector is exactly one SD block of the image. The
+        DMA address advances by 512 bytes per sector. HDSK_PARAM returns a
+        DPB generated for the image (OFF 1, PSH 2, PHM 3; 4K blocks and 1024
+        directory entries) and the BIOS deblocks CP/M records itself.
+        Asynchronous commands aren't available on these drives.
 */
 
 #define CPM_OK                  0               /* indicates to CP/M everything ok          */
@@ -502,6 +1314,12 @@ uint8_t drive_read(void)
 #define HDSK_READ               2
 #define HDSK_WRITE              3
 #define HDSK_PARAM              4
+#define HDSK_READ_MULTI         5
+#define HDSK_WRITE_MULTI        6
+#define HDSK_READ_ASYNC         7
+#define HDSK_WRITE_ASYNC        8
+
+#define HDSK_BUSY               0x80
 
 uint8_t skew[] =  { 
     0,  17, 2,  19, 4,  21, 6,  23,
@@ -520,34 +1338,232 @@ uint8_t dpb[] = {
 #define DPBLEN 19
 #define CMDLEN 6
 
+// Native 512-byte HDSK images
+#define HD_SECSIZE 512ul
+#define HD_SECTORS 16           // sectors per track
+#define HD_TRACKS 1024          // 8MB
+#define HD_RESERVED 1           // system tracks
+#define HD_BLOCK 4096           // CP/M allocation block
+#define HD_OFFSET(track, sector) (((uint32_t)(track) * HD_SECTORS + (sector)) * HD_SECSIZE)
+
+static uint8_t hd_dpb[DPBLEN];
+static uint8_t *hdsk_dpb = dpb;
+
 uint8_t hdsk_command;
 uint8_t drive_dma_index;
 uint8_t dma_disk;
 uint8_t dma_sector;
 uint16_t dma_track;
 uint16_t dma_addr;
+uint8_t dma_count;
 
 /**
- * Perform DMA disk read
+ * Set when a DMA transfer fails. The result of a command is read before its
+ * transfer runs, so the failure is reported by the next command instead.
  */
-void hdsk_dma_read()
+static uint8_t hdsk_failed = 0;
+
+/**
+ * Choose the DPB for HDSK_PARAM, generating one sized to a native image
+ */
+static void hdsk_param(uint8_t drv)
+{
+    uint32_t tracks;
+    uint16_t dsm;
+    uint8_t *p = hd_dpb;
+
+    hdsk_dpb = dpb;
+    if (drv >= NUMDRIVES || !(drives[drv].status & (1 << S_MOUNTED)) || !drives[drv].hd512)
+        return;
+    // A new or oversized image gets the full 8MB
+    tracks = f_size(&drives[drv].fp) / (HD_SECTORS * HD_SECSIZE);
+    if (tracks <= HD_RESERVED + 1 || tracks > HD_TRACKS)
+        tracks = HD_TRACKS;
+    dsm = (tracks - HD_RESERVED) * (HD_SECTORS * HD_SECSIZE / HD_BLOCK) - 1;
+    *p++ = HD_SECTORS * HD_SECSIZE / 128;   // SPT in 128-byte records
+    *p++ = 0;
+    *p++ = 5;                               // BSH, BLM for 4K blocks
+    *p++ = 31;
+    *p++ = dsm > 255 ? 1 : 3;               // EXM
+    *p++ = dsm & 0xff;
+    *p++ = dsm >> 8;
+    *p++ = 0xff;                            // DRM 1023
+    *p++ = 0x03;
+    *p++ = 0xff;                            // AL0, AL1: 8 directory blocks
+    *p++ = 0x00;
+    *p++ = 0;                               // CKS: fixed disk
+    *p++ = 0;
+    *p++ = HD_RESERVED;                     // OFF
+    *p++ = 0;
+    *p++ = 2;                               // PSH, PHM for 512-byte sectors
+    *p++ = 3;
+    *p++ = HD_SECSIZE & 0xff;
+    *p++ = HD_SECSIZE >> 8;
+    hdsk_dpb = hd_dpb;
+}
+
+/**
+ * Transfer a 512-byte sector of a native image to or from memory (bus must
+ * already be mastered). Where the image's blocks are known the sector is
+ * one SD block, moved straight between memory and a block buffer; a write
+ * claims the buffer without reading the old contents.
+ */
+static FRESULT hd512_transfer(uint8_t drv, uint32_t ofs, uint16_t addr, uint8_t write)
+{
+    drive *d = &drives[drv];
+    uint8_t buf[0x80];
+    FRESULT fr;
+    uint16_t i;
+    UINT n;
+
+#if DISK_RAM_SIZE > 0
+    if (d->ram_page) {
+        for (i = 0; i < HD_SECSIZE; i += sizeof buf) {
+            if (write)
+                mem_read_bare(addr + i, buf, sizeof buf);
+            if ((fr = ram_transfer(drv, ofs + i, buf, sizeof buf, write)) != FR_OK)
+                return fr;
+            if (!write)
+                mem_write_bare(addr + i, buf, sizeof buf);
+        }
+        return FR_OK;
+    }
+#endif
+#if DISK_RAW_LBA
+    if (raw_ok(drv, ofs, HD_SECSIZE)) {
+        DWORD block = raw_lba(drv, ofs);
+        raw_entry *r = block ? raw_get(drv, d->fp.obj.fs, block, !write) : NULL;
+        if (!r)
+            return FR_DISK_ERR;
+        if (write) {
+            mem_read_bare(addr, r->data, HD_SECSIZE);
+            r->dirty = 1;
+        } else {
+            mem_write_bare(addr, r->data, HD_SECSIZE);
+        }
+        return FR_OK;
+    }
+#endif
+    if (write) {
+#if DISK_CLMT_LEN > 0
+        if (d->fp.cltbl && ofs + HD_SECSIZE > f_size(&d->fp)) {
+            d->fp.cltbl = NULL;
+            d->linkmap = LM_STALE;
+        }
+#endif
+        // Fill any gap left by growing the image as erased, like unwritten sectors read
+        if (ofs > f_size(&d->fp)) {
+            if ((fr = drive_seek(drv, f_size(&d->fp))) != FR_OK)
+                return fr;
+            memset(buf, CPM_EMPTY, sizeof buf);
+            while (f_tell(&d->fp) < ofs) {
+                i = ofs - f_tell(&d->fp) < sizeof buf ? ofs - f_tell(&d->fp) : sizeof buf;
+                if ((fr = f_write(&d->fp, buf, i, &n)) != FR_OK)
+                    return fr;
+                if (n < i)
+                    return FR_DENIED;
+            }
+        }
+    }
+    if ((fr = drive_seek(drv, ofs)) != FR_OK)
+        return fr;
+    for (i = 0; i < HD_SECSIZE; i += sizeof buf) {
+        if (write) {
+            mem_read_bare(addr + i, buf, sizeof buf);
+            if ((fr = f_write(&d->fp, buf, sizeof buf, &n)) != FR_OK)
+                return fr;
+            d->dirty = 1;
+        } else {
+            if ((fr = f_read(&d->fp, buf, sizeof buf, &n)) != FR_OK)
+                return fr;
+            memset(buf + n, CPM_EMPTY, sizeof buf - n);
+            mem_write_bare(addr + i, buf, sizeof buf);
+        }
+    }
+    return FR_OK;
+}
+
+/**
+ * Transfer consecutive sectors between a native image and memory
+ */
+static void hd512_dma_transfer(uint8_t write, uint8_t count)
+{
+    FRESULT fr;
+    uint8_t sector = dma_sector < HD_SECTORS ? dma_sector : 0;
+    uint16_t track = dma_track < HD_TRACKS ? dma_track : 0;
+    uint16_t addr = dma_addr;
+
+    if (!bus_begin())
+        return;
+    while (count--) {
+        if ((fr = hd512_transfer(dma_disk, HD_OFFSET(track, sector), addr, write)) != FR_OK) {
+            printf_P(PSTR("dma %S error: %S\n"), write ? PSTR("write") : PSTR("read"), strlookup(fr_text, fr));
+            hdsk_failed = 1;
+            break;
+        }
+        addr += HD_SECSIZE;
+        if (++sector >= HD_SECTORS) {
+            sector = 0;
+            if (++track >= HD_TRACKS)
+                track = 0;
+        }
+    }
+    bus_end();
+}
+
+/**
+ * Transfer consecutive sectors between disk and memory under a single bus request
+ */
+void hdsk_dma_transfer(uint8_t write, uint8_t count)
 {
-    UINT br;
     FRESULT fr;
     uint8_t buf[SECTORSIZE+1];
-    if (dma_sector >= NUMSECTORS)
-        dma_sector = 0;
-    if (dma_track >= NUMTRACKS) 
-        dma_track = 0;
-    dma_sector = skew[dma_sector];
-    //printf_P(PSTR("read disk %d sector %d track %d address %04x\n"), dma_disk, dma_sector, dma_track, dma_addr);
-    if ((fr = f_lseek(&drives[dma_disk].fp, OFFSET(dma_track, dma_sector))) != FR_OK) {
-        printf_P(PSTR("dma seek error: %S\n"), strlookup(fr_text, fr));
-    } else if ((fr = f_read(&drives[dma_disk].fp, buf, SECTORSIZE, &br)) != FR_OK) {
-        printf_P(PSTR("dma read error: %S\n"), strlookup(fr_text, fr));
-    } else {
-        mem_write(dma_addr, buf+3, 0x80);
+    uint8_t sector = dma_sector < NUMSECTORS ? dma_sector : 0;
+    uint16_t track = dma_track < NUMTRACKS ? dma_track : 0;
+    uint16_t addr = dma_addr;
+
+    if (dma_disk >= NUMDRIVES || !(drives[dma_disk].status & (1 << S_MOUNTED))) {
+        printf_P(PSTR("dma error: drive %d not mounted\n"), dma_disk);
+        return;
+    }
+    if (drives[dma_disk].hd512) {
+        hd512_dma_transfer(write, count);
+        return;
     }
+    if (!bus_begin())
+        return;
+    while (count--) {
+        if (write) {
+            mem_read_bare(addr, buf+3, 0x80);
+            if ((fr = sector_write(dma_disk, track, skew[sector], buf)) != FR_OK) {
+                printf_P(PSTR("dma write error: %S\n"), strlookup(fr_text, fr));
+                hdsk_failed = 1;
+                break;
+            }
+        } else {
+            if ((fr = sector_read(dma_disk, track, skew[sector], buf)) != FR_OK) {
+                printf_P(PSTR("dma read error: %S\n"), strlookup(fr_text, fr));
+                hdsk_failed = 1;
+                break;
+            }
+            mem_write_bare(addr, buf+3, 0x80);
+        }
+        addr += 0x80;
+        if (++sector >= NUMSECTORS) {
+            sector = 0;
+            if (++track >= NUMTRACKS)
+                track = 0;
+        }
+    }
+    bus_end();
+}
+
+/**
+ * Perform DMA disk read
+ */
+void hdsk_dma_read()
+{
+    hdsk_dma_transfer(0, 1);
 }
 
 /**
@@ -555,24 +1571,170 @@ void hdsk_dma_read()
  */
 void drive_dma_write()
 {
-    UINT bw;
+    hdsk_dma_transfer(1, 1);
+}
+
+/**
+ * Perform multi-sector DMA disk read
+ */
+void hdsk_dma_read_multi()
+{
+    hdsk_dma_transfer(0, dma_count);
+}
+
+/**
+ * Perform multi-sector DMA disk write
+ */
+void hdsk_dma_write_multi()
+{
+    hdsk_dma_transfer(1, dma_count);
+}
+
+#ifdef HDSK_ASYNC
+#define ASYNC_IDLE 0
+#define ASYNC_SD 1          // the background task has sectors to transfer
+#define ASYNC_BUS 2         // the staging buffer waits for a poll to reach memory
+#define ASYNC_DONE 3
+#define ASYNC_ERROR 4
+
+static uint8_t async_state;
+static uint8_t async_write;
+static uint8_t async_disk;
+static uint8_t async_sector;
+static uint16_t async_track;
+static uint16_t async_addr;
+static uint8_t async_count;     // sectors not yet transferred to or from the card
+static uint8_t async_staged;    // sectors held in the staging buffer
+static uint8_t async_buf[HDSK_ASYNC * 0x80];
+
+/**
+ * Move the staging buffer to or from memory; runs as the DMA function of a poll
+ */
+static void async_copy(void)
+{
+    uint16_t len;
+
+    if (!bus_begin()) {
+        async_state = ASYNC_ERROR;
+        return;
+    }
+    if (async_write) {
+        async_staged = async_count < HDSK_ASYNC ? async_count : HDSK_ASYNC;
+        len = async_staged * 0x80;
+        mem_read_bare(async_addr, async_buf, len);
+        async_state = ASYNC_SD;
+    } else {
+        len = async_staged * 0x80;
+        mem_write_bare(async_addr, async_buf, len);
+        async_state = async_count ? ASYNC_SD : ASYNC_DONE;
+    }
+    bus_end();
+    async_addr += len;
+#ifdef INTCTL_BASE
+    intctl_check = 1;
+#endif
+}
+
+/**
+ * Background task transferring staged sectors to or from the card while the Z80 runs
+ */
+void hdsk_async_task(void)
+{
     FRESULT fr;
     uint8_t buf[SECTORSIZE+1];
-    if (dma_sector >= NUMSECTORS)
-        dma_sector = 0;
-    if (dma_track >= NUMTRACKS) 
-        dma_track = 0;
-    dma_sector = skew[dma_sector];
-    //printf_P(PSTR("write disk %d sector %d track %d address %04x\n"), dma_disk, dma_sector, dma_track, dma_addr);
-    if ((fr = f_lseek(&drives[dma_disk].fp, OFFSET(dma_track, dma_sector))) != FR_OK) {
-        printf_P(PSTR("dma seek error: %S\n"), strlookup(fr_text, fr));
+
+    if (async_state != ASYNC_SD)
+        return;
+    if (!async_write)
+        async_staged = async_count < HDSK_ASYNC ? async_count : HDSK_ASYNC;
+    for (uint8_t i = 0; i < async_staged; i++) {
+        if (async_write) {
+            memcpy(buf+3, &async_buf[i * 0x80], 0x80);
+            fr = sector_write(async_disk, async_track, skew[async_sector], buf);
+        } else {
+            fr = sector_read(async_disk, async_track, skew[async_sector], buf);
+            memcpy(&async_buf[i * 0x80], buf+3, 0x80);
+        }
+        if (fr != FR_OK) {
+            printf_P(PSTR("async %S error: %S\n"), async_write ? PSTR("write") : PSTR("read"), strlookup(fr_text, fr));
+            async_state = ASYNC_ERROR;
+            return;
+        }
+        if (++async_sector >= NUMSECTORS) {
+            async_sector = 0;
+            if (++async_track >= NUMTRACKS)
+                async_track = 0;
+        }
+    }
+    async_count -= async_staged;
+    if (async_write)
+        async_state = async_count ? ASYNC_BUS : ASYNC_DONE;
+    else
+        async_state = ASYNC_BUS;
+#ifdef INTCTL_BASE
+    intctl_check = 1;
+#endif
+}
+
+/**
+ * Accept an asynchronous command from the parameter block; returns 0 if it can't start
+ */
+static uint8_t async_start(uint8_t write)
+{
+    if (async_state != ASYNC_IDLE || dma_disk >= NUMDRIVES || !(drives[dma_disk].status & (1 << S_MOUNTED)) ||
+            drives[dma_disk].hd512)
+        return 0;
+    async_write = write;
+    async_disk = dma_disk;
+    async_sector = dma_sector < NUMSECTORS ? dma_sector : 0;
+    async_track = dma_track < NUMTRACKS ? dma_track : 0;
+    async_addr = dma_addr;
+    async_count = dma_count;
+    async_staged = 0;
+    if (async_count == 0) {
+        async_state = ASYNC_DONE;
+    } else if (write) {
+        // Stage the first sectors before the Z80 is released
+        async_state = ASYNC_BUS;
+        dma_function = &async_copy;
     } else {
-        mem_read(dma_addr, buf+3, 0x80);
-        if ((fr = f_write(&drives[dma_disk].fp, buf, SECTORSIZE, &bw)) != FR_OK) {
-            printf_P(PSTR("dma write error: %S\n"), strlookup(fr_text, fr));
-        }        
+        async_state = ASYNC_SD;
     }
+    return 1;
+}
+
+/**
+ * Read the asynchronous status port, letting a waiting transfer make progress
+ */
+static uint8_t async_status(void)
+{
+    switch (async_state) {
+        case ASYNC_IDLE:
+            return CPM_OK;
+        case ASYNC_BUS:
+            dma_function = &async_copy;
+            return HDSK_BUSY;
+        case ASYNC_DONE:
+            async_state = ASYNC_IDLE;
+            return CPM_OK;
+        case ASYNC_ERROR:
+            async_state = ASYNC_IDLE;
+            return CPM_ERROR;
+        default:
+            return HDSK_BUSY;
+    }
+}
+
+#ifdef INTCTL_BASE
+/**
+ * Interrupt source: a poll of the status port would make progress or report the end
+ */
+static uint8_t async_pending(void)
+{
+    return async_state >= ASYNC_BUS;
 }
+#endif
+#endif
 
 /**
  * Initiate command and return status read from hard drive port
@@ -580,7 +1742,11 @@ void drive_dma_write()
 uint8_t drive_dma_result() 
 {
     uint8_t result = CPM_ERROR;
-    if ((drive_dma_index == CMDLEN) && ((hdsk_command == HDSK_READ) || (hdsk_command == HDSK_WRITE))) {
+    if (hdsk_failed && hdsk_command != HDSK_PARAM) {
+        hdsk_failed = 0;
+        hdsk_command = HDSK_NONE;
+        drive_dma_index = 0;
+    } else if ((drive_dma_index == CMDLEN) && ((hdsk_command == HDSK_READ) || (hdsk_command == HDSK_WRITE))) {
         if (hdsk_command == HDSK_READ)
             dma_function = &hdsk_dma_read;
         else
@@ -588,8 +1754,23 @@ uint8_t drive_dma_result()
         hdsk_command = HDSK_NONE;
         drive_dma_index = 0;
         result = CPM_OK;
+    } else if ((drive_dma_index == CMDLEN + 1) && ((hdsk_command == HDSK_READ_MULTI) || (hdsk_command == HDSK_WRITE_MULTI))) {
+        if (hdsk_command == HDSK_READ_MULTI)
+            dma_function = &hdsk_dma_read_multi;
+        else
+            dma_function = &hdsk_dma_write_multi;
+        hdsk_command = HDSK_NONE;
+        drive_dma_index = 0;
+        result = CPM_OK;
+#ifdef HDSK_ASYNC
+    } else if ((drive_dma_index == CMDLEN + 1) && ((hdsk_command == HDSK_READ_ASYNC) || (hdsk_command == HDSK_WRITE_ASYNC))) {
+        if (async_start(hdsk_command == HDSK_WRITE_ASYNC))
+            result = CPM_OK;
+        hdsk_command = HDSK_NONE;
+        drive_dma_index = 0;
+#endif
     } else if (hdsk_command == HDSK_PARAM) {
-        result = dpb[drive_dma_index++];
+        result = hdsk_dpb[drive_dma_index++];
         if (drive_dma_index >= DPBLEN) {
             hdsk_command = HDSK_NONE;
             drive_dma_index = 0;
@@ -604,9 +1785,13 @@ uint8_t drive_dma_result()
 void drive_dma_command(uint8_t data) 
 {
     if (hdsk_command == HDSK_PARAM) {
+        hdsk_param(data);
         drive_dma_index = 0;
-    } else if (hdsk_command == HDSK_READ || hdsk_command == HDSK_WRITE) {
-        if (drive_dma_index < CMDLEN) {
+    } else if (hdsk_command == HDSK_READ || hdsk_command == HDSK_WRITE ||
+               hdsk_command == HDSK_READ_MULTI || hdsk_command == HDSK_WRITE_MULTI ||
+               hdsk_command == HDSK_READ_ASYNC || hdsk_command == HDSK_WRITE_ASYNC) {
+        uint8_t cmdlen = (hdsk_command >= HDSK_READ_MULTI) ? CMDLEN + 1 : CMDLEN;
+        if (drive_dma_index < cmdlen) {
             switch(drive_dma_index) {
                 case 0:
                     dma_disk = data;
@@ -632,6 +1817,10 @@ void drive_dma_command(uint8_t data)
                     dma_addr += (data << 8);
                     drive_dma_index++;
                     break;
+                case 6:
+                    dma_count = data;
+                    drive_dma_index++;
+                    break;
                 default:
                     hdsk_command = HDSK_NONE;
                     drive_dma_index = 0;
@@ -640,11 +1829,81 @@ void drive_dma_command(uint8_t data)
             drive_dma_index = 0;
         }
     } else {
-        if ((HDSK_RESET <= data) && (data <= HDSK_PARAM)) {
+        if ((HDSK_RESET <= data) && (data <= HDSK_WRITE_ASYNC)) {
             hdsk_command = data;
         } else {
             hdsk_command = HDSK_RESET;
         }
         drive_dma_index = 0;
     }
-}
\ No newline at end of file
+}
+
+/**
+ * Read the floppy status, sector or data port
+ */
+static uint8_t drive_port_read(uint8_t offset)
+{
+    switch (offset) {
+        case DRIVE_STATUS - DRIVE_STATUS:
+            return drive_status();
+        case DRIVE_CONTROL - DRIVE_STATUS:
+            return drive_sector();
+        default:
+            return drive_read();
+    }
+}
+
+/**
+ * Write the floppy select, control or data port
+ */
+static void drive_port_write(uint8_t offset, uint8_t data)
+{
+    switch (offset) {
+        case DRIVE_STATUS - DRIVE_STATUS:
+            drive_select(data);
+            break;
+        case DRIVE_CONTROL - DRIVE_STATUS:
+            drive_control(data);
+            break;
+        default:
+            drive_write(data);
+    }
+}
+
+/**
+ * Read the hard disk result or asynchronous status port
+ */
+static uint8_t hdsk_port_read(uint8_t offset)
+{
+#ifdef HDSK_ASYNC
+    if (offset == HDSK_STATUS - DRIVE_DMA)
+        return async_status();
+#endif
+    return drive_dma_result();
+}
+
+/**
+ * Write the hard disk command port
+ */
+static void hdsk_port_write(uint8_t offset, uint8_t data)
+{
+    if (offset == 0)
+        drive_dma_command(data);
+}
+
+/**
+ * Register the floppy and hard disk ports
+ */
+void drive_init(void)
+{
+    iorq_register(PSTR("disk"), DRIVE_STATUS, 3, drive_port_read, drive_port_write);
+#ifdef HDSK_ASYNC
+    iorq_register(PSTR("hdsk"), DRIVE_DMA, 2, hdsk_port_read, hdsk_port_write);
+    sched_add(hdsk_async_task, 0);
+#ifdef INTCTL_BASE
+    intctl_register(async_pending);
+#endif
+#else
+    iorq_register(PSTR("hdsk"), DRIVE_DMA, 1, hdsk_port_read, hdsk_port_write);
+#endif
+}
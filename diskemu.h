@@ -32,10 +32,75 @@
 #define DRIVE_CONTROL 0x9
 #define DRIVE_DATA 0xA
 #define DRIVE_DMA 0xB
+#define HDSK_STATUS 0xC     // asynchronous transfer status, with HDSK_ASYNC
 
-int drive_bootload();
+// Number of 137-byte sectors held in the LRU sector cache (0 to disable)
+#ifndef DISK_CACHE_SECTORS
+#define DISK_CACHE_SECTORS 0
+#endif
+
+// Cluster link map entries per drive for fast seek (0 to disable);
+// an image with n fragments needs 2n+1 entries
+#ifndef DISK_CLMT_LEN
+#define DISK_CLMT_LEN 0
+#endif
+
+// Access images directly by SD block address, bypassing FatFs
+// (needs the cluster link map to locate the blocks)
+#ifndef DISK_RAW_LBA
+#define DISK_RAW_LBA (DISK_CLMT_LEN > 0)
+#endif
+#if DISK_RAW_LBA && DISK_CLMT_LEN == 0
+#error DISK_RAW_LBA requires DISK_CLMT_LEN
+#endif
+
+// RAM budget in bytes for the 512-byte block buffers of the raw LBA path;
+// with one per busy image (1024 for two), copies between drives don't
+// evict each other
+#ifndef DISK_BUF_RAM
+#define DISK_BUF_RAM 512
+#endif
+#define DISK_RAW_BUFS (DISK_BUF_RAM / 512)
+#if DISK_RAW_LBA && DISK_RAW_BUFS == 0
+#error DISK_BUF_RAM must be at least 512
+#endif
+
+// Physical RAM reserved for images mounted with mount -ram (needs paging)
+#ifndef PAGE_BASE
+#undef DISK_RAM_SIZE
+#define DISK_RAM_SIZE 0
+#endif
+#ifndef DISK_RAM_BASE
+#define DISK_RAM_BASE 0xA0000
+#endif
+#ifndef DISK_RAM_SIZE
+#define DISK_RAM_SIZE 0x60000
+#endif
+
+// drive_mount flags
+#define MOUNT_RAM 1         // serve the image from paged RAM
+#define MOUNT_HD512 2       // native HDSK image of 512-byte sectors
+
+// Bytes in an emulated disk sector, including the SIMH header and trailer
+#define DRIVE_SECTOR_LEN 137
+
+// Sectors staged in RAM per step of an asynchronous HDSK transfer
+#if defined(HDSK_ASYNC) && HDSK_ASYNC < 1
+#undef HDSK_ASYNC
+#endif
+
+extern uint32_t drive_cache_hits;
+extern uint32_t drive_cache_misses;
+
+int drive_bootload(uint16_t end);
+void drive_init(void);
 void drive_unmount(uint8_t drv);
-void drive_mount(uint8_t drv, char *filename);
+void drive_mount(uint8_t drv, char *filename, uint8_t flags);
+void drive_sync(void);
+uint8_t drive_sector_read(uint8_t drv, uint16_t track, uint8_t sector, uint8_t *buf);
+uint8_t drive_sector_write(uint8_t drv, uint16_t track, uint8_t sector, const uint8_t *buf);
+void drive_writeback(uint8_t drv);
+void drive_cache_clear(uint8_t drv);
 void drive_select(uint8_t newdrv);
 uint8_t drive_status();
 void drive_control(uint8_t cmd);
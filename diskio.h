@@ -84,6 +84,7 @@ void disk_timerproc (void);
 #define ISDIO_READ			55	/**< Read data form SD iSDIO register */
 #define ISDIO_WRITE			56	/**< Write data to SD iSDIO register */
 #define ISDIO_MRITE			57	/**< Masked write data to SD iSDIO register */
+#define MMC_PREERASE		58	/**< Set blocks to pre-erase for the next sequential write */
 
 /* ATA/CF specific command (Not used by FatFs) */
 #define ATA_GET_REV			60	/**< Get F/W revision */
@@ -4024,6 +4024,28 @@ FRESULT f_sync (
     LEAVE_FF(fs, res);
 }
 
+
+
+
+/*-----------------------------------------------------------------------*/
+/* Release the Disk Access Window                                        */
+/*-----------------------------------------------------------------------*/
+
+FRESULT f_syncwin (
+    FATFS* fs,		/* Filesystem object */
+    DWORD sector	/* Sector the caller is about to access directly */
+)
+{
+    FRESULT res = FR_OK;
+
+
+    if (sector == fs->winsect) {	/* Does the window hold the sector? */
+        res = sync_window(fs);		/* Write-back changes */
+        if (res == FR_OK) fs->winsect = 0xFFFFFFFF;	/* Invalidate window so the sector is read again */
+    }
+    return res;
+}
+
 #endif /* !FF_FS_READONLY */
 
 
@@ -24,13 +24,16 @@
  * @file flash.c Support for SST39SF0x0 flash
  */
 
-#include <util/delay.h>
+#include <avr/cpufunc.h>
 
 #include "flash.h"
 #include "bus.h"
+#include "timer.h"
 
 // Reference: http://ww1.microchip.com/downloads/en/DeviceDoc/20005022C.pdf
 
+#define FLASH_TIMEOUT_US 200000UL   // longer than the slowest operation (chip erase, 100ms)
+
 void flash_cmd_prefix(void)
 {
         SET_ADDR(0x5555);
@@ -43,17 +46,81 @@ void flash_cmd_prefix(void)
         WR_HI;
 }
 
-void flash_write(uint32_t addr, uint8_t *buf, uint32_t len)
+/**
+ * Read the byte at the current address (MREQ must be low); leaves the data bus as input
+ */
+static uint8_t flash_read_byte(void)
 {
+    uint8_t data;
+    DATA_INPUT;
+    RD_LO;
+    // Allow for output enable time and the input synchronizer
+    _NOP();
+    _NOP();
+    data = GET_DATA;
+    RD_HI;
+    return data;
+}
+
+/**
+ * Wait for a program or erase operation to finish (MREQ must be low and the
+ * address within the chip)
+ *
+ * DQ6 toggles on each read while the operation is in progress, so this
+ * returns as soon as the chip is done instead of after the worst case time.
+ * Returns 0 if the chip was still busy after FLASH_TIMEOUT_US.
+ */
+static uint8_t flash_wait(void)
+{
+    uint32_t start = timer_ticks();
+    uint8_t prev = flash_read_byte();
+    uint8_t cur, ok = 1;
+
+    for (;;) {
+        cur = flash_read_byte();
+        if (((prev ^ cur) & (1 << 6)) == 0)
+            break;
+        if (timer_ticks() - start > TIMER_TICKS_US(FLASH_TIMEOUT_US)) {
+            ok = 0;
+            break;
+        }
+        prev = cur;
+    }
+    DATA_OUTPUT;
+    return ok;
+}
+
+/**
+ * Program bytes from a buffer, skipping those already equal to the flash
+ * contents when diff is set; stops and returns 0 if a byte times out
+ */
+static uint8_t flash_program(uint32_t addr, uint8_t *buf, uint32_t len, uint8_t diff)
+{
+    uint8_t ok = 1;
+
     if (!bus_master())
-        return;
+        return 0;
     DATA_OUTPUT;
     // first two banks must be physical pages 0 and 1
     mem_page_bare(0, 0);
     mem_page_bare(1, 1);
     mem_page_bare(2, PAGE(addr));
     MREQ_LO;
-    for (uint32_t i = 0; i < len; i++) {
+    for (uint32_t i = 0; i < len; i++, addr++) {
+        if ((addr & 0x3fff) == 0) {
+            // Load page to write into bank 2
+            MREQ_HI;
+            mem_page_bare(2, PAGE(addr));
+            MREQ_LO;
+        }
+        if (diff) {
+            SET_ADDR((addr & 0x3fff) + 0x8000);
+            uint8_t data = flash_read_byte();
+            DATA_OUTPUT;
+            if (data == buf[i])
+                continue;
+        }
+
         // Send byte program command sequence
         flash_cmd_prefix();
         SET_ADDR(0x5555);
@@ -62,34 +129,90 @@ void flash_write(uint32_t addr, uint8_t *buf, uint32_t len)
         WR_HI;
 
         // Write byte
-        if ((addr & 0x3fff) == 0) {
-            // Load page to write into bank 3
-            MREQ_HI;
-            mem_page_bare(2, PAGE(addr));
-            MREQ_LO;
-        }
         SET_ADDR((addr & 0x3fff) + 0x8000);
         SET_DATA(buf[i]);
         WR_LO;
         WR_HI;
 
         // Wait for write to finish
-        _delay_us(20);
-        addr++;
+        if (!(ok = flash_wait()))
+            break;
     }
     MREQ_HI;
     DATA_INPUT;
     bus_slave();
+    return ok;
+}
+
+/**
+ * Program flash from a buffer; the bytes must be erased first.
+ * Returns 0 if the chip timed out or the bus wasn't available.
+ */
+uint8_t flash_write(uint32_t addr, uint8_t *buf, uint32_t len)
+{
+    return flash_program(addr, buf, len, 0);
+}
+
+/**
+ * Program only the bytes that differ from the buffer; the sector must not
+ * need erasing (see flash_compare). Returns 0 on failure like flash_write.
+ */
+uint8_t flash_write_diff(uint32_t addr, uint8_t *buf, uint32_t len)
+{
+    return flash_program(addr, buf, len, 1);
+}
+
+/**
+ * Compare flash with a buffer
+ *
+ * Returns 0 if they match, FLASH_PROGRAM if bytes differ but programming
+ * alone can produce them, or FLASH_PROGRAM | FLASH_ERASE if any bit would
+ * have to change from 0 to 1.
+ */
+uint8_t flash_compare(uint32_t addr, const uint8_t *buf, uint32_t len)
+{
+    uint8_t result = 0;
+    uint8_t data;
+
+    if (!bus_master())
+        return 0;
+    DATA_OUTPUT;
+    mem_page_bare(2, PAGE(addr));
+    MREQ_LO;
+    for (uint32_t i = 0; i < len; i++, addr++) {
+        if ((addr & 0x3fff) == 0) {
+            MREQ_HI;
+            DATA_OUTPUT;
+            mem_page_bare(2, PAGE(addr));
+            MREQ_LO;
+        }
+        SET_ADDR((addr & 0x3fff) + 0x8000);
+        data = flash_read_byte();
+        if (data != buf[i]) {
+            result |= FLASH_PROGRAM;
+            if (buf[i] & ~data) {
+                result |= FLASH_ERASE;
+                break;
+            }
+        }
+    }
+    MREQ_HI;
+    DATA_INPUT;
+    bus_slave();
+    return result;
 }
 
 
 /** 
- * Erase the 4KB sector that the address falls within
+ * Erase the 4KB sector that the address falls within, or the whole chip
+ * for an address past its end; returns 0 on failure like flash_write
  */
-void flash_erase(uint32_t addr)
+uint8_t flash_erase(uint32_t addr)
 {
+    uint8_t ok;
+
     if (!bus_master())
-        return;
+        return 0;
     DATA_OUTPUT;
     // first two banks must be physical pages 0 and 1
     mem_page_bare(0, 0);
@@ -108,7 +231,7 @@ void flash_erase(uint32_t addr)
         SET_DATA(0x10);
         WR_LO;
         WR_HI;
-        _delay_ms(100);
+        ok = flash_wait();
     } else {
         // Erase 4KB sector
         MREQ_HI;
@@ -118,9 +241,10 @@ void flash_erase(uint32_t addr)
         SET_DATA(0x30);
         WR_LO;
         WR_HI;
-        _delay_ms(100);
+        ok = flash_wait();
     }
     MREQ_HI;
     DATA_INPUT;
     bus_slave();
+    return ok;
 }
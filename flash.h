@@ -34,7 +34,14 @@
 #error "Flash support requires board revision 3 or higher"
 #endif
 
-void flash_erase(uint32_t addr);
-void flash_write(uint32_t addr, uint8_t *buf, uint32_t len);
+#define FLASH_SECTOR 4096   /**< size of an erasable sector */
+
+#define FLASH_PROGRAM 1     /**< flash_compare: some bytes need programming */
+#define FLASH_ERASE 2       /**< flash_compare: some bits need erasing first */
+
+uint8_t flash_erase(uint32_t addr);
+uint8_t flash_write(uint32_t addr, uint8_t *buf, uint32_t len);
+uint8_t flash_write_diff(uint32_t addr, uint8_t *buf, uint32_t len);
+uint8_t flash_compare(uint32_t addr, const uint8_t *buf, uint32_t len);
 
 #endif
\ No newline at end of file
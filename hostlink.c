@@ -0,0 +1,322 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file hostlink.c Framed binary protocol for host-side tools
+ *
+ * Host tools can drive the monitor over either UART without typing commands
+ * or scraping dump output. A frame is HL_SYNC, a command (or a status in a
+ * reply), a 16-bit little-endian payload length, the payload, and the
+ * CRC-16/CCITT of everything after the sync byte, most significant byte
+ * first. The host sends one request and waits for its reply. Bytes outside
+ * a frame are ignored, so the host can skip console or Z80 output on the
+ * same UART by scanning for the sync byte and checking the CRC. Ctrl-]
+ * between frames on the link, or any key on the console when the link is
+ * on UART 1, returns to the monitor.
+ */
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "hostlink.h"
+#include "bus.h"
+#include "z80.h"
+#include "diskemu.h"
+#include "uart.h"
+#include "timer.h"
+#include "xmodem.h"
+#ifdef TRACE_LEN
+#include "trace.h"
+#endif
+
+#define HL_TIMEOUT_MS 500       // longest gap between bytes of a frame
+#define HL_BREAK 0x1d           // Ctrl-]
+
+static uint8_t hl_uart;
+static uint16_t hl_crc;
+
+/**
+ * Receive bytes of a frame; returns 0 if the host stopped sending
+ */
+static uint8_t hl_read(uint8_t *buf, uint16_t len)
+{
+    uint32_t start;
+
+    while (len--) {
+        start = timer_ticks();
+        while (uart_testrx(hl_uart) == 0)
+            if (timer_ticks() - start >= HL_TIMEOUT_MS * TIMER_TICKS_US(1000))
+                return 0;
+        *buf++ = uart_getc(hl_uart);
+    }
+    return 1;
+}
+
+/**
+ * Send bytes of a reply, adding them to the CRC
+ */
+static void hl_put(const uint8_t *buf, uint16_t len)
+{
+    hl_crc = crc16_update(hl_crc, buf, len);
+    while (len--)
+        uart_putc(hl_uart, *buf++);
+}
+
+/**
+ * Start a reply whose payload will be sent with hl_put
+ */
+static void hl_begin(uint8_t status, uint16_t len)
+{
+    uint8_t hdr[] = { status, len & 0xff, len >> 8 };
+
+    uart_putc(hl_uart, HL_SYNC);
+    hl_crc = 0;
+    hl_put(hdr, sizeof hdr);
+}
+
+/**
+ * Finish a reply with its CRC
+ */
+static void hl_end(void)
+{
+    uart_putc(hl_uart, hl_crc >> 8);
+    uart_putc(hl_uart, hl_crc & 0xff);
+}
+
+/**
+ * Send a complete reply
+ */
+static void hl_reply(uint8_t status, const uint8_t *buf, uint16_t len)
+{
+    hl_begin(status, len);
+    hl_put(buf, len);
+    hl_end();
+}
+
+static uint16_t get16(const uint8_t *p)
+{
+    return p[0] | (p[1] << 8);
+}
+
+static uint32_t get32(const uint8_t *p)
+{
+    return get16(p) | ((uint32_t)get16(p + 2) << 16);
+}
+
+/**
+ * Stream a block of memory in one reply, using buf as the staging area
+ */
+static void hl_mem_read(uint32_t addr, uint16_t len, uint8_t *buf)
+{
+    uint16_t n;
+
+    if (!bus_begin()) {
+        hl_reply(HL_ERR_FAIL, NULL, 0);
+        return;
+    }
+    hl_begin(HL_OK, len);
+    while (len) {
+        n = len < 256 ? len : 256;
+        mem_read(addr, buf, n);
+        hl_put(buf, n);
+        addr += n;
+        len -= n;
+    }
+    hl_end();
+    bus_end();
+}
+
+#ifdef TRACE_LEN
+/**
+ * Send the captured trace window
+ */
+static void hl_trace(void)
+{
+    int16_t first;
+    uint16_t n = trace_window(&first);
+    uint8_t rec[5];
+    bus_stat s;
+
+    hl_begin(HL_OK, 2 + n * sizeof rec);
+    rec[0] = first & 0xff;
+    rec[1] = first >> 8;
+    hl_put(rec, 2);
+    for (uint16_t i = 0; i < n; i++) {
+        s = trace_record(i);
+        rec[0] = s.flags;
+        rec[1] = s.xflags;
+        rec[2] = s.addr & 0xff;
+        rec[3] = s.addr >> 8;
+        rec[4] = s.data;
+        hl_put(rec, sizeof rec);
+    }
+    hl_end();
+}
+#endif
+
+/**
+ * Carry out a request and send its reply; returns 1 when the link should close.
+ * The request buffer is reused for data going back to the host.
+ */
+static uint8_t hl_command(uint8_t cmd, uint8_t *p, uint16_t len)
+{
+    uint8_t status = HL_ERR_LEN;
+    uint8_t reply[5];
+    uint8_t rlen = 0;
+    bus_stat s;
+
+    switch (cmd) {
+    case HL_PING:
+        reply[0] = HL_VERSION;
+        reply[1] = HL_MAX_PAYLOAD & 0xff;
+        reply[2] = HL_MAX_PAYLOAD >> 8;
+        rlen = 3;
+        status = HL_OK;
+        break;
+    case HL_MEM_READ:
+        if (len != 6)
+            break;
+        hl_mem_read(get32(p), get16(p + 4), p);
+        return 0;
+    case HL_MEM_WRITE:
+        if (len < 4)
+            break;
+        mem_write(get32(p), p + 4, len - 4);
+        status = HL_OK;
+        break;
+    case HL_IO_IN:
+        if (len != 1)
+            break;
+        reply[0] = io_in(p[0]);
+        rlen = 1;
+        status = HL_OK;
+        break;
+    case HL_IO_OUT:
+        if (len != 2)
+            break;
+        io_out(p[0], p[1]);
+        status = HL_OK;
+        break;
+    case HL_RESET:
+        if (len != 0 && len != 4)
+            break;
+        z80_reset(len ? get32(p) : 0);
+        status = HL_OK;
+        break;
+    case HL_RUN:
+        if (len != 0 && len != 4)
+            break;
+        if (len && get32(p))
+            z80_run_cycles(get32(p));
+        else
+            z80_run();
+        s = bus_status();
+        reply[0] = s.flags;
+        reply[1] = s.xflags;
+        reply[2] = s.addr & 0xff;
+        reply[3] = s.addr >> 8;
+        reply[4] = s.data;
+        rlen = 5;
+        status = HL_OK;
+        break;
+    case HL_DISK_READ:
+        if (len != 4)
+            break;
+        if (drive_sector_read(p[0], get16(p + 1), p[3], p) != 0) {
+            status = HL_ERR_FAIL;
+            break;
+        }
+        hl_reply(HL_OK, p, DRIVE_SECTOR_LEN);
+        return 0;
+    case HL_DISK_WRITE:
+        if (len != 4 + DRIVE_SECTOR_LEN)
+            break;
+        status = drive_sector_write(p[0], get16(p + 1), p[3], p + 4) ? HL_ERR_FAIL : HL_OK;
+        // The host may drop the link at any time, so don't leave the write in the cache
+        if (status == HL_OK)
+            drive_sync();
+        break;
+#ifdef TRACE_LEN
+    case HL_TRACE:
+        if (len != 0)
+            break;
+        hl_trace();
+        return 0;
+#endif
+    case HL_EXIT:
+        hl_reply(HL_OK, NULL, 0);
+        return 1;
+    default:
+        status = HL_ERR_CMD;
+        break;
+    }
+    hl_reply(status, reply, status == HL_OK ? rlen : 0);
+    return 0;
+}
+
+/**
+ * Serve host link requests on a UART until the host closes the link
+ */
+void hostlink(uint8_t uart)
+{
+    uint8_t buf[HL_MAX_PAYLOAD];
+    uint8_t hdr[3];
+    uint8_t crc[2];
+    uint16_t len;
+
+    hl_uart = uart;
+    for (;;) {
+        while (uart_testrx(uart) == 0) {
+            if (uart != 0 && uart_testrx(0)) {
+                uart_getc(0);
+                return;
+            }
+        }
+        uint8_t c = uart_getc(uart);
+        if (c == HL_BREAK)
+            return;
+        if (c != HL_SYNC || !hl_read(hdr, sizeof hdr))
+            continue;
+        len = get16(hdr + 1);
+        if (len > HL_MAX_PAYLOAD) {
+            // Swallow the oversized payload so it isn't scanned for frames
+            while (len) {
+                uint16_t n = len < sizeof buf ? len : sizeof buf;
+                if (!hl_read(buf, n))
+                    break;
+                len -= n;
+            }
+            if (len == 0 && hl_read(crc, sizeof crc))
+                hl_reply(HL_ERR_LEN, NULL, 0);
+            continue;
+        }
+        if (!hl_read(buf, len) || !hl_read(crc, sizeof crc))
+            continue;
+        if (crc16_update(crc16_ccitt(hdr, sizeof hdr), buf, len) != ((crc[0] << 8) | crc[1])) {
+            hl_reply(HL_ERR_CRC, NULL, 0);
+            continue;
+        }
+        if (hl_command(hdr[0], buf, len))
+            return;
+    }
+}
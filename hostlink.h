@@ -0,0 +1,61 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file hostlink.h Framed binary protocol for host-side tools
+ */
+
+#ifndef HOSTLINK_H
+#define HOSTLINK_H
+
+#include <stdint.h>
+
+#define HL_SYNC 0xA5            /**< first byte of every frame */
+#define HL_VERSION 1
+
+// Commands
+#define HL_PING 0x00            /**< -> version, max payload (16 bits) */
+#define HL_MEM_READ 0x01        /**< addr (32 bits), len (16 bits) -> data */
+#define HL_MEM_WRITE 0x02       /**< addr (32 bits), data -> */
+#define HL_IO_IN 0x03           /**< port -> value */
+#define HL_IO_OUT 0x04          /**< port, value -> */
+#define HL_RESET 0x05           /**< [addr (32 bits)] -> */
+#define HL_RUN 0x06             /**< [cycles (32 bits)] -> bus status */
+#define HL_DISK_READ 0x07       /**< drive, track (16 bits), sector -> 137 bytes */
+#define HL_DISK_WRITE 0x08      /**< drive, track (16 bits), sector, 137 bytes -> */
+#define HL_TRACE 0x09           /**< -> first record number (16 bits), 5-byte records */
+#define HL_EXIT 0x7F            /**< -> ; returns to the monitor */
+
+// Reply status
+#define HL_OK 0
+#define HL_ERR_CRC 1
+#define HL_ERR_CMD 2
+#define HL_ERR_LEN 3
+#define HL_ERR_FAIL 4
+
+// Largest request payload: an address and a 256-byte block
+#define HL_MAX_PAYLOAD 260
+
+void hostlink(uint8_t uart);
+
+#endif
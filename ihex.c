@@ -71,7 +71,7 @@ const char ihex_rc_text[] PROGMEM = {
  */
 typedef struct {
     uint8_t count;
-    uint16_t addr;
+    uint32_t addr;
     uint8_t type;
     uint8_t rc;
 } ihex_rec;
@@ -144,7 +144,7 @@ ihex_rec ihex_to_bin(char *ihex, uint8_t *bin)
         record.rc = IHEX_CKSUM;
         return record;
     }
-    if (record.type == IHEX_DATA || record.type == IHEX_EOF)
+    if (record.type == IHEX_DATA || record.type == IHEX_EOF || (record.type == IHEX_ELA && record.count == 2))
         record.rc = IHEX_OK;
     else
         record.rc = IHEX_RECTYPE;
@@ -152,28 +152,97 @@ ihex_rec ihex_to_bin(char *ihex, uint8_t *bin)
 }
 
 /**
- * Load an Intel HEX file into memory
+ * Bytes read from a file at a time
  */
-ihex_res load_ihex(FILE *file)
+#define IHEX_BLOCK 128
+
+/**
+ * Size of the buffer in which contiguous records are merged before writing
+ */
+#define IHEX_STAGE 256
+
+/**
+ * Source of Intel HEX lines, either a stdio stream or a FatFS file
+ */
+typedef struct {
+    FILE *file;
+    FIL *fil;
+    char *buf;
+    uint8_t pos;
+    uint8_t len;
+} ihex_src;
+
+/**
+ * Read a line from the source, a block at a time for FatFS files
+ */
+static char *ihex_gets(char *s, int size, ihex_src *src)
+{
+    char *p = s;
+    UINT br;
+
+    if (src->fil == NULL)
+        return fgets(s, size, src->file);
+    while (p < s + size - 1) {
+        if (src->pos == src->len) {
+            if (f_read(src->fil, src->buf, IHEX_BLOCK, &br) != FR_OK || br == 0)
+                break;
+            src->pos = 0;
+            src->len = br;
+        }
+        if ((*p++ = src->buf[src->pos++]) == '\n')
+            break;
+    }
+    *p = '\0';
+    return p == s ? NULL : s;
+}
+
+/**
+ * Load Intel HEX records from the source into memory
+ *
+ * Data records at consecutive addresses are decoded into a staging buffer
+ * and written out as one run, so a large image costs a fraction of the memory
+ * writes it would take with one per record. Extended linear address records
+ * set the upper 16 bits of the addresses that follow.
+ */
+static ihex_res ihex_load(ihex_src *src)
 {
     char ihex[524];
-    uint8_t bin[256];
+    uint8_t stage[IHEX_STAGE];
+    uint32_t stage_addr = 0;
+    uint16_t stage_len = 0;
     uint16_t line = 0;
+    uint32_t addr, upper = 0;
+    uint8_t count;
     ihex_rec record;
     ihex_res result;
-    result.min = 0xffff;
+    result.min = 0xffffffff;
     result.max = 0;
     result.total = 0;
     result.errors = 0;
+    if (!bus_begin())
+        return result;
     for (;;) {
-        if (fgets(ihex, 524, file) == NULL)
+        if (ihex_gets(ihex, 524, src) == NULL)
             break;
         if (strlen(ihex) == 0)
             break;
         line++;
-        record = ihex_to_bin(ihex, bin);
-        if (record.rc == IHEX_OK && record.type == IHEX_DATA && record.count > 0) {
-            mem_write(record.addr, bin, record.count);
+        // Peek at the count and address to decide whether this record extends the run
+        count = fromhex(ihex[1]) << 4 | fromhex(ihex[2]);
+        addr = upper | (uint16_t)(fromhex(ihex[3]) << 12 | fromhex(ihex[4]) << 8 | fromhex(ihex[5]) << 4 | fromhex(ihex[6]));
+        if (stage_len > 0 && (addr != stage_addr + stage_len || stage_len + count > IHEX_STAGE)) {
+            mem_write_bare(stage_addr, stage, stage_len);
+            stage_len = 0;
+        }
+        record = ihex_to_bin(ihex, stage + stage_len);
+        record.addr |= upper;
+        if (record.rc == IHEX_OK && record.type == IHEX_ELA) {
+            // The address bytes went into the staging buffer past the run; they aren't part of it
+            upper = (uint32_t)((uint16_t)stage[stage_len] << 8 | stage[stage_len + 1]) << 16;
+        } else if (record.rc == IHEX_OK && record.type == IHEX_DATA && record.count > 0) {
+            if (stage_len == 0)
+                stage_addr = record.addr;
+            stage_len += record.count;
             result.total += record.count;
             if (record.addr < result.min)
                 result.min = record.addr;
@@ -186,69 +255,181 @@ ihex_res load_ihex(FILE *file)
             result.errors++;
         }
     }
+    if (stage_len > 0)
+        mem_write_bare(stage_addr, stage, stage_len);
+    bus_end();
     return result;
 }
 
-#define BYTESPERLINE 16
+/**
+ * Load an Intel HEX file into memory from a stream
+ */
+ihex_res load_ihex(FILE *file)
+{
+    ihex_src src;
+    src.file = file;
+    src.fil = NULL;
+    return ihex_load(&src);
+}
 
 /**
- * Encode a byte array to a single Intel HEX record
+ * Load an Intel HEX file into memory from a FatFS file
  */
-void bin_to_ihex(uint8_t *bin, char *ihex, uint16_t addr, uint8_t count) 
+ihex_res load_ihex_file(FIL *fil)
 {
-    uint8_t check = count + (addr >> 8) + (addr & 0xff);
-    int i;
+    char buf[IHEX_BLOCK];
+    ihex_src src;
+    src.file = NULL;
+    src.fil = fil;
+    src.buf = buf;
+    src.pos = 0;
+    src.len = 0;
+    return ihex_load(&src);
+}
 
-    ihex[0] = ':';
-    ihex[1] = tohex(count >> 4);
-    ihex[2] = tohex(count & 0xf);
-    ihex[3] = tohex((addr >> 12) & 0xf);
-    ihex[4] = tohex((addr >> 8) & 0xf);
-    ihex[5] = tohex((addr >> 4) & 0xf);
-    ihex[6] = tohex(addr & 0xf);
-    ihex[7] = '0';
-    if (count > 0) {
-        ihex[8] = '0';
-    } else {
-        check += 1;
-        ihex[8] = '1';
+/**
+ * Bytes read from memory at a time when saving
+ */
+#define IHEX_CHUNK 256
+
+/**
+ * Size of the buffer in which output is gathered before writing to a file
+ */
+#define IHEX_OUTBUF 512
+
+/**
+ * Destination of Intel HEX output, either a stdio stream or a FatFS file
+ */
+typedef struct {
+    FILE *file;
+    FIL *fil;
+    char *buf;
+    uint16_t len;
+    int res;
+} ihex_dst;
+
+/**
+ * Write buffered output to the file
+ */
+static void ihex_flush(ihex_dst *dst)
+{
+    UINT bw;
+
+    if (dst->fil != NULL && dst->len > 0) {
+        if (f_write(dst->fil, dst->buf, dst->len, &bw) != FR_OK || bw != dst->len)
+            dst->res = EOF;
+        dst->len = 0;
     }
+}
+
+/**
+ * Output a single character, buffering it for FatFS files
+ */
+static void ihex_putc(ihex_dst *dst, char c)
+{
+    if (dst->fil == NULL) {
+        if (fputc(c, dst->file) == EOF)
+            dst->res = EOF;
+        return;
+    }
+    dst->buf[dst->len++] = c;
+    if (dst->len == IHEX_OUTBUF)
+        ihex_flush(dst);
+}
+
+/**
+ * Output a byte as two hex digits
+ */
+static void ihex_puthex(ihex_dst *dst, uint8_t b)
+{
+    ihex_putc(dst, tohex(b >> 4));
+    ihex_putc(dst, tohex(b & 0xf));
+}
+
+/**
+ * Encode a byte array as a single Intel HEX record
+ */
+static void ihex_record(ihex_dst *dst, const uint8_t *bin, uint16_t addr, uint8_t count, uint8_t type)
+{
+    uint8_t check = count + (addr >> 8) + (addr & 0xff) + type;
+    uint8_t i;
+
+    ihex_putc(dst, ':');
+    ihex_puthex(dst, count);
+    ihex_puthex(dst, addr >> 8);
+    ihex_puthex(dst, addr & 0xff);
+    ihex_puthex(dst, type);
     for (i = 0; i < count; i++) {
-        ihex[i*2+9] = tohex(bin[i] >> 4);
-        ihex[i*2+10] = tohex(bin[i] & 0xf);
+        ihex_puthex(dst, bin[i]);
         check += bin[i];
     }
-    check = ~check + 1;
-    ihex[count*2+9] = tohex(check >> 4);
-    ihex[count*2+10] = tohex(check & 0xf);
-    ihex[count*2+11] = '\0';
+    ihex_puthex(dst, ~check + 1);
+    ihex_putc(dst, '\n');
 }
 
 /**
- * Save a range of memory to an Intel HEX file
+ * Save a range of memory as Intel HEX records of up to reclen bytes
+ *
+ * Memory is read in chunks holding a whole number of records, within one
+ * bus session. Records don't cross a 64K boundary, and an extended linear
+ * address record precedes the first one in each 64K above the lowest.
  */
-int save_ihex(uint32_t start, uint16_t end, FILE *file)
+static int ihex_save(uint32_t start, uint32_t end, uint8_t reclen, ihex_dst *dst)
 {
-    uint8_t count;
-    char bin[BYTESPERLINE];
-    char ihex[BYTESPERLINE*2+12];
-    uint16_t i;
-    for (;;) {
-        if (end - start + 1 > BYTESPERLINE)
-            count = BYTESPERLINE;
-        else
-            count = end - start + 1;
-        mem_read(start, bin, count);
-        bin_to_ihex(bin, ihex, start, count);
-        if (fprintf_P(file, PSTR("%s\n"), ihex) == EOF)
-            return EOF;
-        start += count;
-        if (start > end) {
-            bin_to_ihex(bin, ihex, 0, 0);
-            if (fprintf_P(file, PSTR("%s\n"), ihex) == EOF)
-                return EOF;
-            break;
+    uint8_t bin[IHEX_CHUNK];
+    uint16_t chunk = (IHEX_CHUNK / reclen) * reclen;
+    uint16_t len, i, upper = 0;
+    uint32_t addr;
+    uint8_t count, ela[2];
+
+    dst->len = 0;
+    dst->res = 0;
+    if (!bus_begin())
+        return EOF;
+    while (start <= end && dst->res != EOF) {
+        len = end - start + 1 > chunk ? chunk : end - start + 1;
+        mem_read_bare(start, bin, len);
+        for (i = 0; i < len; i += count) {
+            addr = start + i;
+            if ((addr >> 16) != upper) {
+                upper = addr >> 16;
+                ela[0] = upper >> 8;
+                ela[1] = upper & 0xff;
+                ihex_record(dst, ela, 0, 2, IHEX_ELA);
+            }
+            count = len - i > reclen ? reclen : len - i;
+            if (0x10000 - (addr & 0xffff) < count)
+                count = 0x10000 - (addr & 0xffff);
+            ihex_record(dst, bin + i, addr, count, IHEX_DATA);
         }
+        start += len;
     }
-    return 0;
-}
\ No newline at end of file
+    bus_end();
+    ihex_record(dst, NULL, 0, 0, IHEX_EOF);
+    ihex_flush(dst);
+    return dst->res;
+}
+
+/**
+ * Save a range of memory to an Intel HEX stream
+ */
+int save_ihex(uint32_t start, uint32_t end, uint8_t reclen, FILE *file)
+{
+    ihex_dst dst;
+    dst.file = file;
+    dst.fil = NULL;
+    return ihex_save(start, end, reclen, &dst);
+}
+
+/**
+ * Save a range of memory to an Intel HEX FatFS file
+ */
+int save_ihex_file(uint32_t start, uint32_t end, uint8_t reclen, FIL *fil)
+{
+    char buf[IHEX_OUTBUF];
+    ihex_dst dst;
+    dst.file = NULL;
+    dst.fil = fil;
+    dst.buf = buf;
+    return ihex_save(start, end, reclen, &dst);
+}
@@ -30,14 +30,20 @@
 #include <stdint.h>
 #include <stdio.h>
 
+#include "ff.h"
+
 typedef struct {
-    uint16_t min;
-    uint16_t max;
-    uint16_t total;
+    uint32_t min;
+    uint32_t max;
+    uint32_t total;
     uint8_t errors;
 } ihex_res;
 
-int save_ihex(uint32_t start, uint16_t end, FILE *file);    /**< Save an intel hex file */
+#define IHEX_RECLEN 16                                      /**< Default number of data bytes per record */
+
+int save_ihex(uint32_t start, uint32_t end, uint8_t reclen, FILE *file);   /**< Save an intel hex file */
+int save_ihex_file(uint32_t start, uint32_t end, uint8_t reclen, FIL *fil);/**< Save an intel hex file to a FatFS file */
 ihex_res load_ihex(FILE *file);                             /**< Load an intel hex file */
+ihex_res load_ihex_file(FIL *fil);                          /**< Load an intel hex file from a FatFS file */
 
 #endif
\ No newline at end of file
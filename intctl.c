@@ -0,0 +1,127 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file intctl.c Interrupt controller driving the Z80 INT line
+ *
+ * Emulated devices register a function reporting whether they need service,
+ * and each gets a bit in the mask port. INT is asserted while any enabled
+ * source is pending. In IM2 the vector port supplies the low byte of the
+ * vector table address; the default of 0xFF is RST 38h in IM0 and is
+ * ignored in IM1.
+ *
+ * INT is on the I/O expander, so it is only changed from the IORQ handler
+ * and from the run loop with the IORQ interrupt masked. Other interrupt
+ * handlers set intctl_check to have the run loop look at the sources.
+ */
+
+#include <stdint.h>
+#include <avr/pgmspace.h>
+
+#include "intctl.h"
+#include "iorq.h"
+#include "bus.h"
+
+uint8_t intctl_vector = 0xFF;           /**< vector byte for interrupt acknowledge */
+volatile uint8_t intctl_check;          /**< set when a source may have changed */
+static uint8_t intctl_mask;             /**< sources enabled by the Z80 */
+uint8_t intctl_asserted;                /**< INT is being driven low */
+static intctl_fn intctl_sources[INTCTL_SOURCES];
+static uint8_t intctl_nsources;
+
+/**
+ * Add a source, returning its bit number in the mask or IORQ_NONE
+ */
+uint8_t intctl_register(intctl_fn pending)
+{
+    if (intctl_nsources == INTCTL_SOURCES)
+        return IORQ_NONE;
+    intctl_sources[intctl_nsources] = pending;
+    return intctl_nsources++;
+}
+
+/**
+ * Return the bit mask of sources needing service
+ */
+static uint8_t intctl_pending(void)
+{
+    uint8_t pending = 0;
+
+    for (uint8_t i = 0; i < intctl_nsources; i++)
+        if (intctl_sources[i]())
+            pending |= (1 << i);
+    return pending;
+}
+
+/**
+ * Drive INT to match the enabled pending sources
+ *
+ * Like reset, INT is only driven while asserted so other cards can share it.
+ */
+void intctl_update(void)
+{
+    intctl_check = 0;
+    if (intctl_pending() & intctl_mask) {
+        if (!intctl_asserted) {
+            INT_LO;
+            INT_OUTPUT;
+            intctl_asserted = 1;
+        }
+    } else if (intctl_asserted) {
+        INT_INPUT;
+        intctl_asserted = 0;
+    }
+}
+
+/**
+ * Disable all sources and release INT, as on a Z80 reset
+ */
+void intctl_reset(void)
+{
+    intctl_mask = 0;
+    intctl_vector = 0xFF;
+    intctl_update();
+}
+
+static uint8_t intctl_port_read(uint8_t offset)
+{
+    return offset == 0 ? intctl_pending() : intctl_vector;
+}
+
+static void intctl_port_write(uint8_t offset, uint8_t data)
+{
+    if (offset == 0) {
+        intctl_mask = data;
+        intctl_update();
+    } else {
+        intctl_vector = data;
+    }
+}
+
+/**
+ * Register the interrupt controller ports
+ */
+void intctl_init(void)
+{
+    iorq_register(PSTR("intctl"), INTCTL_BASE, 2, intctl_port_read, intctl_port_write);
+}
@@ -0,0 +1,52 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file intctl.h Interrupt controller driving the Z80 INT line
+ */
+
+#ifndef INTCTL_H
+#define INTCTL_H
+
+#include <stdint.h>
+
+#define INTCTL_MASK INTCTL_BASE         /**< read pending sources, write enabled sources */
+#define INTCTL_VECTOR (INTCTL_BASE+1)   /**< data byte supplied during interrupt acknowledge */
+
+#define INTCTL_SOURCES 8
+
+/**
+ * Returns nonzero while a source wants service
+ */
+typedef uint8_t (*intctl_fn)(void);
+
+extern uint8_t intctl_vector;
+extern uint8_t intctl_asserted;
+extern volatile uint8_t intctl_check;
+
+void intctl_init(void);
+uint8_t intctl_register(intctl_fn pending);
+void intctl_update(void);
+void intctl_reset(void);
+
+#endif
@@ -29,19 +29,28 @@
 #include "bus.h"
 #include "iox.h"
 #include "rtc.h"
-#include "diskemu.h"
-#include "sioemu.h"
-#include "msxkey.h"
+#include "timer.h"
+#include "trace.h"
+#include "intctl.h"
 
 #include <avr/interrupt.h>
 #include <avr/pgmspace.h>
 #include <stdio.h>
+#include <string.h>
 
 /**
  * Function pointer of to DMA transfer function to be run after IORQ is acknowledged
  */
 void (*dma_function)(void) = NULL;
 
+/**
+ * While iorq_slow_tally is set, CPU clocks spent with the clock slowed for a
+ * device, and the Z80 clocks emitted in them, measured on Timer3
+ */
+uint8_t iorq_slow_tally = 0;
+uint32_t iorq_slow_clocks;
+uint32_t iorq_slow_cycles;
+
 /**
  * IO registers
  */
@@ -60,128 +69,280 @@ static uint8_t iox_dev = 0;
 static uint8_t iox_reg = 0;
 #endif
 
+/**
+ * Registered devices and the device owning each port, plus one; 0 means unassigned
+ */
+iorq_device iorq_devices[IORQ_DEVICES];
+uint8_t iorq_ndevices = 0;
+uint8_t iorq_ports[256];
+
+#ifdef IORQ_STATS
+uint32_t iorq_reads[256];
+uint32_t iorq_writes[256];
+iorq_dev_stat iorq_dev_stats[IORQ_DEVICES + 1];
+
+const uint16_t iorq_hist_us[IORQ_HIST_BUCKETS - 1] PROGMEM = {
+    10, 30, 100, 300, 1000, 3000, 10000
+};
+
+static const uint16_t iorq_hist_ticks[IORQ_HIST_BUCKETS - 1] PROGMEM = {
+    TIMER_TICKS_US(10), TIMER_TICKS_US(30), TIMER_TICKS_US(100), TIMER_TICKS_US(300),
+    TIMER_TICKS_US(1000), TIMER_TICKS_US(3000), TIMER_TICKS_US(10000)
+};
 
 /**
- * Handle Z80 IO request
+ * Clear IO request statistics
  */
-void iorq_dispatch(uint8_t logged)
+void iorq_stats_reset(void)
 {
+    uint8_t sreg = SREG;
     cli();
-    switch (GET_ADDRLO) {
-#ifdef IOX_BASE
-        case IOX_DEVPORT:
-            if (!GET_WR) {
-                iox_dev = GET_DATA;
-            }
-            break;
-        case IOX_REGPORT:
-            if (!GET_WR) {
-                iox_reg = GET_DATA;
-            }
-            break;
-        case IOX_VALPORT:
-            if (!GET_WR) {
-                if (iox_dev == IOX_RTC)
-                    rtc_write1(iox_reg, GET_DATA);
-                else if (iox_dev >= IOX_GPIO_MIN && iox_dev <= IOX_GPIO_MAX)
-                    iox_write(iox_dev, iox_reg, GET_DATA);
-            } else if (!GET_RD) {
-                if (iox_dev == IOX_RTC)
-                    SET_DATA(rtc_read1(iox_reg));
-                else if (iox_dev >= IOX_GPIO_MIN && iox_dev <= IOX_GPIO_MAX)
-                    SET_DATA(iox_read(iox_dev, iox_reg));
-                DATA_OUTPUT;
-            }
+    memset(iorq_reads, 0, sizeof iorq_reads);
+    memset(iorq_writes, 0, sizeof iorq_writes);
+    memset(iorq_dev_stats, 0, sizeof iorq_dev_stats);
+    SREG = sreg;
+}
+
+/**
+ * Record the time spent servicing a request for a device
+ */
+static void iorq_stats_record(uint8_t dev, uint32_t ticks)
+{
+    iorq_dev_stat *s = &iorq_dev_stats[dev];
+    uint8_t i;
+    s->count++;
+    s->total += ticks;
+    if (ticks > s->max)
+        s->max = ticks;
+    for (i = 0; i < IORQ_HIST_BUCKETS - 1; i++)
+        if (ticks < pgm_read_word(&iorq_hist_ticks[i]))
             break;
+    s->hist[i]++;
+}
 #endif
-        case SIO0_STATUS:
-            if (!GET_RD) {
-                SET_DATA(ACIA_STATUS(0));
-                DATA_OUTPUT;
-            }
-            break;
-        case SIO1_STATUS:
-            if (!GET_RD) {
-                SET_DATA(ACIA_STATUS(1));
-                DATA_OUTPUT;
-            }
-            break;
-        case SIO0_DATA:
-            if (!GET_RD) {
-                SET_DATA(uart_getc(z80_uart[0]));
-                DATA_OUTPUT;
-            } else if (!GET_WR) {
-                uart_putc(z80_uart[0], GET_DATA);
-            }
-            break;
-        case SIO1_DATA:
-            if (!GET_RD) {
-                SET_DATA(uart_getc(z80_uart[1]));
-                DATA_OUTPUT;
-            } else if (!GET_WR) {
-                uart_putc(z80_uart[1], GET_DATA);
-            }
-            break;
-        case DRIVE_STATUS:
-            if (!GET_RD) {
-                SET_DATA(drive_status());
-                DATA_OUTPUT;
-            } else if (!GET_WR) {
-                drive_select(GET_DATA);
-            }
-            break;
-        case DRIVE_CONTROL:
-            if (!GET_RD) {
-                SET_DATA(drive_sector());
-                DATA_OUTPUT;
-            } else if (!GET_WR) {
-                drive_control(GET_DATA);
-            }
-            break;
-        case DRIVE_DATA:
-            if (!GET_RD) {
-                SET_DATA(drive_read());
-                DATA_OUTPUT;
-            } else if (!GET_WR) {
-                drive_write(GET_DATA);
-            }
-            break;
-        case DRIVE_DMA:
-            if (!GET_RD) { 
-                SET_DATA(drive_dma_result());
-                DATA_OUTPUT;
-            } else if (!GET_WR) {
-                drive_dma_command(GET_DATA);
-            }
+
+/**
+ * Assign a device to a range of ports, releasing the ones it had.
+ * Returns 0 if any of the new ports belong to another device.
+ */
+uint8_t iorq_map(uint8_t dev, uint8_t base)
+{
+    iorq_device *d = &iorq_devices[dev];
+    uint8_t sreg = SREG;
+    uint16_t i;
+
+    if (base + d->count > 256)
+        return 0;
+    for (i = base; i < base + d->count; i++)
+        if (iorq_ports[i] && iorq_ports[i] != dev + 1)
+            return 0;
+    cli();
+    for (i = 0; i < 256; i++)
+        if (iorq_ports[i] == dev + 1)
+            iorq_ports[i] = 0;
+    for (i = base; i < base + d->count; i++)
+        iorq_ports[i] = dev + 1;
+    d->base = base;
+    SREG = sreg;
+    return 1;
+}
+
+/**
+ * Register a device handling count ports starting at base.
+ * Either handler may be NULL; such requests are left to the bus.
+ * Returns the device number or IORQ_NONE if it couldn't be added.
+ */
+uint8_t iorq_register(const char *name, uint8_t base, uint8_t count, iorq_read_fn read, iorq_write_fn write)
+{
+    if (iorq_ndevices >= IORQ_DEVICES)
+        return IORQ_NONE;
+    uint8_t dev = iorq_ndevices++;
+    iorq_device *d = &iorq_devices[dev];
+    d->name = name;
+    d->count = count;
+    d->read = read;
+    d->write = write;
+    d->base = base;
+    d->clkdiv = 0;
+    if (!iorq_map(dev, base))
+        printf_P(PSTR("%S: ports %02X-%02X in use\n"), name, base, base + count - 1);
+    return dev;
+}
+
+/**
+ * Find a registered device by name
+ */
+uint8_t iorq_find(const char *name)
+{
+    for (uint8_t i = 0; i < iorq_ndevices; i++)
+        if (strcasecmp_P(name, iorq_devices[i].name) == 0)
+            return i;
+    return IORQ_NONE;
+}
+
+#ifdef IOX_BASE
+/**
+ * Read from the RTC or GPIO register selected by earlier writes
+ */
+static uint8_t iox_port_read(uint8_t offset)
+{
+    if (offset != IOX_VALPORT - IOX_BASE)
+        return 0xFF;
+    if (iox_dev == IOX_RTC)
+        return rtc_read1(iox_reg);
+    else if (iox_dev >= IOX_GPIO_MIN && iox_dev <= IOX_GPIO_MAX)
+        return iox_read(iox_dev, iox_reg);
+    return 0xFF;
+}
+
+/**
+ * Select a device and register, or write to the selected register
+ */
+static void iox_port_write(uint8_t offset, uint8_t data)
+{
+    switch (offset) {
+        case IOX_DEVPORT - IOX_BASE:
+            iox_dev = data;
             break;
-        case MSX_KEY_COL:
-            if (!GET_RD) {
-                SET_DATA(msx_scanrow());
-                DATA_OUTPUT;
-            }
+        case IOX_REGPORT - IOX_BASE:
+            iox_reg = data;
             break;
-        case MSX_KEY_ROW:
-            if (!GET_WR) {
-                msx_setrow(GET_DATA);
-            } 
+        case IOX_VALPORT - IOX_BASE:
+            if (iox_dev == IOX_RTC)
+                rtc_write1(iox_reg, data);
+            else if (iox_dev >= IOX_GPIO_MIN && iox_dev <= IOX_GPIO_MAX)
+                iox_write(iox_dev, iox_reg, data);
             break;
-        default:
-            if (!GET_RD) {
-                SET_DATA(0xFF);
-            }
     }
+}
+#endif
+
+/**
+ * Register the devices implemented in this file
+ */
+void iorq_init(void)
+{
+#ifdef IOX_BASE
+    iorq_register(PSTR("iox"), IOX_BASE, 3, iox_port_read, iox_port_write);
+#endif
+#ifdef SN76489_PORT
+    // The PSG itself is on the bus; it is registered so its writes can be slowed
+    uint8_t psg = iorq_register(PSTR("psg"), SN76489_PORT, 1, NULL, NULL);
+    if (psg != IORQ_NONE)
+        iorq_devices[psg].clkdiv = SN76489_CLKDIV;
+#endif
+}
+
+/**
+ * Handle Z80 IO request
+ */
+void iorq_dispatch(uint8_t logged)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint8_t port = GET_ADDRLO;
+    uint8_t dev = iorq_ports[port];
+    iorq_device *d = dev ? &iorq_devices[dev - 1] : NULL;
+    uint8_t slow = d && d->clkdiv > clkdiv;
+    uint16_t slow_start = 0;
+#ifdef IORQ_STATS
+    uint32_t start = timer_ticks();
+    if (!GET_RD)
+        iorq_reads[port]++;
+    else if (!GET_WR)
+        iorq_writes[port]++;
+#endif
+    // Slow devices on the bus get the slower clock for the rest of the cycle
+    if (slow) {
+        clk_set(d->clkdiv);
+        slow_start = TCNT3;
+    }
+    if (!GET_RD) {
+        if (d && d->read) {
+            SET_DATA(d->read(port - d->base));
+            DATA_OUTPUT;
+        } else {
+            SET_DATA(0xFF);
+        }
+    } else if (!GET_WR) {
+        if (d && d->write)
+            d->write(port - d->base, GET_DATA);
+#ifdef PAGE_BASE
+        if ((uint8_t)(port - PAGE_BASE) <= PAGE_ENABLE - PAGE_BASE)
+            mem_page_seen(port - PAGE_BASE, GET_DATA);
+#endif
+    }
+#ifdef INTCTL_BASE
+    else if (intctl_asserted) {
+        // Interrupt acknowledge: IORQ with M1 and neither RD nor WR
+        SET_DATA(intctl_vector);
+        DATA_OUTPUT;
+    }
+    // Drop INT before the Z80 can re-enable interrupts once its handler has drained the source
+    if (dev || intctl_check)
+        intctl_update();
+#endif
     if (logged) {
         bus_stat status = bus_status();
-        bus_log(status);
+        trace_log(status);
     }
     BUSRQ_LO;
     while (!GET_IORQ)
         CLK_TOGGLE;
+    if (slow) {
+        clk_set(clkdiv);
+        if (iorq_slow_tally) {
+            uint16_t t = TCNT3 - slow_start;
+            iorq_slow_clocks += t;
+            iorq_slow_cycles += t / d->clkdiv;
+        }
+    }
+    // Interrupts are off until the transfer is done, so don't let it lose a timebase overflow
+    timer_poll();
     if (dma_function) {
         dma_function();
         dma_function = NULL;
+        timer_poll();
     }
     DATA_INPUT;
+    // Discard pin changes caused by this cycle before the Z80 can start another
+    IORQ_INT_CLEAR;
     BUSRQ_HI;
+#ifdef IORQ_STATS
+    iorq_stats_record(dev ? dev - 1 : IORQ_DEVICES, timer_ticks() - start);
+#endif
+    SREG = sreg;
+}
+
+/**
+ * Service IO requests from the pin change interrupt while the Z80 runs
+ */
+ISR(IORQ_vect)
+{
+    if (!GET_IORQ)
+        iorq_dispatch(0);
+}
+
+/**
+ * Start servicing IO requests by interrupt
+ */
+void iorq_irq_start(void)
+{
+    cli();
+    IORQ_PCMSK |= (1 << IORQ_PCINT);
+    IORQ_INT_CLEAR;
+    IORQ_INT_ENABLE;
+    // A request already in progress won't generate a pin change
+    if (!GET_IORQ)
+        iorq_dispatch(0);
     sei();
 }
+
+/**
+ * Stop servicing IO requests by interrupt
+ */
+void iorq_irq_stop(void)
+{
+    IORQ_INT_DISABLE;
+    IORQ_PCMSK &= ~(1 << IORQ_PCINT);
+}
@@ -29,8 +29,58 @@
 
 #include <stdint.h>
 
+typedef uint8_t (*iorq_read_fn)(uint8_t offset);
+typedef void (*iorq_write_fn)(uint8_t offset, uint8_t data);
+
+/**
+ * Emulated device occupying a range of IO ports
+ */
+typedef struct {
+    const char *name;       // in program memory
+    iorq_read_fn read;      // called with the offset from base
+    iorq_write_fn write;
+    uint8_t base;
+    uint8_t count;
+    uint8_t clkdiv;         // divider to slow the clock to during access, or 0
+} iorq_device;
+
+#define IORQ_DEVICES 8
+#define IORQ_NONE 0xFF
+
+extern iorq_device iorq_devices[IORQ_DEVICES];
+extern uint8_t iorq_ndevices;
+extern uint8_t iorq_ports[256];
+
+void iorq_init(void);
+uint8_t iorq_register(const char *name, uint8_t base, uint8_t count, iorq_read_fn read, iorq_write_fn write);
+uint8_t iorq_map(uint8_t dev, uint8_t base);
+uint8_t iorq_find(const char *name);
 void iorq_dispatch(uint8_t logged); 
+void iorq_irq_start(void);
+void iorq_irq_stop(void);
 
 extern void (*dma_function)(void);
+extern uint8_t iorq_slow_tally;
+extern uint32_t iorq_slow_clocks;
+extern uint32_t iorq_slow_cycles;
+
+#ifdef IORQ_STATS
+// Latency histogram buckets; bounds are in iorq_hist_us and the last is open
+#define IORQ_HIST_BUCKETS 8
+
+typedef struct {
+    uint32_t count;
+    uint32_t total;         // timer ticks spent in dispatch
+    uint32_t max;
+    uint32_t hist[IORQ_HIST_BUCKETS];
+} iorq_dev_stat;
+
+extern uint32_t iorq_reads[256];
+extern uint32_t iorq_writes[256];
+extern iorq_dev_stat iorq_dev_stats[IORQ_DEVICES + 1];   // last is unassigned ports
+extern const uint16_t iorq_hist_us[IORQ_HIST_BUCKETS - 1];
+
+void iorq_stats_reset(void);
+#endif
 
  #endif
\ No newline at end of file
@@ -27,18 +27,108 @@
 #include "iox.h"
 #include "spi.h"
 
+/**
+ * Index of each cached register within a chip's shadow
+ */
+enum {SH_IODIRA, SH_IODIRB, SH_GPPUA, SH_GPPUB, SH_OLATA, SH_OLATB, SH_COUNT};
+
+/**
+ * Shadow copies of the output configuration registers for cached chips
+ */
+static uint8_t iox_shadow[8][SH_COUNT];
+
+/**
+ * Bit mask of chips whose registers are currently shadowed
+ */
+static uint8_t iox_cached = 0;
+
+/**
+ * Find a register's slot in the shadow, or -1 if it is not shadowed.
+ * Writes to GPIO land in OLAT, but reads of GPIO must go to the pins.
+ */
+static int8_t iox_shadow_index(uint8_t chipaddr, uint8_t regaddr, uint8_t write)
+{
+    if (!(iox_cached & (1 << chipaddr)))
+        return -1;
+    switch (regaddr) {
+        case IODIRA0:
+            return SH_IODIRA;
+        case IODIRB0:
+            return SH_IODIRB;
+        case GPPUA0:
+            return SH_GPPUA;
+        case GPPUB0:
+            return SH_GPPUB;
+        case GPIOA0:
+            return write ? SH_OLATA : -1;
+        case OLATA0:
+            return SH_OLATA;
+        case GPIOB0:
+            return write ? SH_OLATB : -1;
+        case OLATB0:
+            return SH_OLATB;
+        default:
+            return -1;
+    }
+}
+
+static uint8_t iox_read_raw(uint8_t chipaddr, uint8_t regaddr)
+{
+    uint8_t data;
+    iox_begin(READ | (chipaddr << 1), regaddr);
+    data = spi_exchange(0);
+    iox_end();
+    return data;
+}
+
+static void iox_write_raw(uint8_t chipaddr, uint8_t regaddr, uint8_t data)
+{
+    iox_begin(WRITE | (chipaddr << 1), regaddr);
+    spi_exchange(data);
+    iox_end();
+}
+
+/**
+ * Start shadowing a chip's registers, seeding the shadow from the chip
+ */
+void iox_cache_enable(uint8_t chipaddr)
+{
+    uint8_t regs[OLATB0 + 1];
+    chipaddr &= 7;
+    iox_cached &= ~(1 << chipaddr);
+    iox_read_burst(chipaddr, IODIRA0, regs, sizeof regs);
+    iox_shadow[chipaddr][SH_IODIRA] = regs[IODIRA0];
+    iox_shadow[chipaddr][SH_IODIRB] = regs[IODIRB0];
+    iox_shadow[chipaddr][SH_GPPUA] = regs[GPPUA0];
+    iox_shadow[chipaddr][SH_GPPUB] = regs[GPPUB0];
+    iox_shadow[chipaddr][SH_OLATA] = regs[OLATA0];
+    iox_shadow[chipaddr][SH_OLATB] = regs[OLATB0];
+    iox_cached |= (1 << chipaddr);
+}
+
+/**
+ * Stop shadowing a chip's registers
+ */
+void iox_cache_disable(uint8_t chipaddr)
+{
+    iox_cached &= ~(1 << (chipaddr & 7));
+}
+
 void iox_init(void)
 {
     spi_init();
     // Enable individually addressable chips
-    iox_write(0, IOCON0, (1 << HAEN));
+    iox_write_raw(0, IOCON0, (1 << HAEN));
+    for (uint8_t i = 0; i < 8; i++)
+        if (IOX_CACHE & (1 << i))
+            iox_cache_enable(i);
 }
 
 void iox_begin(uint8_t mode, uint8_t addr)
 {
+    uint8_t header[] = {SPI_ADDR | mode, addr};
     IOX_SEL;
-    spi_exchange(SPI_ADDR | mode);
-    spi_exchange(addr);
+    spi_send(header, sizeof header);
 }
 
 void iox_end(void)
@@ -48,36 +138,93 @@ void iox_end(void)
 
 uint8_t iox_read(uint8_t chipaddr, uint8_t regaddr)
 {
-    uint8_t data;
-    iox_begin(READ | (chipaddr << 1), regaddr);
-    data = spi_exchange(0);
-    iox_end();
-    return data;
+    chipaddr &= 7;
+    int8_t i = iox_shadow_index(chipaddr, regaddr, 0);
+    if (i >= 0)
+        return iox_shadow[chipaddr][i];
+    return iox_read_raw(chipaddr, regaddr);
 }
 
 void iox_write(uint8_t chipaddr, uint8_t regaddr, uint8_t data)
 {
+    chipaddr &= 7;
+    int8_t i = iox_shadow_index(chipaddr, regaddr, 1);
+    if (i >= 0) {
+        // Nothing to do if the register already holds this value
+        if (iox_shadow[chipaddr][i] == data)
+            return;
+        iox_shadow[chipaddr][i] = data;
+    }
+    iox_write_raw(chipaddr, regaddr, data);
+    // Register addresses move in bank 1 mode, so the shadow can't follow
+    if ((regaddr & ~1) == IOCON0 && (data & (1 << BANK)))
+        iox_cache_disable(chipaddr);
+}
+
+/**
+ * Read consecutive registers in a single frame using sequential addressing
+ */
+void iox_read_burst(uint8_t chipaddr, uint8_t regaddr, uint8_t *buf, uint8_t len)
+{
+    iox_begin(READ | ((chipaddr & 7) << 1), regaddr);
+    spi_receive(buf, len);
+    iox_end();
+}
+
+/**
+ * Write consecutive registers in a single frame using sequential addressing
+ */
+void iox_write_burst(uint8_t chipaddr, uint8_t regaddr, const uint8_t *buf, uint8_t len)
+{
+    chipaddr &= 7;
+    for (uint8_t i = 0; i < len; i++) {
+        int8_t j = iox_shadow_index(chipaddr, regaddr + i, 1);
+        if (j >= 0)
+            iox_shadow[chipaddr][j] = buf[i];
+    }
     iox_begin(WRITE | (chipaddr << 1), regaddr);
-    spi_exchange(data);
+    spi_send(buf, len);
     iox_end();
+    for (uint8_t i = 0; i < len; i++)
+        if (((regaddr + i) & ~1) == IOCON0 && (buf[i] & (1 << BANK)))
+            iox_cache_disable(chipaddr);
+}
+
+/**
+ * Read a port A/port B register pair, returning port B in the high byte
+ */
+uint16_t iox_read16(uint8_t chipaddr, uint8_t regaddr)
+{
+    uint8_t buf[2];
+    iox_read_burst(chipaddr, regaddr, buf, 2);
+    return buf[0] | (buf[1] << 8);
+}
+
+/**
+ * Write a port A/port B register pair, taking port B from the high byte
+ */
+void iox_write16(uint8_t chipaddr, uint8_t regaddr, uint16_t data)
+{
+    uint8_t buf[2] = {data & 0xFF, data >> 8};
+    iox_write_burst(chipaddr, regaddr, buf, 2);
 }
 
 void iox_extcs_init(uint8_t addr)
 {
     iox_write(addr, IODIRB0, iox_read(addr, IODIRB0) & 0x0F);
-    iox_write(addr, GPIOB0, iox_read(addr, GPIOB0) & 0xF0);
+    iox_write(addr, GPIOB0, iox_read(addr, OLATB0) & 0xF0);
 }
 
 void iox_extcs_lo(uint8_t c)
 {
     uint8_t addr = (c / 4) * 2 + 1;
     uint8_t pin = (c % 4) + 4;
-    iox_write(addr, GPIOB0, iox_read(addr, GPIOA0) & ~(1 << pin));
+    iox_write(addr, GPIOB0, iox_read(addr, OLATB0) & ~(1 << pin));
 }
 
 void iox_extcs_hi(uint8_t c)
 {
     uint8_t addr = (c / 4) * 2 + 1;
     uint8_t pin = (c % 4) + 4;
-    iox_write(addr, GPIOB0, iox_read(addr, GPIOA0) | (1 << pin));
+    iox_write(addr, GPIOB0, iox_read(addr, OLATB0) | (1 << pin));
 }
\ No newline at end of file
@@ -85,6 +85,14 @@
 #define MIRROR 6
 #define BANK 7
 
+/**
+ * Bit mask of chips whose IODIR, GPPU and OLAT registers are shadowed in RAM.
+ * Chip 0 drives the Z80 control lines and should always be included.
+ */
+#ifndef IOX_CACHE
+#define IOX_CACHE 0x01
+#endif
+
 #define SPI_ADDR 0x40
 #define WRITE 0
 #define READ 1
@@ -94,6 +102,12 @@ void iox_begin(uint8_t mode, uint8_t addr);
 void iox_end(void);
 uint8_t iox_read(uint8_t chipaddr, uint8_t regaddr);
 void iox_write(uint8_t chipaddr, uint8_t regaddr, uint8_t data);
+void iox_read_burst(uint8_t chipaddr, uint8_t regaddr, uint8_t *buf, uint8_t len);
+void iox_write_burst(uint8_t chipaddr, uint8_t regaddr, const uint8_t *buf, uint8_t len);
+uint16_t iox_read16(uint8_t chipaddr, uint8_t regaddr);
+void iox_write16(uint8_t chipaddr, uint8_t regaddr, uint16_t data);
+void iox_cache_enable(uint8_t chipaddr);
+void iox_cache_disable(uint8_t chipaddr);
 
 void iox_extcs_init(uint8_t addr);
 void iox_extcs_lo(uint8_t c);
@@ -21,6 +21,9 @@ DRESULT mmc_disk_read (BYTE* buff, DWORD sector, UINT count);
 DRESULT mmc_disk_write (const BYTE* buff, DWORD sector, UINT count);
 DRESULT mmc_disk_ioctl (BYTE cmd, void* buff);
 void mmc_disk_timerproc (void);
+void mmc_disk_idle (void);
+
+extern volatile UINT Timer;	/* Performance timer (100Hz increment) */
 
 #ifdef __cplusplus
 }
@@ -25,6 +25,7 @@
 #define SD_IODIR IODIRB0    // Direction register handling SD CD/EN lines
 #define SD_GPPU GPPUB0      // Pullup register handling SD CD/EN lines
 #define SD_GPIO GPIOB0      // GPIO register handling SD CD/EN lines
+#define SD_OLAT OLATB0      // Output latch register handling SD CD/EN lines
 #define SD_IOXADDR 0        // IO expander address handling SD CD/EN lines
 #define SD_EN 0             // SD power enable pin on IO expnader
 #define SD_CD 6             // SD chip detect pin on IO expander
@@ -71,11 +72,33 @@ static volatile
 DSTATUS Stat = STA_NOINIT;	/* Disk status */
 
 static volatile
-BYTE Timer1, Timer2;	/* 100Hz decrement timer */
+BYTE Timer1, Timer2, Timer3;	/* 100Hz decrement timer */
 
 static
 BYTE CardType;			/* Card type flags (b0:MMC, b1:SDv1, b2:SDv2, b3:Block addressing) */
 
+#define STREAM_TIMEOUT 10	/* Close an idle stream after 100ms */
+
+#define STREAM_READ 1
+#define STREAM_WRITE 2
+
+static
+BYTE Streaming;			/* READ_ or WRITE_MULTIPLE_BLOCK left open by the last transfer */
+
+static
+DWORD NextRead;			/* Card address following the last block read */
+
+#if _USE_WRITE
+static
+DWORD NextWrite = 0xFFFFFFFF;	/* Card address following the last block written */
+
+static
+DWORD EraseStart = 0xFFFFFFFF;	/* Card address of a write stream the caller announced */
+
+static
+DWORD EraseCount;		/* Number of blocks that stream will write */
+#endif
+
 volatile UINT Timer;    /* Performance timer (100Hz increment) */
 
 ISR(TIMER0_COMPA_vect)
@@ -122,7 +145,7 @@ void init_cden()
     iox_write(SD_IOXADDR, SD_GPPU, iox_read(SD_IOXADDR, SD_GPPU) | (1 << SD_CD));
 
     // Set SD enable high and make it an output
-    iox_write(SD_IOXADDR, SD_GPIO, iox_read(SD_IOXADDR, SD_GPIO) | (1 << SD_EN));
+    iox_write(SD_IOXADDR, SD_GPIO, iox_read(SD_IOXADDR, SD_OLAT) | (1 << SD_EN));
     iox_write(SD_IOXADDR, SD_IODIR, iox_read(SD_IOXADDR, SD_IODIR) & ~(1 << SD_EN));
 }
 
@@ -158,7 +181,7 @@ static
 void power_on (void)
 {
     // Set SDEN low to turn off voltage regulator
-    iox_write(SD_IOXADDR, SD_GPIO, iox_read(SD_IOXADDR, SD_GPIO) | (1 << SD_EN));
+    iox_write(SD_IOXADDR, SD_GPIO, iox_read(SD_IOXADDR, SD_OLAT) | (1 << SD_EN));
 }
 
 
@@ -166,7 +189,7 @@ static
 void power_off (void)
 {
     // Set SDEN high to turn on voltage regulator
-    iox_write(SD_IOXADDR, SD_GPIO, iox_read(SD_IOXADDR, SD_GPIO) & ~(1 << SD_EN));
+    iox_write(SD_IOXADDR, SD_GPIO, iox_read(SD_IOXADDR, SD_OLAT) & ~(1 << SD_EN));
 }
 
 
@@ -188,37 +211,10 @@ BYTE xchg_spi (		/* Returns received data */
 
 
 /* Receive a data block fast */
-static
-void rcvr_spi_multi (
-    BYTE *p,	/* Data read buffer */
-    UINT cnt	/* Size of data block */
-)
-{
-    do {
-        SPDR = 0xFF;
-        loop_until_bit_is_set(SPSR, SPIF);
-        *p++ = SPDR;
-        SPDR = 0xFF;
-        loop_until_bit_is_set(SPSR, SPIF);
-        *p++ = SPDR;
-    } while (cnt -= 2);
-}
-
+#define rcvr_spi_multi(p, cnt)	spi_receive((p), (cnt))
 
 /* Send a data block fast */
-static
-void xmit_spi_multi (
-    const BYTE *p,	/* Data block to be sent */
-    UINT cnt		/* Size of data block */
-)
-{
-    do {
-        SPDR = *p++;
-        loop_until_bit_is_set(SPSR, SPIF);
-        SPDR = *p++;
-        loop_until_bit_is_set(SPSR, SPIF);
-    } while (cnt -= 2);
-}
+#define xmit_spi_multi(p, cnt)	spi_send((p), (cnt))
 
 
 
@@ -260,6 +256,35 @@ void deselect (void)
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Close an open multiple block read                                     */
+/*-----------------------------------------------------------------------*/
+
+static BYTE send_cmd (BYTE cmd, DWORD arg);
+#if _USE_WRITE
+static int xmit_datablock (const BYTE *buff, BYTE token);
+#endif
+
+static
+void stop_stream (void)
+{
+    if (Streaming == STREAM_READ) {
+        CS_LOW();
+        send_cmd(CMD12, 0);		/* STOP_TRANSMISSION */
+        deselect();
+    }
+#if _USE_WRITE
+    if (Streaming == STREAM_WRITE) {
+        CS_LOW();
+        if (!xmit_datablock(0, 0xFD)) NextWrite = 0xFFFFFFFF;	/* STOP_TRAN token */
+        deselect();
+    }
+#endif
+    Streaming = 0;
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Select the card and wait for ready                                    */
 /*-----------------------------------------------------------------------*/
@@ -267,6 +292,7 @@ void deselect (void)
 static
 int select (void)	/* 1:Successful, 0:Timeout */
 {
+    stop_stream();	/* Any other transaction ends a read stream */
     CS_LOW();		/* Set CS# low */
     xchg_spi(0xFF);	/* Dummy clock (force DO enabled) */
 
@@ -348,7 +374,7 @@ BYTE send_cmd (		/* Returns R1 resp (bit7==1:Send failed) */
     DWORD arg		/* Argument */
 )
 {
-    BYTE n, res;
+    BYTE n, res, pkt[6];
 
 
     if (cmd & 0x80) {	/* ACMD<n> is the command sequense of CMD55-CMD<n> */
@@ -364,15 +390,16 @@ BYTE send_cmd (		/* Returns R1 resp (bit7==1:Send failed) */
     }
 
     /* Send command packet */
-    xchg_spi(0x40 | cmd);				/* Start + Command index */
-    xchg_spi((BYTE)(arg >> 24));		/* Argument[31..24] */
-    xchg_spi((BYTE)(arg >> 16));		/* Argument[23..16] */
-    xchg_spi((BYTE)(arg >> 8));			/* Argument[15..8] */
-    xchg_spi((BYTE)arg);				/* Argument[7..0] */
+    pkt[0] = 0x40 | cmd;				/* Start + Command index */
+    pkt[1] = (BYTE)(arg >> 24);			/* Argument[31..24] */
+    pkt[2] = (BYTE)(arg >> 16);			/* Argument[23..16] */
+    pkt[3] = (BYTE)(arg >> 8);			/* Argument[15..8] */
+    pkt[4] = (BYTE)arg;					/* Argument[7..0] */
     n = 0x01;							/* Dummy CRC + Stop */
     if (cmd == CMD0) n = 0x95;			/* Valid CRC for CMD0(0) + Stop */
     if (cmd == CMD8) n = 0x87;			/* Valid CRC for CMD8(0x1AA) Stop */
-    xchg_spi(n);
+    pkt[5] = n;
+    spi_send(pkt, sizeof pkt);
 
     /* Receive command response */
     if (cmd == CMD12) xchg_spi(0xFF);		/* Skip a stuff byte when stop reading */
@@ -400,6 +427,8 @@ DSTATUS mmc_disk_initialize (void)
 {
     BYTE n, cmd, ty, ocr[4];
 
+    Streaming = 0;
+    NextRead = 0xFFFFFFFF;
     init_cden();
     check_card();
 
@@ -473,30 +502,67 @@ DRESULT mmc_disk_read (
     UINT count			/* Sector count (1..128) */
 )
 {
-    BYTE cmd;
+    DWORD step;
 
     if (!count) return RES_PARERR;
     
     check_card();
-    if (Stat & STA_NOINIT) return RES_NOTRDY;
+    if (Stat & STA_NOINIT) {
+        Streaming = 0;
+        return RES_NOTRDY;
+    }
 
+    step = (CardType & CT_BLOCK) ? 1 : 512;
     if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
 
-    cmd = count > 1 ? CMD18 : CMD17;			/*  READ_MULTIPLE_BLOCK : READ_SINGLE_BLOCK */
-    if (send_cmd(cmd, sector) == 0) {
-        do {
-            if (!rcvr_datablock(buff, 512)) break;
-            buff += 512;
-        } while (--count);
-        if (cmd == CMD18) send_cmd(CMD12, 0);	/* STOP_TRANSMISSION */
+    /* Continue an open stream only if this read picks up where the last one ended */
+    if (Streaming && (Streaming != STREAM_READ || sector != NextRead || !Timer3)) stop_stream();
+
+    if (Streaming) {
+        CS_LOW();
+    } else if (count == 1 && sector != NextRead) {	/* Random access: READ_SINGLE_BLOCK */
+        if (send_cmd(CMD17, sector) == 0 && rcvr_datablock(buff, 512)) count = 0;
+        deselect();
+        NextRead = sector + step;
+        return count ? RES_ERROR : RES_OK;
+    } else {							/* Sequential access: open READ_MULTIPLE_BLOCK */
+        if (send_cmd(CMD18, sector) != 0) {
+            deselect();
+            NextRead = 0xFFFFFFFF;
+            return RES_ERROR;
+        }
+        Streaming = STREAM_READ;
+    }
+
+    do {
+        if (!rcvr_datablock(buff, 512)) break;
+        buff += 512;
+        sector += step;
+    } while (--count);
+    NextRead = sector;
+    Timer3 = STREAM_TIMEOUT;
+    deselect();						/* Stream stays open for the next block */
+    if (count) {
+        stop_stream();				/* Abandon the stream on error */
+        NextRead = 0xFFFFFFFF;
     }
-    deselect();
 
     return count ? RES_ERROR : RES_OK;
 }
 
 
 
+/*-----------------------------------------------------------------------*/
+/* Close the read or write stream if it has been idle                    */
+/*-----------------------------------------------------------------------*/
+
+void mmc_disk_idle (void)
+{
+    if (Streaming && !Timer3) stop_stream();
+}
+
+
+
 /*-----------------------------------------------------------------------*/
 /* Write Sector(s)                                                       */
 /*-----------------------------------------------------------------------*/
@@ -508,31 +574,54 @@ DRESULT mmc_disk_write (
     UINT count			/* Sector count (1..128) */
 )
 {
+    DWORD step;
+
     if (!count) return RES_PARERR;
 
     check_card();
-    if (Stat & STA_NOINIT) return RES_NOTRDY;
+    if (Stat & STA_NOINIT) {
+        Streaming = 0;
+        return RES_NOTRDY;
+    }
     if (Stat & STA_PROTECT) return RES_WRPRT;
 
+    step = (CardType & CT_BLOCK) ? 1 : 512;
     if (!(CardType & CT_BLOCK)) sector *= 512;	/* Convert to byte address if needed */
 
-    if (count == 1) {	/* Single block write */
-        if ((send_cmd(CMD24, sector) == 0)	/* WRITE_BLOCK */
-            && xmit_datablock(buff, 0xFE)) {
-            count = 0;
+    /* Continue an open stream only if this write picks up where the last one ended */
+    if (Streaming && (Streaming != STREAM_WRITE || sector != NextWrite || !Timer3)) stop_stream();
+
+    if (Streaming) {
+        CS_LOW();
+    } else if (count == 1 && sector != NextWrite && sector != EraseStart) {	/* Random access: WRITE_BLOCK */
+        if (send_cmd(CMD24, sector) == 0 && xmit_datablock(buff, 0xFE)) count = 0;
+        deselect();
+        NextWrite = sector + step;
+        return count ? RES_ERROR : RES_OK;
+    } else {							/* Sequential access: open WRITE_MULTIPLE_BLOCK */
+        if (CardType & CT_SDC)			/* Pre-erase the blocks known to follow */
+            send_cmd(ACMD23, sector == EraseStart && EraseCount > count ? EraseCount : count);
+        EraseStart = 0xFFFFFFFF;
+        if (send_cmd(CMD25, sector) != 0) {
+            deselect();
+            NextWrite = 0xFFFFFFFF;
+            return RES_ERROR;
         }
+        Streaming = STREAM_WRITE;
     }
-    else {				/* Multiple block write */
-        if (CardType & CT_SDC) send_cmd(ACMD23, count);
-        if (send_cmd(CMD25, sector) == 0) {	/* WRITE_MULTIPLE_BLOCK */
-            do {
-                if (!xmit_datablock(buff, 0xFC)) break;
-                buff += 512;
-            } while (--count);
-            if (!xmit_datablock(0, 0xFD)) count = 1;	/* STOP_TRAN token */
-        }
+
+    do {
+        if (!xmit_datablock(buff, 0xFC)) break;
+        buff += 512;
+        sector += step;
+    } while (--count);
+    NextWrite = sector;
+    Timer3 = STREAM_TIMEOUT;
+    deselect();						/* Stream stays open for the next block */
+    if (count) {
+        stop_stream();				/* Abandon the stream on error */
+        NextWrite = 0xFFFFFFFF;
     }
-    deselect();
 
     return count ? RES_ERROR : RES_OK;
 }
@@ -564,10 +653,18 @@ DRESULT mmc_disk_ioctl (
     res = RES_ERROR;
     switch (cmd) {
     case CTRL_SYNC :		/* Make sure that no pending write process. Do not remove this or written sector might not left updated. */
-        if (select()) res = RES_OK;
+        EraseStart = 0xFFFFFFFF;
+        if (select()) res = RES_OK;	/* Also closes a write stream */
         deselect();
         break;
 
+    case MMC_PREERASE :		/* Set the blocks the next write stream will cover (DWORD[2]: start LBA, count) */
+        dp = buff;
+        EraseStart = (CardType & CT_BLOCK) ? dp[0] : dp[0] * 512;
+        EraseCount = dp[1];
+        res = RES_OK;
+        break;
+
     case GET_SECTOR_COUNT :	/* Get number of sectors on the disk (DWORD) */
         if ((send_cmd(CMD9, 0) == 0) && rcvr_datablock(csd, 16)) {
             if ((csd[0] >> 6) == 1) {	/* SDC ver 2.00 */
@@ -719,4 +816,6 @@ void mmc_disk_timerproc (void)
     if (n) Timer1 = --n;
     n = Timer2;
     if (n) Timer2 = --n;
+    n = Timer3;
+    if (n) Timer3 = --n;
 }
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "msxkey.h"
 #include "uart.h"
+#include "iorq.h"
 
 // Table to translate ASCII to MSX keyboard matrix
 // Upper nybble is row; lower nybble is column
@@ -34,42 +35,98 @@ const uint8_t msx_key_matrix[128] PROGMEM = {
 #define ROW(s) (s >> 4)
 #define SHIFTED(s) (s & 8)
 #define BITS(s) ~(1 << (s & 7))
+#define SAME_KEY(a, b) (((a) & ~8) == ((b) & ~8))
 
+#define MSX_ROWS 11
+#define MSX_PRESS_SCANS 1   // full matrix scans a keystroke is held down for
+#define MSX_RELEASE_SCANS 1 // full matrix scans between two strokes of the same key
+
+// Key matrix as seen by the Z80, one active-low byte per row
+static uint8_t msx_matrix[MSX_ROWS] = {0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF, 0xFF};
 static uint8_t current_row = 0;
-static uint8_t shift_step = 0;
+static uint8_t last_row = 0;
+static uint8_t held_key = NO_KEY;   // scancode currently pressed in the matrix
+static uint8_t held_scans = 0;      // scans left before the matrix changes
 
-uint8_t msx_scanrow(void)
+/**
+ * Release every key in the matrix
+ */
+static void msx_release(void)
 {
-    if (uart_testrx(0) == 0)
-        return NO_KEY;
-
-    uint8_t c = uart_peek(0) & 0x7F;
-    uint8_t scancode = pgm_read_byte(&msx_key_matrix[c]);
-    uint8_t modkey = (c < 0x20) ? CTRL_KEY : SHIFT_KEY;
+    for (uint8_t i = 0; i < MSX_ROWS; i++)
+        msx_matrix[i] = 0xFF;
+    held_key = NO_KEY;
+}
 
-    if (scancode == NO_KEY) {
-        uart_getc(0);
-        return NO_KEY;
-    } else if (!SHIFTED(scancode) && current_row == ROW(scancode)) {
-        uart_getc(0);
-        return BITS(scancode);
-    } else if (SHIFTED(scancode)) {
-        if (shift_step == 0 && current_row == ROW(modkey)) {
-            shift_step = 1;
-            return BITS(modkey);
-        } else if (shift_step == 1 && current_row == ROW(scancode)) {
-            shift_step = 2;
-            return BITS(scancode);
-        } else if (shift_step == 2 && current_row == ROW(modkey)) {
-            shift_step = 0;
+/**
+ * Advance the keystroke schedule at the start of a scan of the matrix
+ *
+ * The matrix only changes between scans, so the BIOS always sees a key and
+ * its modifier together. A new key is pressed as soon as the previous one
+ * has been seen; the same key twice in a row gets a release scan between.
+ */
+static void msx_next_scan(void)
+{
+    if (held_scans && --held_scans)
+        return;
+    while (uart_testrx(0)) {
+        uint8_t c = uart_peek(0) & 0x7F;
+        uint8_t scancode = pgm_read_byte(&msx_key_matrix[c]);
+        if (scancode == NO_KEY) {
             uart_getc(0);
-            return BITS(modkey);
+            continue;
+        }
+        if (held_key != NO_KEY && SAME_KEY(held_key, scancode)) {
+            msx_release();
+            held_scans = MSX_RELEASE_SCANS;
+            return;
+        }
+        uart_getc(0);
+        msx_release();
+        msx_matrix[ROW(scancode)] &= BITS(scancode);
+        if (SHIFTED(scancode)) {
+            uint8_t modkey = (c < 0x20) ? CTRL_KEY : SHIFT_KEY;
+            msx_matrix[ROW(modkey)] &= BITS(modkey);
         }
+        held_key = scancode;
+        held_scans = MSX_PRESS_SCANS;
+        return;
     }
-    return NO_KEY;
+    msx_release();
 }
 
-uint8_t msx_setrow(uint8_t row)
+/**
+ * Return the state of the selected row of the matrix
+ *
+ * Reading a row at or below the previous one starts a new scan, which
+ * covers the BIOS reading rows 0 to 10 in order as well as programs that
+ * poll a single row.
+ */
+uint8_t msx_scanrow(void)
+{
+    if (current_row <= last_row)
+        msx_next_scan();
+    last_row = current_row;
+    return current_row < MSX_ROWS ? msx_matrix[current_row] : 0xFF;
+}
+
+void msx_setrow(uint8_t row)
 {
     current_row = row & 0xF;
+}
+
+static uint8_t msx_port_read(uint8_t offset)
+{
+    return offset == MSX_KEY_COL - MSX_KEY_BASE ? msx_scanrow() : 0xFF;
+}
+
+static void msx_port_write(uint8_t offset, uint8_t data)
+{
+    if (offset == MSX_KEY_ROW - MSX_KEY_BASE)
+        msx_setrow(data);
+}
+
+void msx_init(void)
+{
+    iorq_register(PSTR("msx"), MSX_KEY_BASE, 2, msx_port_read, msx_port_write);
 }
\ No newline at end of file
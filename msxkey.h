@@ -5,6 +5,7 @@
 #define MSX_KEY_ROW MSX_KEY_BASE+1
 
 uint8_t msx_scanrow(void);
-uint8_t msx_setrow(uint8_t row);
+void msx_setrow(uint8_t row);
+void msx_init(void);
 
 #endif
\ No newline at end of file
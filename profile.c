@@ -0,0 +1,161 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file profile.c Sampling PC profiler
+ *
+ * While z80_run is going, a Timer3 interrupt waits for the next opcode
+ * fetch, freezes the clock long enough to read the address high byte and
+ * M1 from the IO expander, and counts the address in a histogram of
+ * 2^PROFILE_SHIFT byte buckets. The Z80 loses a few clocks per sample.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/io.h>
+#include <avr/interrupt.h>
+#include <avr/pgmspace.h>
+
+#include "profile.h"
+#include "bus.h"
+#include "disasm.h"
+
+// Bus signal checks per sample before giving up on seeing an opcode fetch
+#define PROFILE_TRIES 255
+
+static uint16_t profile_hist[PROFILE_BUCKETS];
+static uint32_t profile_samples;
+static uint32_t profile_misses;
+
+/**
+ * Whether z80_run should sample
+ */
+uint8_t profile_on = 0;
+
+/**
+ * Start sampling
+ */
+void profile_start(void)
+{
+    TCCR3A = 0;
+    TCCR3B = (1 << WGM32) | (1 << CS31);    // CTC, clk/8
+    TCNT3 = 0;
+    OCR3A = F_CPU / 8 / PROFILE_HZ - 1;
+    TIFR3 = (1 << OCF3A);
+    TIMSK3 |= (1 << OCIE3A);
+}
+
+/**
+ * Stop sampling
+ */
+void profile_stop(void)
+{
+    TIMSK3 &= ~(1 << OCIE3A);
+    TCCR3B = 0;
+}
+
+/**
+ * Discard all samples
+ */
+void profile_clear(void)
+{
+    memset(profile_hist, 0, sizeof profile_hist);
+    profile_samples = 0;
+    profile_misses = 0;
+}
+
+/**
+ * Catch an opcode fetch and count its address
+ */
+ISR(TIMER3_COMPA_vect)
+{
+    uint8_t i;
+    uint16_t hiflags;
+    uint8_t lo;
+
+    // z80_run holds IO requests off while a task uses the SPI bus
+    if (!(PCICR & (1 << IORQ_PCIE))) {
+        profile_misses++;
+        return;
+    }
+    for (i = 0; i < PROFILE_TRIES && GET_IORQ; i++) {
+        if (GET_MREQ || GET_RD)
+            continue;
+        TCCR2B &= ~(1 << CS20);
+        if (!GET_MREQ && !GET_RD) {
+            lo = GET_ADDRLO;
+            hiflags = GET_ADDRHI_XFLAGS;
+            if (!(hiflags & (1 << (M1 + 8)))) {
+                TCCR2B |= (1 << CS20);
+                uint16_t *h = &profile_hist[(uint16_t)(lo | (hiflags << 8)) >> PROFILE_SHIFT];
+                if (*h != 0xffff)
+                    (*h)++;
+                profile_samples++;
+                return;
+            }
+        }
+        TCCR2B |= (1 << CS20);
+        // Let this read finish so it isn't checked again
+        while (!GET_MREQ && i < PROFILE_TRIES)
+            i++;
+    }
+    // The Z80 is halted in an IO request, or fetches were too quick to catch
+    profile_misses++;
+}
+
+/**
+ * Print the busiest buckets, optionally disassembling the first instruction of each
+ */
+void profile_print(uint8_t top, uint8_t disasm)
+{
+    uint16_t last = 0xffff, lastb = 0, best, bestb, i;
+    uint8_t n;
+
+    printf_P(PSTR("%lu samples, %lu missed\n"), profile_samples, profile_misses);
+    if (!profile_samples)
+        return;
+    // Select in descending count order, breaking ties by bucket number
+    for (n = 0; n < top; n++) {
+        best = 0;
+        bestb = 0;
+        for (i = 0; i < PROFILE_BUCKETS; i++) {
+            uint16_t c = profile_hist[i];
+            if (c == 0 || c > last || (c == last && i <= lastb && n > 0))
+                continue;
+            if (c > best) {
+                best = c;
+                bestb = i;
+            }
+        }
+        if (!best)
+            break;
+        uint16_t start = bestb << PROFILE_SHIFT;
+        printf_P(PSTR("%04x-%04x %6u %3lu%%\n"), start, start + (1 << PROFILE_SHIFT) - 1,
+            best, best * 100UL / profile_samples);
+        if (disasm)
+            disasm_mem(start, start);
+        last = best;
+        lastb = bestb;
+    }
+}
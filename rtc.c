@@ -24,8 +24,21 @@
  * @file rtc.c DS1306+ RTC functions
  */
 
+#include <string.h>
+
 #include "rtc.h"
 #include "spi.h"
+#include "timer.h"
+
+#define RTC_CACHE_AGE (TIMER_HZ / 2)    // refresh cached time twice a second so no second is missed
+
+static uint8_t rtc_time[RTC_YEAR + 1];  /**< copy of the time and date registers */
+static uint32_t rtc_time_ticks;         /**< when rtc_time was read from the chip */
+static uint8_t rtc_time_valid;
+#ifdef RTC_CACHE_RAM
+static uint8_t rtc_ram[RTC_RAM_SIZE];   /**< copy of the user RAM */
+static uint8_t rtc_ram_valid;
+#endif
 
 void rtc_begin()
 {
@@ -41,24 +54,78 @@ void rtc_end()
     SPI_FAST;
 }
 
-void rtc_read(uint8_t start, uint8_t end, uint8_t values[])
+static void rtc_chip_read(uint8_t start, uint8_t end, uint8_t values[])
 {
     rtc_begin();
     spi_exchange(start);
-    for (uint8_t reg = start; reg <= end; reg++)
-        values[reg - start] = spi_exchange(0);
+    spi_receive(values, end - start + 1);
     rtc_end();
 }
 
-void rtc_write(uint8_t start, uint8_t end, uint8_t values[])
+static void rtc_chip_write(uint8_t start, uint8_t end, uint8_t values[])
 {
     rtc_begin();
     spi_exchange(start | RTC_WRITE);
-    for (uint8_t reg = start; reg <= end; reg++)
-        spi_exchange(values[reg - start]);
+    spi_send(values, end - start + 1);
     rtc_end();
 }
 
+/**
+ * Return the cached copy of a range of registers, refreshing it if stale,
+ * or NULL if the range is not cached
+ */
+static uint8_t *rtc_cached(uint8_t start, uint8_t end)
+{
+    if (end <= RTC_YEAR) {
+        uint32_t now = timer_ticks();
+        if (!rtc_time_valid || now - rtc_time_ticks >= RTC_CACHE_AGE) {
+            rtc_chip_read(RTC_SEC, RTC_YEAR, rtc_time);
+            rtc_time_ticks = now;
+            rtc_time_valid = 1;
+        }
+        return &rtc_time[start];
+    }
+#ifdef RTC_CACHE_RAM
+    if (start >= RTC_RAM_BASE && end < RTC_RAM_BASE + RTC_RAM_SIZE) {
+        if (!rtc_ram_valid) {
+            rtc_chip_read(RTC_RAM_BASE, RTC_RAM_BASE + RTC_RAM_SIZE - 1, rtc_ram);
+            rtc_ram_valid = 1;
+        }
+        return &rtc_ram[start - RTC_RAM_BASE];
+    }
+#endif
+    return NULL;
+}
+
+/**
+ * Read a range of registers, from the RAM copy when they are cached
+ */
+void rtc_read(uint8_t start, uint8_t end, uint8_t values[])
+{
+    uint8_t *cached = rtc_cached(start, end);
+    if (cached)
+        memcpy(values, cached, end - start + 1);
+    else
+        rtc_chip_read(start, end, values);
+}
+
+/**
+ * Write a range of registers through to the chip
+ */
+void rtc_write(uint8_t start, uint8_t end, uint8_t values[])
+{
+    rtc_chip_write(start, end, values);
+    // The chip ignores writes while write protected, so reread rather than copy
+    if (start <= RTC_YEAR)
+        rtc_time_valid = 0;
+#ifdef RTC_CACHE_RAM
+    if (rtc_ram_valid && start >= RTC_RAM_BASE && end < RTC_RAM_BASE + RTC_RAM_SIZE)
+        rtc_chip_read(start, end, &rtc_ram[start - RTC_RAM_BASE]);
+    else if (end >= RTC_RAM_BASE)
+        rtc_ram_valid = 0;
+#endif
+}
+
 uint8_t rtc_read1(uint8_t reg)
 {
     uint8_t value;
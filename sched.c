@@ -0,0 +1,92 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file sched.c Cooperative background task scheduler
+ *
+ * Tasks are plain functions that run to completion. Each one is given an
+ * interval in 10 ms system timer ticks, and sched_next hands back at most
+ * one task that is due, so the caller decides what else must be held off
+ * while it runs.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "sched.h"
+#include "mmc_avr.h"
+
+typedef struct {
+    sched_func func;
+    uint16_t interval;
+    uint16_t last;
+} sched_task;
+
+static sched_task tasks[SCHED_MAX];
+static uint8_t task_count = 0;
+static uint8_t task_index = 0;
+
+/**
+ * Get the current value of the 100Hz system timer
+ */
+uint16_t sched_ticks(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t ticks = Timer;
+    SREG = sreg;
+    return ticks;
+}
+
+/**
+ * Register a task to run every interval ticks; returns 0 if the table is full
+ */
+uint8_t sched_add(sched_func func, uint16_t interval)
+{
+    if (task_count >= SCHED_MAX)
+        return 0;
+    tasks[task_count].func = func;
+    tasks[task_count].interval = interval;
+    tasks[task_count].last = sched_ticks();
+    task_count++;
+    return 1;
+}
+
+/**
+ * Return the next task that is due, or NULL if none is.
+ * Tasks are checked round-robin so a busy task can't starve the others.
+ */
+sched_func sched_next(void)
+{
+    uint16_t now = sched_ticks();
+    for (uint8_t i = 0; i < task_count; i++) {
+        sched_task *t = &tasks[task_index];
+        if (++task_index >= task_count)
+            task_index = 0;
+        if ((uint16_t)(now - t->last) >= t->interval) {
+            t->last = now;
+            return t->func;
+        }
+    }
+    return 0;
+}
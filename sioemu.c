@@ -25,10 +25,65 @@
  */
 
 #include <stdint.h>
+#include <avr/pgmspace.h>
 
 #include "sioemu.h"
+#include "iorq.h"
+#include "uart.h"
+#include "intctl.h"
 
 /**
  * Physical to virtual UART mapping.
  */
-uint8_t z80_uart[] = {0 , 1};
\ No newline at end of file
+uint8_t z80_uart[] = {0 , 1};
+
+/**
+ * Read the status or data register of an SIO channel
+ */
+static uint8_t sio_read(uint8_t offset)
+{
+    uint8_t u = offset >> 1;
+    if (offset & 1)
+        return uart_getc(z80_uart[u]);
+    else
+        return ACIA_STATUS(u);
+}
+
+/**
+ * Write the data register of an SIO channel. The status register reports
+ * when the FIFO is full; as with a real ACIA, a byte written then is lost.
+ * Waiting here would hang since the transmit interrupt is masked.
+ */
+static void sio_write(uint8_t offset, uint8_t data)
+{
+    if (offset & 1)
+        uart_trysend(z80_uart[offset >> 1], data);
+}
+
+#ifdef INTCTL_BASE
+/**
+ * Interrupt sources for received data on each channel
+ */
+static uint8_t sio_rx0_pending(void)
+{
+    return uart_testrx(z80_uart[0]) > 0;
+}
+
+static uint8_t sio_rx1_pending(void)
+{
+    return uart_testrx(z80_uart[1]) > 0;
+}
+#endif
+
+/**
+ * Register the SIO ports, and with INTCTL_BASE, receive interrupts for
+ * channels A and B as interrupt sources 0 and 1
+ */
+void sio_init(void)
+{
+    iorq_register(PSTR("sio"), SIO0_STATUS, 4, sio_read, sio_write);
+#ifdef INTCTL_BASE
+    intctl_register(sio_rx0_pending);
+    intctl_register(sio_rx1_pending);
+#endif
+}
\ No newline at end of file
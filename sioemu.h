@@ -35,8 +35,10 @@
 /**
  * Utility macros to generate SIO status register values
  */
-#define ACIA_STATUS(u) ((((uart_testtx(z80_uart[(u)]) == 0) << 1) & 0x2) | ((uart_testrx(z80_uart[(u)]) > 0) & 0x1))
+#define ACIA_STATUS(u) (((uart_txready(z80_uart[(u)]) != 0) << 1) | ((uart_testrx(z80_uart[(u)]) > 0) & 0x1))
 
 extern uint8_t z80_uart[];
 
+void sio_init(void);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,235 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file snapshot.c Save and restore all of paged memory
+ *
+ * A snapshot file holds a header sector with the page registers, a table
+ * of checksums for each 4KB block of memory, and then the full 1MB image.
+ * The image starts on a sector boundary and is moved in multi-sector
+ * transfers. An incremental save compares each block with the checksum
+ * from the previous snapshot and rewrites only the blocks that changed.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <avr/pgmspace.h>
+
+#include "snapshot.h"
+#include "bus.h"
+#include "util.h"
+#include "ff.h"
+
+#define SNAP_SIZE 0x100000UL            // bytes of paged memory
+#define SNAP_ROM_END 0x80000UL          // memory below this is ROM and is not restored
+#define SNAP_BLOCK 4096                 // bytes covered by each checksum
+#define SNAP_BLOCKS (SNAP_SIZE / SNAP_BLOCK)
+#define SNAP_BUF 1024                   // bytes moved per transfer (two SD sectors)
+#define SNAP_GROUP 32                   // checksums read and written at a time
+#define SNAP_SUMS 512                   // file offset of the checksum table
+#define SNAP_DATA (SNAP_SUMS + SNAP_BLOCKS * 4)     // file offset of the memory image
+#define SNAP_VERSION 1
+
+/**
+ * Snapshot file header
+ */
+typedef struct {
+    char magic[4];
+    uint8_t version;
+    uint8_t pages[4];
+} snap_header;
+
+static const char snap_magic[4] PROGMEM = "Z80S";
+
+/**
+ * Update a Fletcher checksum with a buffer of bytes
+ */
+static uint32_t snap_sum(const uint8_t *buf, uint16_t len, uint32_t sum)
+{
+    uint16_t a = sum;
+    uint16_t b = sum >> 16;
+
+    while (len--) {
+        a += *buf++;
+        b += a;
+    }
+    return (uint32_t)b << 16 | a;
+}
+
+/**
+ * Check whether a file holds a snapshot in the current format
+ */
+static uint8_t snap_valid(FIL *fil, snap_header *header)
+{
+    UINT br;
+
+    return f_size(fil) == SNAP_DATA + SNAP_SIZE
+        && f_lseek(fil, 0) == FR_OK
+        && f_read(fil, header, sizeof *header, &br) == FR_OK && br == sizeof *header
+        && memcmp_P(header->magic, snap_magic, 4) == 0
+        && header->version == SNAP_VERSION;
+}
+
+/**
+ * Save all of memory and the page registers to a file
+ *
+ * When incremental is set and the file already holds a snapshot, only the
+ * 4KB blocks whose checksum changed since then are written.
+ */
+void snapshot_save(char *filename, uint8_t incremental)
+{
+    FIL fil;
+    FRESULT fr;
+    UINT bw;
+    uint8_t buf[SNAP_BUF];
+    uint32_t sums[SNAP_GROUP];
+    snap_header *header = (snap_header *)buf;
+    uint32_t saved_base = base_addr;
+    uint32_t addr, sum;
+    uint16_t block, off, written = 0;
+    uint8_t i;
+
+    // A full save starts from an empty file so it ends up exactly snapshot sized
+    fr = f_open(&fil, filename, FA_READ | FA_WRITE | (incremental ? FA_OPEN_ALWAYS : FA_CREATE_ALWAYS));
+    if (fr == FR_OK && incremental && !snap_valid(&fil, header)) {
+        incremental = 0;
+        f_close(&fil);
+        fr = f_open(&fil, filename, FA_READ | FA_WRITE | FA_CREATE_ALWAYS);
+    }
+    if (fr != FR_OK) {
+        printf_P(PSTR("error opening file: %S\n"), strlookup(fr_text, fr));
+        return;
+    }
+
+    // Write the header, sized to a sector so the image stays aligned
+    memset(buf, 0, SNAP_SUMS);
+    memcpy_P(header->magic, snap_magic, 4);
+    header->version = SNAP_VERSION;
+    memcpy(header->pages, mem_pages, 4);
+    if (!incremental && (fr = f_lseek(&fil, SNAP_DATA + SNAP_SIZE)) != FR_OK)
+        goto done;
+    if ((fr = f_lseek(&fil, 0)) != FR_OK || (fr = f_write(&fil, buf, SNAP_SUMS, &bw)) != FR_OK)
+        goto done;
+    // Every data block is rewritten, so the card may as well pre-erase them all
+    if (!incremental && f_lseek(&fil, SNAP_DATA) == FR_OK)
+        fatfs_preerase(&fil, SNAP_SIZE);
+
+    base_addr = 0;
+    if (!bus_begin()) {
+        base_addr = saved_base;
+        goto done;
+    }
+    for (block = 0; block < SNAP_BLOCKS; block += SNAP_GROUP) {
+        if (incremental) {
+            if ((fr = f_lseek(&fil, SNAP_SUMS + block * 4)) != FR_OK
+                    || (fr = f_read(&fil, sums, sizeof sums, &bw)) != FR_OK)
+                break;
+        }
+        for (i = 0; i < SNAP_GROUP; i++) {
+            addr = (uint32_t)(block + i) * SNAP_BLOCK;
+            sum = 1;
+            if (incremental) {
+                for (off = 0; off < SNAP_BLOCK; off += SNAP_BUF) {
+                    mem_read_bare(addr + off, buf, SNAP_BUF);
+                    sum = snap_sum(buf, SNAP_BUF, sum);
+                }
+                if (sum == sums[i])
+                    continue;
+                sum = 1;
+            }
+            // Read the block again as it is written, in case it changed in between
+            if ((fr = f_lseek(&fil, SNAP_DATA + addr)) != FR_OK)
+                break;
+            for (off = 0; off < SNAP_BLOCK; off += SNAP_BUF) {
+                mem_read_bare(addr + off, buf, SNAP_BUF);
+                sum = snap_sum(buf, SNAP_BUF, sum);
+                if ((fr = f_write(&fil, buf, SNAP_BUF, &bw)) != FR_OK)
+                    break;
+            }
+            if (fr != FR_OK)
+                break;
+            sums[i] = sum;
+            written++;
+        }
+        if (fr != FR_OK)
+            break;
+        if ((fr = f_lseek(&fil, SNAP_SUMS + block * 4)) != FR_OK
+                || (fr = f_write(&fil, sums, sizeof sums, &bw)) != FR_OK)
+            break;
+    }
+    bus_end();
+    base_addr = saved_base;
+    if (fr == FR_OK)
+        printf_P(PSTR("wrote %u of %u blocks\n"), written, (uint16_t)SNAP_BLOCKS);
+
+done:
+    if (fr != FR_OK)
+        printf_P(PSTR("write error: %S\n"), strlookup(fr_text, fr));
+    if ((fr = f_close(&fil)) != FR_OK)
+        printf_P(PSTR("error closing file: %S\n"), strlookup(fr_text, fr));
+}
+
+/**
+ * Restore RAM and the page registers from a snapshot file
+ */
+void snapshot_load(char *filename)
+{
+    FIL fil;
+    FRESULT fr;
+    UINT br;
+    uint8_t buf[SNAP_BUF];
+    snap_header header;
+    uint32_t saved_base = base_addr;
+    uint32_t addr;
+    uint8_t i;
+
+    if ((fr = f_open(&fil, filename, FA_READ)) != FR_OK) {
+        printf_P(PSTR("error opening file: %S\n"), strlookup(fr_text, fr));
+        return;
+    }
+    if (!snap_valid(&fil, &header)) {
+        printf_P(PSTR("error: not a snapshot file\n"));
+    } else if ((fr = f_lseek(&fil, SNAP_DATA + SNAP_ROM_END)) != FR_OK) {
+        printf_P(PSTR("seek error: %S\n"), strlookup(fr_text, fr));
+    } else {
+        base_addr = 0;
+        if (bus_begin()) {
+            for (addr = SNAP_ROM_END; addr < SNAP_SIZE; addr += SNAP_BUF) {
+                if ((fr = f_read(&fil, buf, SNAP_BUF, &br)) != FR_OK || br != SNAP_BUF)
+                    break;
+                mem_write_bare(addr, buf, SNAP_BUF);
+            }
+            DATA_OUTPUT;
+            for (i = 0; i < 4; i++)
+                mem_page_bare(i, header.pages[i]);
+            DATA_INPUT;
+            bus_end();
+        }
+        base_addr = saved_base;
+        if (fr != FR_OK)
+            printf_P(PSTR("read error: %S\n"), strlookup(fr_text, fr));
+    }
+    if ((fr = f_close(&fil)) != FR_OK)
+        printf_P(PSTR("error closing file: %S\n"), strlookup(fr_text, fr));
+}
@@ -45,4 +45,69 @@ uint8_t spi_exchange(uint8_t data)
     while (!(SPSR & (1 << SPIF)))
         ;
     return SPDR;
+}
+
+/*
+ * The burst functions below restart the SPI as soon as the previous byte
+ * is done and do their buffer loads and stores while the next byte is on
+ * the wire, so there are no idle clocks between bytes.
+ */
+
+/**
+ * Transmit a buffer, discarding received data
+ */
+void spi_send(const uint8_t *buf, uint16_t len)
+{
+    if (!len)
+        return;
+    SPDR = *buf++;
+    while (--len) {
+        uint8_t next = *buf++;
+        while (!(SPSR & (1 << SPIF)))
+            ;
+        SPDR = next;
+    }
+    while (!(SPSR & (1 << SPIF)))
+        ;
+}
+
+/**
+ * Receive into a buffer, transmitting 0xFF
+ */
+void spi_receive(uint8_t *buf, uint16_t len)
+{
+    if (!len)
+        return;
+    SPDR = 0xFF;
+    while (--len) {
+        while (!(SPSR & (1 << SPIF)))
+            ;
+        uint8_t data = SPDR;
+        SPDR = 0xFF;
+        *buf++ = data;
+    }
+    while (!(SPSR & (1 << SPIF)))
+        ;
+    *buf = SPDR;
+}
+
+/**
+ * Transmit one buffer while receiving into another (they may be the same)
+ */
+void spi_transfer(const uint8_t *out, uint8_t *in, uint16_t len)
+{
+    if (!len)
+        return;
+    SPDR = *out++;
+    while (--len) {
+        uint8_t next = *out++;
+        while (!(SPSR & (1 << SPIF)))
+            ;
+        uint8_t data = SPDR;
+        SPDR = next;
+        *in++ = data;
+    }
+    while (!(SPSR & (1 << SPIF)))
+        ;
+    *in = SPDR;
 }
\ No newline at end of file
@@ -59,5 +59,8 @@
 
 void spi_init();
 uint8_t spi_exchange(uint8_t val);
+void spi_send(const uint8_t *buf, uint16_t len);
+void spi_receive(uint8_t *buf, uint16_t len);
+void spi_transfer(const uint8_t *out, uint8_t *in, uint16_t len);
 
 #endif
@@ -0,0 +1,95 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file timer.c Free-running microsecond-scale timebase
+ *
+ * Timer1 counts at F_CPU/64 (3.2us at 20MHz) and its overflow interrupt
+ * extends it to 32 bits. A single pending overflow is detected even with
+ * interrupts disabled, so intervals up to about 200ms can be measured
+ * from inside other interrupt handlers. Code that holds interrupts off
+ * for longer calls timer_poll between its steps so no overflow is lost.
+ */
+
+#include <avr/io.h>
+#include <avr/interrupt.h>
+
+#include "timer.h"
+
+static volatile uint16_t timer_high = 0;
+
+ISR(TIMER1_OVF_vect)
+{
+    timer_high++;
+}
+
+/**
+ * Start the timebase
+ */
+void timer_init(void)
+{
+    TCCR1A = 0;
+    TCCR1B = (1 << CS11) | (1 << CS10);
+    TCNT1 = 0;
+    TIFR1 = (1 << TOV1);
+    TIMSK1 |= (1 << TOIE1);
+}
+
+/**
+ * Count an overflow that is pending because interrupts are disabled
+ */
+void timer_poll(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    if (TIFR1 & (1 << TOV1)) {
+        TIFR1 = (1 << TOV1);
+        timer_high++;
+    }
+    SREG = sreg;
+}
+
+/**
+ * Get the current tick count
+ */
+uint32_t timer_ticks(void)
+{
+    uint8_t sreg = SREG;
+    cli();
+    uint16_t low = TCNT1;
+    uint16_t high = timer_high;
+    // Account for an overflow that hasn't been serviced yet
+    if ((TIFR1 & (1 << TOV1)) && low < 0x8000)
+        high++;
+    SREG = sreg;
+    return ((uint32_t)high << 16) | low;
+}
+
+/**
+ * Convert ticks to microseconds
+ */
+uint32_t timer_us(uint32_t ticks)
+{
+    const uint8_t mhz = F_CPU / 1000000;
+    return (ticks / mhz) * TIMER_PRESCALE + (ticks % mhz) * TIMER_PRESCALE / mhz;
+}
@@ -20,52 +20,213 @@
  * DEALINGS IN THE SOFTWARE.
  */
 
+#include <string.h>
 #include <avr/pgmspace.h>
 #include <util/delay.h>
+#include <util/crc16.h>
 
 #include "tms.h"
 #include "bus.h"
+#include "iorq.h"
 
 #define TMS_RAM TMS_BASE
 #define TMS_REG TMS_BASE+1
 
-#define TMS_WAIT 8
+#define TMS_WAIT 8              // us between VRAM accesses during active display
+#define TMS_WAIT_FAST 2         // us between VRAM accesses during vertical blank
+#define TMS_VBLANK_BYTES 1024   // fast accesses that fit in one vertical blank with margin
+#define TMS_VBLANK_POLL 16      // accesses between checks for vertical blank
+#define TMS_STATUS_F 0x80       // status flag set at the start of vertical blank
+#define TMS_BLOCK 256           // bytes per transfer block and per hash
 
-void _tms_write(uint16_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspace)
+/**
+ * Remaining accesses in the current vertical blank window
+ */
+static uint16_t tms_fast;
+
+/**
+ * Start a transfer, clearing any frame flag left over from an earlier
+ * vertical blank so that only one which sets from now on is trusted
+ * (data bus must be output)
+ *
+ * Reading the status register also clears the VDP's frame interrupt, so a
+ * Z80 program waiting on it misses the frames that begin during a transfer.
+ */
+static void tms_vblank_start(void)
 {
-    if (bus_master()) {
-        addr &= 0x3fff;
-        addr |= 0x4000;
-        DATA_OUTPUT;
-        io_out_bare(TMS_REG, addr & 0xff);
-        _delay_us(TMS_WAIT);
-        io_out_bare(TMS_REG, addr >> 8);
+    DATA_INPUT;
+    io_in_bare(TMS_REG);
+    DATA_OUTPUT;
+    tms_fast = 0;
+}
+
+/**
+ * Check whether vertical blank has started (data bus must be output)
+ */
+static void tms_vblank_check(void)
+{
+    if (tms_fast)
+        return;
+    DATA_INPUT;
+    if (io_in_bare(TMS_REG) & TMS_STATUS_F)
+        tms_fast = TMS_VBLANK_BYTES;
+    DATA_OUTPUT;
+}
+
+/**
+ * Wait for the VDP to be ready for the next VRAM access
+ */
+static void tms_wait(void)
+{
+    if (tms_fast) {
+        tms_fast--;
+        _delay_us(TMS_WAIT_FAST);
+    } else {
         _delay_us(TMS_WAIT);
-        for (uint16_t i = 0; i < len; i++) {
+    }
+}
+
+/**
+ * Set the VRAM address for subsequent reads or writes (data bus must be output)
+ */
+static void tms_setaddr(uint16_t addr)
+{
+    io_out_bare(TMS_REG, addr & 0xff);
+    _delay_us(TMS_WAIT_FAST);
+    io_out_bare(TMS_REG, addr >> 8);
+    tms_wait();
+}
+
+#ifdef TMS_HASH
+#define TMS_BLOCKS (0x4000 / TMS_BLOCK)
+
+/**
+ * Hashes of the VRAM blocks last written by the controller
+ */
+static uint32_t tms_hashes[TMS_BLOCKS];
+static uint8_t tms_hash_valid[TMS_BLOCKS / 8];
+
+/**
+ * Hash a block with a CRC-16 and a Fletcher checksum side by side; the CRC
+ * catches every change confined to 16 bits and the pair makes a collision
+ * between other changes unlikely
+ */
+static uint32_t tms_hash(const uint8_t *buf, uint16_t len, uint8_t pgmspace)
+{
+    uint16_t crc = 0;
+    uint8_t a = 0, b = 0;
+
+    for (uint16_t i = 0; i < len; i++) {
+        uint8_t c = pgmspace ? pgm_read_byte(&buf[i]) : buf[i];
+        crc = _crc_xmodem_update(crc, c);
+        a += c;
+        b += a;
+    }
+    return (uint32_t)crc << 16 | (uint16_t)b << 8 | a;
+}
+
+/**
+ * Forget all hashes when the Z80 writes to VRAM itself
+ */
+static void tms_port_write(uint8_t offset, uint8_t data)
+{
+    if (offset == 0)
+        memset(tms_hash_valid, 0, sizeof tms_hash_valid);
+}
+#endif
+
+/**
+ * Register the VDP ports so Z80 accesses can be slowed down, and with
+ * TMS_HASH watch its writes so the hashes stay trustworthy
+ */
+void tms_init(void)
+{
+#ifdef TMS_HASH
+    iorq_register(PSTR("tms"), TMS_BASE, 2, NULL, tms_port_write);
+#else
+    iorq_register(PSTR("tms"), TMS_BASE, 2, NULL, NULL);
+#endif
+}
+
+/**
+ * Write to VRAM, in fast bursts during vertical blank
+ *
+ * With TMS_HASH, whole 256-byte blocks that match what the controller last
+ * wrote there are skipped.
+ */
+void _tms_write(uint16_t addr, const uint8_t *buf, uint16_t len, uint8_t pgmspace)
+{
+    uint16_t n;
+    uint8_t setaddr = 1;
+
+    if (!bus_master())
+        return;
+    DATA_OUTPUT;
+    tms_vblank_start();
+    addr &= 0x3fff;
+    while (len) {
+        n = TMS_BLOCK - (addr & (TMS_BLOCK - 1));
+        if (n > len)
+            n = len;
+#ifdef TMS_HASH
+        uint8_t block = addr / TMS_BLOCK;
+        uint8_t bit = 1 << (block & 7);
+        if (n == TMS_BLOCK) {
+            uint32_t hash = tms_hash(buf, n, pgmspace);
+            if ((tms_hash_valid[block / 8] & bit) && tms_hashes[block] == hash) {
+                addr = (addr + n) & 0x3fff;
+                buf += n;
+                len -= n;
+                setaddr = 1;
+                continue;
+            }
+            tms_hashes[block] = hash;
+            tms_hash_valid[block / 8] |= bit;
+        } else {
+            tms_hash_valid[block / 8] &= ~bit;
+        }
+#endif
+        if (setaddr) {
+            tms_vblank_check();
+            tms_setaddr(addr | 0x4000);
+            setaddr = 0;
+        }
+        for (uint16_t i = 0; i < n; i++) {
+            if ((i % TMS_VBLANK_POLL) == 0)
+                tms_vblank_check();
             if (pgmspace)
                 io_out_bare(TMS_RAM, pgm_read_byte(&buf[i]));
             else
                 io_out_bare(TMS_RAM, buf[i]);
-            _delay_us(TMS_WAIT);
+            tms_wait();
         }
-        bus_slave();
+        addr = (addr + n) & 0x3fff;
+        buf += n;
+        len -= n;
     }
+    DATA_INPUT;
+    bus_slave();
 }
 
+/**
+ * Read from VRAM, in fast bursts during vertical blank
+ */
 void tms_read(uint16_t addr, uint8_t *buf, uint16_t len)
 {
     if (bus_master()) {
         DATA_OUTPUT;
-        addr &= 0x3fff;
-        io_out_bare(TMS_REG, addr & 0xff);
-        _delay_us(TMS_WAIT);
-        io_out_bare(TMS_REG, addr >> 8);
-        _delay_us(TMS_WAIT);
-        DATA_INPUT;
+        tms_vblank_start();
+        tms_vblank_check();
+        tms_setaddr(addr & 0x3fff);
         for (uint16_t i = 0; i < len; i++) {
+            if ((i % TMS_VBLANK_POLL) == 0)
+                tms_vblank_check();
+            DATA_INPUT;
             buf[i] = io_in_bare(TMS_RAM);
-            _delay_us(TMS_WAIT);
+            DATA_OUTPUT;
+            tms_wait();
         }
+        DATA_INPUT;
         bus_slave();
     }
-}
\ No newline at end of file
+}
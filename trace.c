@@ -0,0 +1,318 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file trace.c Bus and instruction trace capture
+ *
+ * While capture is on, cycles matched by watches are stored in a RAM ring
+ * instead of being printed, so tracing doesn't slow z80_debug down to the
+ * speed of the serial line. A breakpoint acts as the trigger: the ring
+ * keeps up to pre records before it, and the Z80 runs on until post more
+ * have been captured.
+ *
+ * Instruction traces are too long for RAM, so they are streamed to a file
+ * on the SD card as packed records: a header byte, the PC, the bus flags if
+ * requested, then the opcode bytes. Records are gathered into whole blocks
+ * before writing so FatFs sends them straight to the card.
+ */
+
+#include <stdint.h>
+#include <stdio.h>
+#include <avr/pgmspace.h>
+
+#include "trace.h"
+#include "uart.h"
+#include "disasm.h"
+#include "ff.h"
+#include "util.h"
+
+#ifdef TRACE_LEN
+static bus_stat trace_buf[TRACE_LEN];
+static uint16_t trace_head;     // index of the next record to write
+static uint16_t trace_count;    // number of valid records
+static uint16_t trace_pre;
+static uint16_t trace_post;
+static uint16_t trace_after;    // records captured after the trigger
+static uint8_t trace_triggered;
+
+uint8_t trace_capture = 0;
+
+/**
+ * Set when the post-trigger window is full and the Z80 should stop;
+ * capture is turned off then so the ring is left intact
+ */
+uint8_t trace_done = 0;
+
+/**
+ * Clear the ring and start capturing
+ */
+void trace_start(uint16_t pre, uint16_t post)
+{
+    trace_head = 0;
+    trace_count = 0;
+    trace_after = 0;
+    trace_triggered = 0;
+    trace_done = 0;
+    trace_post = post < TRACE_LEN ? post : TRACE_LEN;
+    trace_pre = pre < TRACE_LEN - trace_post ? pre : TRACE_LEN - trace_post;
+    trace_capture = 1;
+}
+
+/**
+ * Capture a bus cycle, or print it if capture is off
+ */
+void trace_log(bus_stat status)
+{
+    if (!trace_capture) {
+        bus_log(status);
+        return;
+    }
+    trace_buf[trace_head] = status;
+    if (++trace_head == TRACE_LEN)
+        trace_head = 0;
+    if (trace_count < TRACE_LEN)
+        trace_count++;
+    if (trace_triggered && ++trace_after >= trace_post) {
+        trace_capture = 0;
+        trace_done = 1;
+    }
+}
+
+/**
+ * Note that a breakpoint was hit. Returns 1 if the Z80 should stop now
+ * or 0 if it should run on to fill the post-trigger window.
+ */
+uint8_t trace_trigger(void)
+{
+    if (!trace_capture)
+        return 1;
+    if (!trace_triggered) {
+        trace_triggered = 1;
+        trace_after = 0;
+    }
+    if (trace_post == 0) {
+        trace_capture = 0;
+        return 1;
+    }
+    return 0;
+}
+
+/**
+ * Number of records to report: the pre-trigger window is trimmed once triggered
+ */
+static uint16_t trace_len(void)
+{
+    if (trace_triggered && trace_count > trace_pre + trace_after)
+        return trace_pre + trace_after;
+    return trace_count;
+}
+
+/**
+ * Get the number of captured records and the number of the oldest one
+ * relative to the trigger
+ */
+uint16_t trace_window(int16_t *first)
+{
+    uint16_t n = trace_len();
+    *first = trace_triggered ? -(int16_t)(n - trace_after) : -(int16_t)n;
+    return n;
+}
+
+/**
+ * Get a captured record, counting from the oldest
+ */
+bus_stat trace_record(uint16_t i)
+{
+    return trace_buf[(trace_head + TRACE_LEN - trace_len() + i) % TRACE_LEN];
+}
+
+/**
+ * Print the captured records, numbered relative to the trigger
+ */
+void trace_print(void)
+{
+    int16_t num;
+    uint16_t n = trace_window(&num);
+
+    for (uint16_t i = 0; i < n; i++) {
+        printf_P(PSTR("%6d"), num++);
+        bus_log(trace_record(i));
+    }
+    uart_flush();
+}
+#endif
+
+#ifdef TRACE_FILE
+static FIL itrace_fil;
+static uint8_t itrace_buf[FF_MIN_SS];
+static uint16_t itrace_pos;
+static uint8_t itrace_flags;
+
+uint8_t itrace_on = 0;
+
+/**
+ * Start streaming instruction records to a file, optionally with bus flags
+ */
+uint8_t itrace_open(char *filename, uint8_t flags)
+{
+    FRESULT fr;
+    if ((fr = f_open(&itrace_fil, filename, FA_WRITE | FA_CREATE_ALWAYS)) != FR_OK)
+        return fr;
+    itrace_pos = 0;
+    itrace_flags = flags ? ITRACE_FLAGS : 0;
+    itrace_on = 1;
+    return FR_OK;
+}
+
+/**
+ * Write out the block buffer; streaming stops if the write fails
+ */
+static void itrace_flush(void)
+{
+    UINT bw;
+    FRESULT fr;
+    if (itrace_pos == 0)
+        return;
+    if ((fr = f_write(&itrace_fil, itrace_buf, itrace_pos, &bw)) != FR_OK || bw < itrace_pos) {
+        printf_P(PSTR("error writing trace: %S\n"), strlookup(fr_text, fr));
+        itrace_on = 0;
+        f_close(&itrace_fil);
+    }
+    itrace_pos = 0;
+}
+
+/**
+ * Append one byte to the block buffer
+ */
+static void itrace_put(uint8_t b)
+{
+    itrace_buf[itrace_pos++] = b;
+    if (itrace_pos == sizeof itrace_buf)
+        itrace_flush();
+}
+
+/**
+ * Record an executed instruction
+ */
+void itrace_record(uint16_t pc, uint8_t xflags, uint8_t *bytes, uint8_t len)
+{
+    itrace_put(itrace_flags | (len & ITRACE_LEN_MASK));
+    itrace_put(pc & 0xff);
+    itrace_put(pc >> 8);
+    if (itrace_flags)
+        itrace_put(xflags);
+    for (uint8_t i = 0; i < len && itrace_on; i++)
+        itrace_put(bytes[i]);
+}
+
+/**
+ * Write any partial block and close the trace file
+ */
+void itrace_close(void)
+{
+    if (!itrace_on)
+        return;
+    itrace_flush();
+    if (itrace_on) {
+        itrace_on = 0;
+        f_close(&itrace_fil);
+    }
+}
+
+/**
+ * Replay state; itrace_fil and itrace_buf are reused for reading
+ */
+static UINT itrace_len;
+
+/**
+ * Return the next byte of the trace file, or -1 at the end
+ */
+static int16_t itrace_get(void)
+{
+    if (itrace_pos >= itrace_len) {
+        if (f_read(&itrace_fil, itrace_buf, sizeof itrace_buf, &itrace_len) != FR_OK || itrace_len == 0)
+            return -1;
+        itrace_pos = 0;
+    }
+    return itrace_buf[itrace_pos++];
+}
+
+static uint8_t itrace_bytes[ITRACE_LEN_MASK + 1];
+static uint8_t itrace_index;
+
+/**
+ * Feed the current record's opcode bytes to the disassembler
+ */
+static uint8_t itrace_input(void)
+{
+    return itrace_bytes[itrace_index++ & ITRACE_LEN_MASK];
+}
+
+/**
+ * Disassemble count records from a trace file after skipping the first skip
+ */
+void itrace_show(char *filename, uint32_t skip, uint32_t count)
+{
+    char mnemonic[64];
+    int16_t hdr;
+    uint8_t i, len, xflags = 0xff;
+    uint16_t pc;
+    uint32_t n = 0;
+    FRESULT fr;
+
+    if (itrace_on) {
+        printf_P(PSTR("error: trace in progress\n"));
+        return;
+    }
+    if ((fr = f_open(&itrace_fil, filename, FA_READ)) != FR_OK) {
+        printf_P(PSTR("error opening file: %S\n"), strlookup(fr_text, fr));
+        return;
+    }
+    itrace_pos = itrace_len = 0;
+    while ((hdr = itrace_get()) >= 0 && (count == 0 || n < skip + count)) {
+        len = hdr & ITRACE_LEN_MASK;
+        pc = itrace_get();
+        pc |= itrace_get() << 8;
+        if (hdr & ITRACE_FLAGS)
+            xflags = itrace_get();
+        for (i = 0; i < len; i++)
+            itrace_bytes[i] = itrace_get();
+        if (n++ < skip)
+            continue;
+        itrace_index = 0;
+        disasm(itrace_input, mnemonic);
+        printf_P(PSTR("%04x  "), pc);
+        for (i = 0; i < 4 || i < len; i++) {
+            if (i < len)
+                printf_P(PSTR("%02x "), itrace_bytes[i]);
+            else
+                printf_P(PSTR("   "));
+        }
+        printf_P(PSTR(" %-16s%S%S%S\n"), mnemonic,
+            !FLAG(xflags, INTERRUPT) ? PSTR(" int") : PSTR(""),
+            !FLAG(xflags, NMI) ? PSTR(" nmi") : PSTR(""),
+            !FLAG(xflags, HALT) ? PSTR(" halt") : PSTR(""));
+    }
+    f_close(&itrace_fil);
+}
+#endif
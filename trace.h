@@ -0,0 +1,61 @@
+/* z80ctrl (https://github.com/jblang/z80ctrl)
+ * Copyright 2018 J.B. Langston
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a 
+ * copy of this software and associated documentation files (the "Software"), 
+ * to deal in the Software without restriction, including without limitation 
+ * the rights to use, copy, modify, merge, publish, distribute, sublicense, 
+ * and/or sell copies of the Software, and to permit persons to whom the 
+ * Software is furnished to do so, subject to the following conditions:
+ * 
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ * 
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY, 
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER 
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING 
+ * FROM, OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER 
+ * DEALINGS IN THE SOFTWARE.
+ */
+
+
+/**
+ * @file trace.h Bus and instruction trace capture
+ */
+
+#ifndef TRACE_H
+#define TRACE_H
+
+#include <stdint.h>
+#include "bus.h"
+
+#ifdef TRACE_LEN
+extern uint8_t trace_capture;
+extern uint8_t trace_done;
+
+void trace_start(uint16_t pre, uint16_t post);
+void trace_log(bus_stat status);
+uint8_t trace_trigger(void);
+uint16_t trace_window(int16_t *first);
+bus_stat trace_record(uint16_t i);
+void trace_print(void);
+#else
+#define trace_log(status) bus_log(status)
+#endif
+
+#ifdef TRACE_FILE
+// Instruction trace record header: length of opcode bytes, and whether bus flags follow the PC
+#define ITRACE_LEN_MASK 0x07
+#define ITRACE_FLAGS 0x80
+
+extern uint8_t itrace_on;
+
+uint8_t itrace_open(char *filename, uint8_t flags);
+void itrace_record(uint16_t pc, uint8_t xflags, uint8_t *bytes, uint8_t len);
+void itrace_close(void);
+void itrace_show(char *filename, uint32_t skip, uint32_t count);
+#endif
+
+#endif
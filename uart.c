@@ -31,10 +31,52 @@
 #include <avr/interrupt.h>
 
 #include "uart.h"
-
-#define	UART_BUFF  64
+#include "intctl.h"
+
+#ifndef UART_RX_BUFF
+#define UART_RX_BUFF 64
+#endif
+#ifndef UART_TX_BUFF
+#define UART_TX_BUFF 64
+#endif
 #define LINE_BUFF  80
 
+#if UART_RX_BUFF > 128 || (UART_RX_BUFF & (UART_RX_BUFF - 1))
+#error "UART_RX_BUFF must be a power of two no larger than 128"
+#endif
+#if UART_TX_BUFF > 128 || (UART_TX_BUFF & (UART_TX_BUFF - 1))
+#error "UART_TX_BUFF must be a power of two no larger than 128"
+#endif
+
+#ifdef UART_FLOW
+/* RTS/CTS flow control for UART 0 on the pins otherwise used by UART 1, which
+   becomes unavailable. RTS is driven low while the receive FIFO has room and
+   CTS must be low for transmission to proceed. */
+#ifndef RTS_PORT
+#define RTS_DDR DDRD
+#define RTS_PORT PORTD
+#define RTS_BIT 2
+#define CTS_PORT PORTD
+#define CTS_PIN PIND
+#define CTS_BIT 3
+#define CTS_PCMSK PCMSK3
+#define CTS_PCINT PCINT27
+#define CTS_PCIE PCIE3
+#define CTS_vect PCINT3_vect
+#endif
+#define RTS_ASSERT RTS_PORT &= ~(1 << RTS_BIT)
+#define RTS_DEASSERT RTS_PORT |= (1 << RTS_BIT)
+#define GET_CTS (CTS_PIN & (1 << CTS_BIT))
+
+/* Receive FIFO levels at which RTS is deasserted and asserted again */
+#define RX_HIGH (UART_RX_BUFF * 3 / 4)
+#define RX_LOW (UART_RX_BUFF / 4)
+
+#define UART_VALID(uart) ((uart) == 0)
+#else
+#define UART_VALID(uart) 1
+#endif
+
  /* 
  /  UART FIFO implementation is from the FatFS AVR sample code
  /  Copyright (C) 2016, ChaN, all right reserved.
@@ -46,11 +88,22 @@
 */
 
 typedef struct {
-	uint16_t	wi, ri, ct;
-	uint8_t buff[UART_BUFF];
-} FIFO;
+	uint8_t	wi, ri, ct;
+	uint8_t buff[UART_RX_BUFF];
+} RXFIFO;
+
+typedef struct {
+	uint8_t	wi, ri, ct;
+	uint8_t buff[UART_TX_BUFF];
+} TXFIFO;
 
-static volatile FIFO TxFifo[2], RxFifo[2];
+static volatile TXFIFO TxFifo[2];
+static volatile RXFIFO RxFifo[2];
+
+/* Console break-in: when uart_break_char is received on UART 0 it is
+   swallowed and uart_break is set instead (0 disables detection) */
+volatile uint8_t uart_break_char = 0;
+volatile uint8_t uart_break = 0;
 
 volatile uint8_t * const UCSRA[] = {&UCSR0A, &UCSR1A};
 volatile uint8_t * const UCSRB[] = {&UCSR0B, &UCSR1B};
@@ -63,6 +116,8 @@ volatile uint8_t * const UDR[] = {&UDR0, &UDR1};
 void uart_init (uint8_t uart, uint16_t ubrr)
 {
     uart &= 1;
+    if (!UART_VALID(uart))
+        return;
 
 	*UCSRB[uart] = 0;
 
@@ -73,6 +128,14 @@ void uart_init (uint8_t uart, uint16_t ubrr)
     *UBRRL[uart] = ubrr & 0xff;
 
 	*UCSRB[uart] = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0);
+
+#ifdef UART_FLOW
+    RTS_ASSERT;
+    RTS_DDR |= (1 << RTS_BIT);
+    CTS_PORT |= (1 << CTS_BIT);     // pull up so a disconnected CTS doesn't block
+    CTS_PCMSK |= (1 << CTS_PCINT);
+    PCICR |= (1 << CTS_PCIE);
+#endif
 }
 
 /* Get a received character */
@@ -85,7 +148,7 @@ uint16_t uart_testrx (uint8_t uart)
 
 uint8_t uart_getc (uint8_t uart)
 {
-	uint8_t d, i;
+	uint8_t d, i, sreg;
     uart &= 1;
 
     // Non-blocking
@@ -94,10 +157,15 @@ uint8_t uart_getc (uint8_t uart)
 
 	i = RxFifo[uart].ri;
 	d = RxFifo[uart].buff[i];
+	sreg = SREG;
 	cli();
 	RxFifo[uart].ct--;
-	sei();
-	RxFifo[uart].ri = (i + 1) % sizeof RxFifo[uart].buff;
+	SREG = sreg;
+	RxFifo[uart].ri = (i + 1) & (UART_RX_BUFF - 1);
+#ifdef UART_FLOW
+	if (RxFifo[uart].ct <= RX_LOW)
+		RTS_ASSERT;
+#endif
 
 	return d;
 }
@@ -134,20 +202,129 @@ void uart_flush(void)
     loop_until_bit_is_set(UCSR1A, UDRE1);
  }
 
-void uart_putc (uint8_t uart, uint8_t d)
+/* Check whether the Tx FIFO has room for another byte */
+
+uint8_t uart_txready (uint8_t uart)
+{
+    uart &= 1;
+	return TxFifo[uart].ct < UART_TX_BUFF;
+}
+
+/* Queue a byte if there is room, without waiting; safe with interrupts
+   disabled. Returns 0 if the FIFO was full or the UART is unavailable
+   and the byte was dropped. */
+
+uint8_t uart_trysend (uint8_t uart, uint8_t d)
 {
-	uint8_t i;
+	uint8_t i, sreg;
     uart &= 1;
+    if (!UART_VALID(uart))
+        return 0;
 
-	while (TxFifo[uart].ct >= sizeof TxFifo[uart].buff) ;
+	if (TxFifo[uart].ct >= UART_TX_BUFF)
+		return 0;
 
 	i = TxFifo[uart].wi;
 	TxFifo[uart].buff[i] = d;
+	TxFifo[uart].wi = (i + 1) & (UART_TX_BUFF - 1);
+	sreg = SREG;
 	cli();
 	TxFifo[uart].ct++;
 	*UCSRB[uart] = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0)|_BV(UDRIE0);
-	sei();
-	TxFifo[uart].wi = (i + 1) % sizeof TxFifo[uart].buff;
+	SREG = sreg;
+	return 1;
+}
+
+void uart_udre_vect(uint8_t uart);
+
+void uart_putc (uint8_t uart, uint8_t d)
+{
+    if (!UART_VALID(uart & 1))
+        return;
+	while (!uart_trysend(uart, d)) {
+		// Drain by polling when called with interrupts disabled, e.g. from iorq_dispatch
+		if (!(SREG & _BV(SREG_I)) && (*UCSRA[uart & 1] & _BV(UDRE0)))
+			uart_udre_vect(uart);
+	}
+}
+
+/* Queue a block, copying as much as fits each time the FIFO has room and
+   publishing it under one critical section rather than one per byte */
+
+void uart_write (uint8_t uart, const uint8_t *buf, uint16_t len)
+{
+	uint8_t i, n, sreg;
+    uart &= 1;
+    if (!UART_VALID(uart))
+        return;
+
+	while (len) {
+		// Only the UDRE interrupt changes ct meanwhile, and it only makes room
+		n = UART_TX_BUFF - TxFifo[uart].ct;
+		if (n == 0) {
+			if (!(SREG & _BV(SREG_I)) && (*UCSRA[uart] & _BV(UDRE0)))
+				uart_udre_vect(uart);
+			continue;
+		}
+		if (n > len)
+			n = len;
+		len -= n;
+		i = TxFifo[uart].wi;
+		for (uint8_t j = n; j; j--) {
+			TxFifo[uart].buff[i] = *buf++;
+			i = (i + 1) & (UART_TX_BUFF - 1);
+		}
+		TxFifo[uart].wi = i;
+		sreg = SREG;
+		cli();
+		TxFifo[uart].ct += n;
+		*UCSRB[uart] = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0)|_BV(UDRIE0);
+		SREG = sreg;
+	}
+}
+
+/* Bulk receive on UART 0: while a buffer is set and not yet full, the
+   receive interrupt stores bytes there instead of in the FIFO, so a block
+   can arrive while the foreground is busy for longer than the FIFO lasts */
+
+static uint8_t *rx_bulk_buf;
+static uint16_t rx_bulk_len;
+static volatile uint16_t rx_bulk_ct;
+
+void uart_bulk_start (uint8_t *buf, uint16_t len)
+{
+	uint8_t sreg = SREG;
+	uint16_t n = 0;
+
+	cli();
+	// Bytes already in the FIFO come first
+	while (n < len && RxFifo[0].ct)
+		buf[n++] = uart_getc(0);
+	rx_bulk_buf = buf;
+	rx_bulk_ct = n;
+	rx_bulk_len = len;
+	SREG = sreg;
+}
+
+uint16_t uart_bulk_count (void)
+{
+	uint8_t sreg = SREG;
+	uint16_t n;
+
+	cli();
+	n = rx_bulk_ct;
+	SREG = sreg;
+	return n;
+}
+
+void uart_bulk_stop (void)
+{
+	uint8_t sreg = SREG;
+
+	cli();
+	rx_bulk_len = 0;
+	rx_bulk_ct = 0;
+	SREG = sreg;
 }
 
 /* UART RXC interrupt */
@@ -158,23 +335,41 @@ void uart_rx_vect(uint8_t uart)
     uart &= 1;
 
 	d = *UDR[uart];
+	if (uart == 0 && uart_break_char && d == uart_break_char) {
+		uart_break = 1;
+		return;
+	}
+	if (uart == 0 && rx_bulk_ct < rx_bulk_len) {
+		rx_bulk_buf[rx_bulk_ct++] = d;
+		return;
+	}
 	n = RxFifo[uart].ct;
-	if (n < sizeof RxFifo[uart].buff) {
+	if (n < UART_RX_BUFF) {
 		RxFifo[uart].ct = ++n;
 		i = RxFifo[uart].wi;
 		RxFifo[uart].buff[i] = d;
-		RxFifo[uart].wi = (i + 1) % sizeof RxFifo[uart].buff;
+		RxFifo[uart].wi = (i + 1) & (UART_RX_BUFF - 1);
 	}
+#ifdef UART_FLOW
+	if (n >= RX_HIGH)
+		RTS_DEASSERT;
+#endif
 }
 
 ISR(USART0_RX_vect)
 {
     uart_rx_vect(0);
+#ifdef INTCTL_BASE
+    intctl_check = 1;
+#endif
 }
 
 ISR(USART1_RX_vect)
 {
     uart_rx_vect(1);
+#ifdef INTCTL_BASE
+    intctl_check = 1;
+#endif
 }
 
 
@@ -186,11 +381,18 @@ void uart_udre_vect(uint8_t uart)
     uart &= 1;
 
 	n = TxFifo[uart].ct;
+#ifdef UART_FLOW
+	// Hold off until the CTS pin change interrupt resumes transmission
+	if (GET_CTS) {
+		*UCSRB[uart] = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0);
+		return;
+	}
+#endif
 	if (n) {
 		TxFifo[uart].ct = --n;
 		i = TxFifo[uart].ri;
 		*UDR[uart] = TxFifo[uart].buff[i];
-		TxFifo[uart].ri = (i + 1) % sizeof TxFifo[uart].buff;
+		TxFifo[uart].ri = (i + 1) & (UART_TX_BUFF - 1);
 	}
 	if (n == 0) *UCSRB[uart] = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0);
 }
@@ -205,6 +407,16 @@ ISR(USART1_UDRE_vect)
     uart_udre_vect(1);
 }
 
+#ifdef UART_FLOW
+/* CTS pin change interrupt */
+
+ISR(CTS_vect)
+{
+	if (!GET_CTS && TxFifo[0].ct)
+		UCSR0B = _BV(RXEN0)|_BV(RXCIE0)|_BV(TXEN0)|_BV(UDRIE0);
+}
+#endif
+
 /*
  * "Cooked" terminal mode functions are from libc-avr stdio demo
  * ----------------------------------------------------------------------------
@@ -29,12 +29,21 @@
 
 #define UBRR115200 10
 
+extern volatile uint8_t uart_break_char;    /* console break-in character, 0 = off */
+extern volatile uint8_t uart_break;         /* set when break-in character received */
+
 void uart_init(uint8_t uart, uint16_t ubrr);     /* Perform UART startup initialization. */
 uint16_t uart_testrx(uint8_t uart);		/* Check number of bytes in UART Rx FIFO */
-uint16_t uart_testtx(uint8_t uart);		/* Check number of bytes in UART Rx FIFO */
+uint16_t uart_testtx(uint8_t uart);		/* Check number of bytes in UART Tx FIFO */
+uint8_t uart_txready(uint8_t uart);		/* Check for room in UART Tx FIFO */
+uint8_t uart_trysend(uint8_t uart, uint8_t d);	/* Put a byte into UART Tx FIFO if not full */
 uint8_t uart_peek (uint8_t uart);
 uint8_t uart_getc(uint8_t uart);		/* Get a byte from UART Rx FIFO */
 void uart_putc(uint8_t uart, uint8_t d);	/* Put a byte into UART Tx FIFO */
+void uart_write(uint8_t uart, const uint8_t *buf, uint16_t len);	/* Put a block into UART Tx FIFO */
+void uart_bulk_start(uint8_t *buf, uint16_t len);	/* Receive the next len bytes on UART 0 into buf */
+uint16_t uart_bulk_count(void);			/* Bytes received so far by bulk receive */
+void uart_bulk_stop(void);			/* Return UART 0 to receiving into its FIFO */
 void uart_flush(void);                          /* flush uart transmit buffers */
 int uart_putchar(char c, FILE * stream);        /* output with cr/lf conversion */
 int uart_getchar(FILE * stream);                /* line buffered input */
\ No newline at end of file
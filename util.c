@@ -30,6 +30,7 @@
 
 #include "util.h"
 #include "ff.h"
+#include "diskio.h"
 
 /**
  * Look up a text string by index from a NULL-separated PROGMEM array
@@ -46,6 +47,48 @@ PGM_P strlookup(PGM_P str, uint32_t index)
     return p;
 }
 
+static const char hex_digits[] PROGMEM = "0123456789abcdef0123456789ABCDEF";
+
+/**
+ * Append the low digits of a value in hex using the given digit set
+ */
+static char *hex_append(char *p, uint16_t value, uint8_t digits, PGM_P set)
+{
+    char *end = p + digits;
+    while (digits--) {
+        p[digits] = pgm_read_byte(&set[value & 0xf]);
+        value >>= 4;
+    }
+    return end;
+}
+
+/**
+ * Append the low digits of a value to a string in lower case hex, without printf
+ */
+char *fmt_hex(char *p, uint16_t value, uint8_t digits)
+{
+    return hex_append(p, value, digits, hex_digits);
+}
+
+/**
+ * Append the low digits of a value to a string in upper case hex, without printf
+ */
+char *fmt_HEX(char *p, uint16_t value, uint8_t digits)
+{
+    return hex_append(p, value, digits, hex_digits + 16);
+}
+
+/**
+ * Append a PROGMEM string to a string, without the terminator
+ */
+char *fmt_str_P(char *p, PGM_P s)
+{
+    char c;
+    while ((c = pgm_read_byte(s++)))
+        *p++ = c;
+    return p;
+}
+
 /**
  * FatFS wrapper to write a single byte to a file, used by stdio library
  */
@@ -70,4 +113,33 @@ int fatfs_getchar(FILE * stream)
         return c;
     else
         return EOF;
-}
\ No newline at end of file
+}
+
+/**
+ * Let the SD card pre-erase the blocks that the next len bytes written at the
+ * file pointer will fill. Only whole blocks of an already allocated, unfragmented
+ * part of the file are announced, since the card may erase every announced
+ * block even if the write stops short.
+ */
+void fatfs_preerase(FIL *fil, FSIZE_t len)
+{
+    FATFS *fs = fil->obj.fs;
+    FSIZE_t ofs = f_tell(fil);
+    DWORD *saved = fil->cltbl;
+    DWORD clmt[4], hint[2];
+    FRESULT fr;
+
+    if (ofs + len > f_size(fil) || len < 2 * FF_MIN_SS)
+        return;
+    // A link map with room for one fragment can only be built for a contiguous file
+    clmt[0] = 4;
+    fil->cltbl = clmt;
+    fr = f_lseek(fil, CREATE_LINKMAP);
+    fil->cltbl = saved;
+    f_lseek(fil, ofs);
+    if (fr != FR_OK)
+        return;
+    hint[0] = fs->database + (clmt[2] - 2) * fs->csize + ofs / FF_MIN_SS;
+    hint[1] = (ofs + len) / FF_MIN_SS - ofs / FF_MIN_SS;
+    disk_ioctl(fs->pdrv, MMC_PREERASE, hint);
+}
@@ -28,9 +28,14 @@
  */
 
 #include <stdint.h>
+#include "ff.h"
 
 const char *strlookup(const char *str, uint32_t index); /**< Lookup a string by index in a NULL-separated PROGMEM array */
 int fatfs_getchar(FILE * stream);                       /**< FatFS wrapper to read a single byte from a file */
 int fatfs_putchar(char c, FILE * stream);               /**< FatFS wrapper to write a single byte to a file */
+void fatfs_preerase(FIL *fil, FSIZE_t len);             /**< Let the SD card pre-erase for a write of known length */
+char *fmt_hex(char *p, uint16_t value, uint8_t digits);  /**< Append a value in lower case hex */
+char *fmt_HEX(char *p, uint16_t value, uint8_t digits);  /**< Append a value in upper case hex */
+char *fmt_str_P(char *p, const char *s);                /**< Append a PROGMEM string */
 
 #endif
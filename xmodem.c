@@ -35,10 +35,16 @@
  */
 
 #include <stdio.h>
+#include <stdlib.h>
 #include <string.h>
-#include <util/delay.h>
+#include <avr/pgmspace.h>
 #include "ff.h"
 #include "uart.h"
+#include "timer.h"
+#include "bus.h"
+#include "flash.h"
+#include "xmodem.h"
+#include "util.h"
 
 #define SOH  0x01
 #define STX  0x02
@@ -54,12 +60,10 @@
 
 int _inbyte(unsigned short timeout) // msec timeout
 {
-        unsigned short c;
+        uint32_t start = timer_ticks();
         while (uart_testrx(0) == 0) {
-                _delay_ms(1);
-                if (timeout) {
-                        if (--timeout == 0) return -2;
-                }
+                if (timeout && timer_ticks() - start >= timeout * TIMER_TICKS_US(1000))
+                        return -2;
         }
 
         return uart_getc(0);
@@ -70,22 +74,56 @@ void _outbyte(char c)
     uart_putc(0, c);
 }
 
-unsigned short crc16_ccitt( const void *buf, int len )
+/* CRC-16/CCITT of each byte value, so the CRC costs one lookup per byte */
+static const unsigned short crc16_table[256] PROGMEM = {
+    0x0000, 0x1021, 0x2042, 0x3063, 0x4084, 0x50a5, 0x60c6, 0x70e7,
+    0x8108, 0x9129, 0xa14a, 0xb16b, 0xc18c, 0xd1ad, 0xe1ce, 0xf1ef,
+    0x1231, 0x0210, 0x3273, 0x2252, 0x52b5, 0x4294, 0x72f7, 0x62d6,
+    0x9339, 0x8318, 0xb37b, 0xa35a, 0xd3bd, 0xc39c, 0xf3ff, 0xe3de,
+    0x2462, 0x3443, 0x0420, 0x1401, 0x64e6, 0x74c7, 0x44a4, 0x5485,
+    0xa56a, 0xb54b, 0x8528, 0x9509, 0xe5ee, 0xf5cf, 0xc5ac, 0xd58d,
+    0x3653, 0x2672, 0x1611, 0x0630, 0x76d7, 0x66f6, 0x5695, 0x46b4,
+    0xb75b, 0xa77a, 0x9719, 0x8738, 0xf7df, 0xe7fe, 0xd79d, 0xc7bc,
+    0x48c4, 0x58e5, 0x6886, 0x78a7, 0x0840, 0x1861, 0x2802, 0x3823,
+    0xc9cc, 0xd9ed, 0xe98e, 0xf9af, 0x8948, 0x9969, 0xa90a, 0xb92b,
+    0x5af5, 0x4ad4, 0x7ab7, 0x6a96, 0x1a71, 0x0a50, 0x3a33, 0x2a12,
+    0xdbfd, 0xcbdc, 0xfbbf, 0xeb9e, 0x9b79, 0x8b58, 0xbb3b, 0xab1a,
+    0x6ca6, 0x7c87, 0x4ce4, 0x5cc5, 0x2c22, 0x3c03, 0x0c60, 0x1c41,
+    0xedae, 0xfd8f, 0xcdec, 0xddcd, 0xad2a, 0xbd0b, 0x8d68, 0x9d49,
+    0x7e97, 0x6eb6, 0x5ed5, 0x4ef4, 0x3e13, 0x2e32, 0x1e51, 0x0e70,
+    0xff9f, 0xefbe, 0xdfdd, 0xcffc, 0xbf1b, 0xaf3a, 0x9f59, 0x8f78,
+    0x9188, 0x81a9, 0xb1ca, 0xa1eb, 0xd10c, 0xc12d, 0xf14e, 0xe16f,
+    0x1080, 0x00a1, 0x30c2, 0x20e3, 0x5004, 0x4025, 0x7046, 0x6067,
+    0x83b9, 0x9398, 0xa3fb, 0xb3da, 0xc33d, 0xd31c, 0xe37f, 0xf35e,
+    0x02b1, 0x1290, 0x22f3, 0x32d2, 0x4235, 0x5214, 0x6277, 0x7256,
+    0xb5ea, 0xa5cb, 0x95a8, 0x8589, 0xf56e, 0xe54f, 0xd52c, 0xc50d,
+    0x34e2, 0x24c3, 0x14a0, 0x0481, 0x7466, 0x6447, 0x5424, 0x4405,
+    0xa7db, 0xb7fa, 0x8799, 0x97b8, 0xe75f, 0xf77e, 0xc71d, 0xd73c,
+    0x26d3, 0x36f2, 0x0691, 0x16b0, 0x6657, 0x7676, 0x4615, 0x5634,
+    0xd94c, 0xc96d, 0xf90e, 0xe92f, 0x99c8, 0x89e9, 0xb98a, 0xa9ab,
+    0x5844, 0x4865, 0x7806, 0x6827, 0x18c0, 0x08e1, 0x3882, 0x28a3,
+    0xcb7d, 0xdb5c, 0xeb3f, 0xfb1e, 0x8bf9, 0x9bd8, 0xabbb, 0xbb9a,
+    0x4a75, 0x5a54, 0x6a37, 0x7a16, 0x0af1, 0x1ad0, 0x2ab3, 0x3a92,
+    0xfd2e, 0xed0f, 0xdd6c, 0xcd4d, 0xbdaa, 0xad8b, 0x9de8, 0x8dc9,
+    0x7c26, 0x6c07, 0x5c64, 0x4c45, 0x3ca2, 0x2c83, 0x1ce0, 0x0cc1,
+    0xef1f, 0xff3e, 0xcf5d, 0xdf7c, 0xaf9b, 0xbfba, 0x8fd9, 0x9ff8,
+    0x6e17, 0x7e36, 0x4e55, 0x5e74, 0x2e93, 0x3eb2, 0x0ed1, 0x1ef0
+};
+
+unsigned short crc16_update( unsigned short crc, const void *buf, int len )
 {
-    unsigned short crc = 0;
+    const unsigned char *p = buf;
     while( len-- ) {
-        int i;
-        crc ^= *(char *)buf++ << 8;
-        for( i = 0; i < 8; ++i ) {
-            if( crc & 0x8000 )
-                crc = (crc << 1) ^ 0x1021;
-            else
-                crc = crc << 1;
-        }
+        crc = (crc << 8) ^ pgm_read_word(&crc16_table[(crc >> 8) ^ *p++]);
     }
     return crc;
 }
 
+unsigned short crc16_ccitt( const void *buf, int len )
+{
+    return crc16_update(0, buf, len);
+}
+
 static int check(int crc, const unsigned char *buf, int sz)
 {
     if (crc) {
@@ -113,7 +151,22 @@ static void flushinput(void)
         ;
 }
 
-int xm_receive(FIL *file)
+#ifdef SST_FLASH
+/* erase each flash sector that a block reaches first; the transfer starts
+   on a sector boundary, so no sector holds anything else of value */
+static int xm_flash_erase(uint32_t addr, int len)
+{
+    uint32_t sector;
+
+    for (sector = (addr + FLASH_SECTOR - 1) & ~(uint32_t)(FLASH_SECTOR - 1); sector < addr + len; sector += FLASH_SECTOR)
+        if (!flash_erase(sector))
+            return -1;
+    return 0;
+}
+#endif
+
+/* receive into a file, or into memory or flash starting at addr */
+static int xm_receive_to(FIL *file, uint32_t addr, unsigned char target)
 {
     unsigned char xbuff[1030]; /* 1024 for XModem 1k + 3 head chars + 2 crc + nul */
     unsigned char *p;
@@ -171,10 +224,24 @@ int xm_receive(FIL *file)
             (xbuff[1] == packetno || xbuff[1] == (unsigned char)packetno-1) &&
             check(crc, &xbuff[3], bufsz)) {
             if (xbuff[1] == packetno)	{
-                UINT bw;
-                if (f_write(file, &xbuff[3], bufsz, &bw) != FR_OK)
+                UINT bw = bufsz;
+                if (target == XM_MEM) {
+                    mem_write(addr, &xbuff[3], bufsz);
+#ifdef SST_FLASH
+                } else if (target == XM_FLASH) {
+                    if (xm_flash_erase(addr, bufsz) < 0 || !flash_write(addr, &xbuff[3], bufsz)) {
+                        flushinput();
+                        _outbyte(CAN);
+                        _outbyte(CAN);
+                        _outbyte(CAN);
+                        return -5; /* flash timed out */
+                    }
+#endif
+                } else if (f_write(file, &xbuff[3], bufsz, &bw) != FR_OK) {
                     return -4;
+                }
                 len += bw;
+                addr += bw;
                 ++packetno;
                 retrans = MAXRETRANS+1;
             }
@@ -194,6 +261,16 @@ int xm_receive(FIL *file)
     }
 }
 
+int xm_receive(FIL *file)
+{
+    return xm_receive_to(file, 0, XM_FILE);
+}
+
+int xm_receive_mem(uint32_t addr, unsigned char target)
+{
+    return xm_receive_to(NULL, addr, target);
+}
+
 int xm_transmit(FIL *file)
 {
     unsigned char xbuff[1030]; /* 1024 for XModem 1k + 3 head chars + 2 crc + nul */
@@ -297,6 +374,315 @@ int xm_transmit(FIL *file)
     }
 }
 
+/* YMODEM batch transfers, streaming without per-block ACKs when the other
+   end asks for YMODEM-G. Both ends fall back to plain YMODEM (CRC, 1K blocks,
+   ACK per block) when the other end does not answer 'G'. */
+
+static void ym_cancel(void)
+{
+    _outbyte(CAN);
+    _outbyte(CAN);
+    _outbyte(CAN);
+    flushinput();
+}
+
+/* receive the rest of a packet whose first byte c has been read;
+   returns the block size, or -1 for a bad or incomplete packet */
+static int ym_recv_packet(unsigned char *xbuff, int c)
+{
+    int i, bufsz = (c == STX) ? 1024 : 128;
+    unsigned char *p = xbuff;
+
+    *p++ = c;
+    for (i = 0; i < bufsz+4; ++i) {
+        if ((c = _inbyte(DLY_1S)) < 0) return -1;
+        *p++ = c;
+    }
+    if (xbuff[1] != (unsigned char)(~xbuff[2]) || !check(1, &xbuff[3], bufsz))
+        return -1;
+    return bufsz;
+}
+
+/* like ym_recv_packet, but the rest of the packet is already arriving
+   through uart_bulk_start; gives up after a second without a byte */
+static int ym_recv_bulk(unsigned char *xbuff, int c)
+{
+    int bufsz = (c == STX) ? 1024 : 128;
+    uint32_t start = timer_ticks();
+    uint16_t n, last = 0;
+
+    while ((n = uart_bulk_count()) < bufsz+4) {
+        if (n != last) {
+            last = n;
+            start = timer_ticks();
+        } else if (timer_ticks() - start >= DLY_1S * TIMER_TICKS_US(1000)) {
+            break;
+        }
+    }
+    uart_bulk_stop();
+    if (n < bufsz+4 || xbuff[1] != (unsigned char)(~xbuff[2]) || !check(1, &xbuff[3], bufsz))
+        return -1;
+    return bufsz;
+}
+
+/* send a packet whose header and data are already in xbuff */
+static void ym_send_packet(unsigned char *xbuff, int bufsz)
+{
+    unsigned short ccrc = crc16_ccitt(&xbuff[3], bufsz);
+    int i;
+
+    xbuff[bufsz+3] = (ccrc>>8) & 0xFF;
+    xbuff[bufsz+4] = ccrc & 0xFF;
+    for (i = 0; i < bufsz+5; ++i) {
+        _outbyte(xbuff[i]);
+    }
+}
+
+/* wait for the receiver to ask for a transfer; returns 'G' or 'C',
+   -1 if canceled or -2 on timeout */
+static int ym_wait(void)
+{
+    int c, retry;
+
+    for (retry = 0; retry < 16; ++retry) {
+        if ((c = _inbyte((DLY_1S)<<1)) == 'G' || c == 'C')
+            return c;
+        if (c == CAN && _inbyte(DLY_1S) == CAN)
+            return -1;
+    }
+    return -2;
+}
+
+/* wait for the ACK to a packet in plain YMODEM, resending it on NAK;
+   returns 0 on ACK or -1 if canceled or out of retries */
+static int ym_wait_ack(unsigned char *xbuff, int bufsz)
+{
+    int c, retry;
+
+    for (retry = 0; retry < MAXRETRANS; ++retry) {
+        if ((c = _inbyte(DLY_1S*10)) == ACK)
+            return 0;
+        if (c == CAN && _inbyte(DLY_1S) == CAN)
+            return -1;
+        ym_send_packet(xbuff, bufsz);
+    }
+    return -1;
+}
+
+/* Blocks are double buffered: once a block is verified, the next one is
+   received into the other buffer by the UART interrupt while the first is
+   written to the card, so streaming keeps up as long as each write takes
+   less time than a block takes to arrive. */
+
+int ym_receive(void)
+{
+    unsigned char bufs[2][1030]; /* 1024 for XModem 1k + 3 head chars + 2 crc + nul */
+    unsigned char *xbuff = bufs[0], *pend = NULL;
+    FIL fil;
+    char *name, *p;
+    unsigned char packetno, mode = 0, trychar = 0;
+    int bufsz, c, retry, retrans, files = 0, pend_len = 0;
+    long size;
+    UINT bw;
+
+    for (;;) {
+        /* block 0: try streaming first, and keep whichever mode the sender answers */
+        for (retry = 0; retry < 16; ++retry) {
+            trychar = mode ? mode : (retry < 4 ? 'G' : 'C');
+            _outbyte(trychar);
+            if ((c = _inbyte((DLY_1S)<<1)) == SOH || c == STX)
+                break;
+            if (c == CAN && _inbyte(DLY_1S) == CAN) {
+                flushinput();
+                return -1; /* canceled by remote */
+            }
+        }
+        if (retry == 16) {
+            ym_cancel();
+            return -2; /* sync error */
+        }
+        mode = trychar;
+        if ((bufsz = ym_recv_packet(xbuff, c)) < 0 || xbuff[1] != 0) {
+            if (mode == 'G') {
+                ym_cancel();
+                return -3;
+            }
+            flushinput();
+            continue;
+        }
+        /* terminate the block over its checked CRC so the parse stays inside it */
+        xbuff[bufsz+3] = '\0';
+        name = (char *)&xbuff[3];
+        if (*name == '\0') {
+            _outbyte(ACK);
+            return files; /* end of batch */
+        }
+        p = name + strlen(name) + 1;
+        size = (p < (char *)&xbuff[bufsz+3] && *p >= '0' && *p <= '9') ? atol(p) : -1;
+        if ((p = strrchr(name, '/')) != NULL)
+            name = p + 1;
+        if (f_open(&fil, name, FA_WRITE | FA_CREATE_ALWAYS) != FR_OK) {
+            ym_cancel();
+            return -4;
+        }
+        /* allocate the clusters up front so no FAT updates interrupt the stream */
+        if (size > 0 && f_lseek(&fil, size) == FR_OK && f_lseek(&fil, 0) == FR_OK)
+            fatfs_preerase(&fil, size);
+        if (mode == 'C')
+            _outbyte(ACK);
+        _outbyte(mode);
+
+        packetno = 1;
+        retrans = MAXRETRANS;
+        for (;;) {
+            c = _inbyte(DLY_1S*10);
+            if (c == SOH || c == STX) {
+                xbuff = (pend == bufs[0]) ? bufs[1] : bufs[0];
+                xbuff[0] = c;
+                uart_bulk_start(&xbuff[1], ((c == STX) ? 1024 : 128) + 4);
+            }
+            /* the previous block is written while this one arrives */
+            if (pend) {
+                if (f_write(&fil, &pend[3], pend_len, &bw) != FR_OK || bw != pend_len) {
+                    uart_bulk_stop();
+                    f_close(&fil);
+                    ym_cancel();
+                    return -5;
+                }
+                pend = NULL;
+            }
+            if (c == EOT) {
+                _outbyte(ACK);
+                break;
+            }
+            if (c == CAN && _inbyte(DLY_1S) == CAN) {
+                f_close(&fil);
+                flushinput();
+                return -1; /* canceled by remote */
+            }
+            if ((c == SOH || c == STX) && (bufsz = ym_recv_bulk(xbuff, c)) > 0) {
+                if (xbuff[1] == packetno) {
+                    if (size >= 0 && bufsz > size)
+                        bufsz = size;
+                    pend = xbuff;
+                    pend_len = bufsz;
+                    if (size >= 0)
+                        size -= bufsz;
+                    ++packetno;
+                    retrans = MAXRETRANS;
+                    if (mode == 'C')
+                        _outbyte(ACK);
+                    continue;
+                }
+                if (mode == 'C' && xbuff[1] == (unsigned char)(packetno-1)) {
+                    _outbyte(ACK);
+                    continue;
+                }
+            }
+            /* no retransmission when streaming */
+            if (mode == 'G' || --retrans <= 0) {
+                f_close(&fil);
+                ym_cancel();
+                return -3;
+            }
+            flushinput();
+            _outbyte(NAK);
+        }
+        f_close(&fil);
+        files++;
+    }
+}
+
+int ym_transmit(int count, char *names[])
+{
+    unsigned char xbuff[1030]; /* 1024 for XModem 1k + 3 head chars + 2 crc + nul */
+    FIL fil;
+    char *name;
+    unsigned char packetno;
+    int bufsz, c, n, retry, files = 0;
+    UINT br;
+
+    for (n = 0; n <= count; n++) {
+        if ((c = ym_wait()) < 0) {
+            if (c == -2)
+                ym_cancel();
+            return c;
+        }
+        /* block 0 holds the name and size, or nothing at the end of the batch */
+        xbuff[0] = SOH;
+        xbuff[1] = 0;
+        xbuff[2] = 0xFF;
+        memset(&xbuff[3], 0, 128);
+        if (n < count) {
+            if (f_open(&fil, names[n], FA_READ) != FR_OK) {
+                ym_cancel();
+                return -4;
+            }
+            if ((name = strrchr(names[n], '/')) == NULL)
+                name = names[n];
+            else
+                name++;
+            strncpy((char *)&xbuff[3], name, 100);
+            sprintf_P((char *)&xbuff[strlen(name)+4], PSTR("%lu"), (unsigned long)f_size(&fil));
+        }
+        ym_send_packet(xbuff, 128);
+        if (c == 'C' && ym_wait_ack(xbuff, 128) < 0) {
+            if (n < count)
+                f_close(&fil);
+            ym_cancel();
+            return -4;
+        }
+        if (n == count)
+            break;
+
+        if ((c = ym_wait()) < 0) {
+            f_close(&fil);
+            if (c == -2)
+                ym_cancel();
+            return c;
+        }
+        packetno = 1;
+        for (;;) {
+            if (f_read(&fil, &xbuff[3], 1024, &br) != FR_OK || br == 0)
+                break;
+            /* use a short block for a short tail */
+            bufsz = br <= 128 ? 128 : 1024;
+            if (br < bufsz)
+                memset(&xbuff[3+br], CTRLZ, bufsz-br);
+            xbuff[0] = bufsz == 128 ? SOH : STX;
+            xbuff[1] = packetno;
+            xbuff[2] = ~packetno;
+            ym_send_packet(xbuff, bufsz);
+            if (c == 'G') {
+                /* streaming: the only thing the receiver can say is cancel */
+                while (uart_testrx(0)) {
+                    if (uart_getc(0) == CAN) {
+                        f_close(&fil);
+                        flushinput();
+                        return -1;
+                    }
+                }
+            } else if (ym_wait_ack(xbuff, bufsz) < 0) {
+                f_close(&fil);
+                ym_cancel();
+                return -4; /* xmit error */
+            }
+            ++packetno;
+        }
+        f_close(&fil);
+        for (retry = 0; retry < 10; ++retry) {
+            _outbyte(EOT);
+            if ((c = _inbyte((DLY_1S)<<1)) == ACK) break;
+        }
+        if (c != ACK) {
+            flushinput();
+            return -5;
+        }
+        files++;
+    }
+    return files;
+}
+
 #ifdef TEST_XMODEM_RECEIVE
 int main(void)
 {
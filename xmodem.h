@@ -23,9 +23,20 @@
 #ifndef XMODEM_H
 #define XMODEM_H
 
+#include <stdint.h>
 #include "ff.h"
 
+#define XM_FILE 0   /**< receive into a file */
+#define XM_MEM 1    /**< receive into Z80 memory */
+#define XM_FLASH 2  /**< receive into SST flash */
+
+unsigned short crc16_update(unsigned short crc, const void *buf, int len);
+unsigned short crc16_ccitt(const void *buf, int len);
+
 int xm_receive(FIL *file);
+int xm_receive_mem(uint32_t addr, unsigned char target);
 int xm_transmit(FIL *file);
+int ym_receive(void);
+int ym_transmit(int count, char *names[]);
 
 #endif
\ No newline at end of file
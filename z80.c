@@ -26,6 +26,7 @@
 
 #include <stdint.h>
 #include <stdio.h>
+#include <string.h>
 #include <avr/pgmspace.h>
 
 #include "z80.h"
@@ -33,6 +34,13 @@
 #include "disasm.h"
 #include "uart.h"
 #include "iorq.h"
+#include "intctl.h"
+#include "sched.h"
+#include "trace.h"
+#include "timer.h"
+#ifdef PROFILE_SHIFT
+#include "profile.h"
+#endif
 
 /**
  * Breakpoints and watch names
@@ -42,14 +50,93 @@ const char debug_names[] PROGMEM = "memrd\0memwr\0iord\0iowr\0opfetch\0bus";
 /**
  * Breakpoint and watch ranges
  */
-range breaks[] = {{0xffff, 0}, {0xffff, 0}, {0xffff, 0}, {0xffff, 0}, {0xffff, 0}, {0xffff, 0}};
-range watches[] = {{0xffff, 0}, {0xffff, 0}, {0xffff, 0}, {0xffff, 0}, {0xffff, 0}, {0xffff, 0}};
+debug_set breaks[DEBUGCNT];
+debug_set watches[DEBUGCNT];
+
+/**
+ * Recompute the page or port map after the ranges of a type change
+ */
+static void debug_map(debug_set *set, uint8_t type)
+{
+    uint16_t i, first, last;
+    memset(set->map, 0, sizeof set->map);
+    for (uint8_t r = 0; r < set->count; r++) {
+        if (IOTYPE(type)) {
+            // Ports are mapped by their low byte, so a range wrapping past it covers the rest too
+            first = set->ranges[r].start & 0xff;
+            last = set->ranges[r].end & 0xff;
+            if (set->ranges[r].end - set->ranges[r].start >= 0xff) {
+                first = 0;
+                last = 0xff;
+            } else if (last < first) {
+                for (i = 0; i <= last; i++)
+                    set->map[i >> 3] |= (1 << (i & 7));
+                last = 0xff;
+            }
+        } else {
+            first = set->ranges[r].start >> 8;
+            last = set->ranges[r].end >> 8;
+        }
+        for (i = first; i <= last; i++)
+            set->map[i >> 3] |= (1 << (i & 7));
+    }
+}
+
+/**
+ * Add a range; returns 0 if the type already has DEBUG_RANGES ranges
+ */
+uint8_t debug_add(debug_set *sets, uint8_t type, uint16_t start, uint16_t end)
+{
+    debug_set *set = &sets[type];
+    if (set->count >= DEBUG_RANGES)
+        return 0;
+    set->ranges[set->count].start = start;
+    set->ranges[set->count].end = end;
+    set->count++;
+    debug_map(set, type);
+    return 1;
+}
+
+/**
+ * Delete the range beginning at start; returns 0 if there is none
+ */
+uint8_t debug_del(debug_set *sets, uint8_t type, uint16_t start)
+{
+    debug_set *set = &sets[type];
+    for (uint8_t i = 0; i < set->count; i++) {
+        if (set->ranges[i].start == start) {
+            set->ranges[i] = set->ranges[--set->count];
+            debug_map(set, type);
+            return 1;
+        }
+    }
+    return 0;
+}
+
+/**
+ * Delete all ranges of a type
+ */
+void debug_clear(debug_set *sets, uint8_t type)
+{
+    sets[type].count = 0;
+    memset(sets[type].map, 0, sizeof sets[type].map);
+}
 
 /**
  * Whether to stop when the halt signal occurs
  */
 uint8_t do_halt = 1;
 
+/**
+ * Set by background tasks to end z80_run
+ */
+static volatile uint8_t z80_stop;
+
+/**
+ * Character that breaks into the monitor from z80_run (Ctrl-])
+ */
+#define BREAK_CHAR 0x1d
+
 /**
  * Reset the Z80 to a specified address
  */
@@ -60,6 +147,9 @@ void z80_reset(uint32_t addr)
     if (addr > 0x0002) {
         mem_write(0x0000, reset_vect, 3);
     }
+#ifdef INTCTL_BASE
+    intctl_reset();
+#endif
     RESET_LO;
     clk_cycle(3);
     RESET_HI;
@@ -71,23 +161,84 @@ void z80_reset(uint32_t addr)
     BUSRQ_HI;
 }
 
+/**
+ * Background task to stop the Z80 when it halts
+ */
+void z80_halt_task(void)
+{
+    if (do_halt && !GET_HALT)
+        z80_stop = 1;
+}
+
+/**
+ * Background task to stop the Z80 when the break-in character is received
+ */
+void z80_break_task(void)
+{
+    if (uart_break) {
+        uart_break = 0;
+        printf_P(PSTR("break\n"));
+        z80_stop = 1;
+    }
+}
+
 /**
  * Run the Z80 at full speed
+ * 
+ * IO requests are serviced by the IORQ pin change interrupt, leaving this
+ * loop free to run background tasks. The interrupt is held off while a task
+ * runs since both may use the SPI bus; the Z80 just waits a little longer.
+ * The profiler's sampling interrupt checks for this too.
  */
 void z80_run(void)
 {
-    uint16_t count;
+    sched_func task;
+
+    z80_stop = 0;
+    uart_break = 0;
+    uart_break_char = BREAK_CHAR;
     clk_run();
-    for(;;) {
-        if (!GET_IORQ)
-            iorq_dispatch(0);
-        if (++count == 0 && !GET_HALT && do_halt)
-            break;
+    iorq_irq_start();
+#ifdef PROFILE_SHIFT
+    if (profile_on)
+        profile_start();
+#endif
+    while (!z80_stop) {
+        if ((task = sched_next())) {
+            IORQ_INT_DISABLE;
+            task();
+            IORQ_INT_ENABLE;
+        }
+#ifdef INTCTL_BASE
+        if (intctl_check) {
+            IORQ_INT_DISABLE;
+            intctl_update();
+            IORQ_INT_ENABLE;
+        }
+#endif
     }
+#ifdef PROFILE_SHIFT
+    profile_stop();
+#endif
+    iorq_irq_stop();
+    uart_break_char = 0;
     clk_stop();
     CLK_LO;
 }
 
+/**
+ * Decide whether a breakpoint stops the Z80 now or after the trace
+ * post-trigger window has been captured
+ */
+static uint8_t z80_trigger(void)
+{
+#ifdef TRACE_LEN
+    return trace_trigger();
+#else
+    return 1;
+#endif
+}
+
 /**
  * Do a single T cycle, optionally logging and breaking on the bus status
  */
@@ -107,24 +258,24 @@ uint8_t z80_tick()
         if (lastrd && !GET_RD) {
             bus_stat status = bus_status();
             if (logged = INRANGE(watches, MEMRD, status.addr)) {
-                bus_log(status);
+                trace_log(status);
                 uart_flush();
             }
             if (INRANGE(breaks, MEMRD, status.addr)) {
                 printf_P(PSTR("memrd break at %04X\n"), status.addr);
                 uart_flush();
-                return 1;
+                return z80_trigger();
             }
         } else if (lastwr && !GET_WR) {
             bus_stat status = bus_status();
             if (logged = INRANGE(watches, MEMWR, status.addr)) {
-                bus_log(status);
+                trace_log(status);
                 uart_flush();
             }
             if (INRANGE(breaks, MEMWR, status.addr)) {
                 printf_P(PSTR("memwr break at %04X\n"), status.addr);
                 uart_flush();
-                return 1;
+                return z80_trigger();
             };
         }
     } 
@@ -135,14 +286,14 @@ uint8_t z80_tick()
             if (INRANGE(breaks, IORD, GET_ADDRLO)) {
                 printf_P(PSTR("iord break at %02x\n"), GET_ADDRLO);
                 uart_flush();
-                return 1;
+                return z80_trigger();
             }
         } else if (lastwr && !GET_WR) {
             logged = INRANGE(watches, IOWR, GET_ADDRLO);
             if (INRANGE(breaks, IOWR, GET_ADDRLO)) {
                 printf_P(PSTR("iowr break at %02x\n"), GET_ADDRLO);
                 uart_flush();
-                return 1;
+                return z80_trigger();
             }
         }
     }
@@ -150,7 +301,7 @@ uint8_t z80_tick()
     if (ENABLED(watches, BUS) && !logged) {
         bus_stat status = bus_status();
         if (INRANGE(watches, BUS, status.addr)) {
-            bus_log(status);
+            trace_log(status);
             uart_flush();
         }
     }
@@ -160,12 +311,30 @@ uint8_t z80_tick()
         if (logged)
             uart_flush();
     }
-        
+
+#ifdef TRACE_LEN
+    if (trace_done) {
+        trace_done = 0;
+        printf_P(PSTR("trace captured\n"));
+        return 1;
+    }
+#endif
     return 0;
 }
 
 uint8_t disasmbrk = 0;
 
+#ifdef TRACE_FILE
+/**
+ * Opcode bytes of the instruction being traced
+ */
+static uint8_t fetch_bytes[ITRACE_LEN_MASK];
+static uint8_t fetch_len;
+#define ITRACE_ON itrace_on
+#else
+#define ITRACE_ON 0
+#endif
+
 /**
  * Clock the Z80 until it completes a memory read cycle and return the value read
  */
@@ -180,6 +349,19 @@ uint8_t z80_read()
     return data;
 }
 
+#ifdef TRACE_FILE
+/**
+ * Read the next instruction byte and keep it for the instruction trace
+ */
+uint8_t z80_fetch()
+{
+    uint8_t data = z80_read();
+    if (fetch_len < sizeof fetch_bytes)
+        fetch_bytes[fetch_len++] = data;
+    return data;
+}
+#endif
+
 /**
  * Run the Z80 with watches and breakpoints for a specified number of instructions
  */
@@ -190,17 +372,28 @@ void z80_debug(uint32_t cycles)
     static uint8_t brkonce = 0;
 
     while (GET_HALT && (cycles == 0 || c < cycles)) {
-        if ((ENABLED(watches, OPFETCH) || ENABLED(breaks, OPFETCH) || cycles)) {
-            if (!GET_RD && !GET_MREQ && !GET_M1) {
-                uint16_t addr = GET_ADDR;
+        if ((ENABLED(watches, OPFETCH) || ENABLED(breaks, OPFETCH) || cycles || ITRACE_ON)) {
+            // Sample M1 and the address high byte in one expander read
+            uint16_t hiflags = (!GET_RD && !GET_MREQ) ? GET_ADDRHI_XFLAGS : (1 << (M1 + 8));
+            if (!(hiflags & (1 << (M1 + 8)))) {
+                uint16_t addr = GET_ADDRLO | (hiflags << 8);
                 if (INRANGE(breaks, OPFETCH, addr) && !cycles && !brkonce) {
                     printf_P(PSTR("opfetch break at %04x\n"), addr);
-                    brkonce = 1;
-                    break;
+                    if (z80_trigger()) {
+                        brkonce = 1;
+                        break;
+                    }
                 }
                 brkonce = 0;
                 disasmbrk = 0;
+#ifdef TRACE_FILE
+                fetch_len = 0;
+                disasm(z80_fetch, mnemonic);
+                if (itrace_on)
+                    itrace_record(addr, (hiflags >> 8) & XFLAGS_MASK, fetch_bytes, fetch_len);
+#else
                 disasm(z80_read, mnemonic);
+#endif
                 if (INRANGE(watches, OPFETCH, addr)) {
                     printf_P(PSTR("\t%04x\t%s\n"), addr, mnemonic);
                     uart_flush();
@@ -213,4 +406,182 @@ void z80_debug(uint32_t cycles)
         if(z80_tick())
             break;
     }
-}
\ No newline at end of file
+#ifdef TRACE_FILE
+    // Tracing stops with the run, so leave a complete file on the card
+    itrace_close();
+#endif
+}
+
+/**
+ * Z80 cycles left for z80_tick at the end of a counted run, to cover the
+ * latency of noticing the count is nearly reached
+ */
+#define RUN_MARGIN 64
+
+/**
+ * Slowest Z80 clock, as a divider, at which the run-until loop reliably
+ * sees the address of every memory read
+ */
+#define UNTIL_CLKDIV 16
+
+/**
+ * Run-until tuning: at full speed one memory read in UNTIL_SAMPLE has its
+ * page checked; a read near the target page slows the clock for the next
+ * UNTIL_NEAR reads; UNTIL_TRIES bounds each wait for a read to end
+ */
+#define UNTIL_SAMPLE 16
+#define UNTIL_NEAR 4096
+#define UNTIL_TRIES 255
+
+static uint32_t run_start;
+
+/**
+ * Count of CPU clocks since the counted run started. Timer3 counts them
+ * exactly but only to 16 bits, so the upper bits come from the timebase,
+ * which keeps counting while long IO requests hold interrupts off.
+ */
+static uint32_t run_clocks(void)
+{
+    uint16_t fine = TCNT3;
+    uint32_t coarse = (timer_ticks() - run_start) * TIMER_PRESCALE;
+    return coarse + (int16_t)(fine - (uint16_t)coarse);
+}
+
+/**
+ * Run the Z80 for an exact number of clock cycles
+ *
+ * Timer3 counts CPU clocks alongside the Timer2 PWM clock. The two are
+ * started and stopped by back to back stores, so the PWM ran for exactly
+ * as many CPU clocks as Timer3 counted and emitted one Z80 clock per
+ * clkdiv of them. IO requests are polled; the PWM keeps clocking through
+ * them, so they don't disturb the count. Devices with their own clkdiv
+ * slow the PWM during their cycle, and iorq_dispatch tallies those clocks
+ * separately so they are counted at the slower rate, to within a cycle per
+ * request. The last few cycles are single stepped with z80_tick, so
+ * breakpoints and watches apply there.
+ *
+ * An IO request still being serviced when the count runs out lets the Z80
+ * run on, so the count returned can exceed cycles. A device handler or
+ * transfer holding interrupts off for longer than a timebase overflow
+ * (about 200ms) is not counted correctly.
+ */
+uint32_t z80_run_cycles(uint32_t cycles)
+{
+    uint32_t done = 0;
+
+    uart_break = 0;
+    uart_break_char = BREAK_CHAR;
+    if (cycles > RUN_MARGIN) {
+        uint32_t stop = (cycles - RUN_MARGIN) * clkdiv;
+        uint8_t run3 = (1 << CS30);
+        uint8_t run2 = (1 << WGM22) | (1 << CS20);
+
+        TCCR3A = 0;
+        TCCR3B = 0;
+        TCNT3 = 0;
+        TCCR2A = (1 << COM2B1) | (1 << WGM21) | (1 << WGM20);
+        TCCR2B = 0;
+        TCNT2 = 0;
+        OCR2A = (clkdiv - 1);
+        OCR2B = (clkdiv - 1) >> 1;
+        iorq_slow_clocks = 0;
+        iorq_slow_cycles = 0;
+        iorq_slow_tally = 1;
+        run_start = timer_ticks();
+        __asm__ __volatile__ (
+            "sts %0, %2\n\t"
+            "sts %1, %3\n\t"
+            :: "n" (_SFR_MEM_ADDR(TCCR3B)), "n" (_SFR_MEM_ADDR(TCCR2B)), "r" (run3), "r" (run2));
+        while (!uart_break && run_clocks() - iorq_slow_clocks + iorq_slow_cycles * clkdiv < stop) {
+            if (!GET_IORQ)
+                iorq_dispatch(0);
+        }
+        __asm__ __volatile__ (
+            "sts %0, __zero_reg__\n\t"
+            "sts %1, __zero_reg__\n\t"
+            :: "n" (_SFR_MEM_ADDR(TCCR3B)), "n" (_SFR_MEM_ADDR(TCCR2B)));
+        iorq_slow_tally = 0;
+        done = (run_clocks() - iorq_slow_clocks) / clkdiv + iorq_slow_cycles;
+        clk_stop();
+        CLK_LO;
+    }
+    while (done < cycles && !uart_break) {
+        done++;
+        if (z80_tick())
+            break;
+    }
+    uart_break_char = 0;
+    return done;
+}
+
+/**
+ * Run the Z80 until it fetches an opcode from an address
+ *
+ * The Z80 runs at full speed while the loop samples the page of the odd
+ * memory read, freezing the PWM clock to read the high byte over SPI. Once a
+ * read lands in or just below the target page, the clock is slowed to
+ * UNTIL_CLKDIV so every read with the target's low byte on PORTA is seen
+ * and can be checked for M1 and the high byte, until the program has moved
+ * away again. An interrupt landing at the wrong moment can still hide a
+ * fetch, so code only passed through briefly may be missed.
+ * Returns 1 if the address was reached or 0 if the break character was typed.
+ */
+uint8_t z80_run_until(uint16_t addr)
+{
+    uint8_t lo = addr & 0xff;
+    uint8_t fast = clkdiv;
+    uint8_t slow = clkdiv < UNTIL_CLKDIV ? UNTIL_CLKDIV : clkdiv;
+    uint8_t hit = 0, sample = 0, i;
+    uint16_t near = 0;
+    uint16_t hiflags;
+
+    uart_break = 0;
+    uart_break_char = BREAK_CHAR;
+    clk_run();
+    while (!uart_break) {
+        if (!GET_IORQ) {
+            iorq_dispatch(0);
+            continue;
+        }
+        if (GET_MREQ || GET_RD)
+            continue;
+        if (!near) {
+            if (++sample >= UNTIL_SAMPLE) {
+                sample = 0;
+                TCCR2B &= ~(1 << CS20);
+                if (!GET_MREQ && !GET_RD) {
+                    hiflags = GET_ADDRHI_XFLAGS;
+                    if ((uint8_t)((addr >> 8) - (hiflags & 0xff)) <= 1) {
+                        // Set clkdiv too, so slow devices restore this speed after their cycle
+                        near = UNTIL_NEAR;
+                        clkdiv = slow;
+                        clk_set(clkdiv);
+                    }
+                }
+                TCCR2B |= (1 << CS20);
+            }
+        } else {
+            if (GET_ADDRLO == lo) {
+                TCCR2B &= ~(1 << CS20);
+                hiflags = GET_ADDRHI_XFLAGS;
+                if (!(hiflags & (1 << (M1 + 8))) && (hiflags & 0xff) == (addr >> 8)) {
+                    hit = 1;
+                    break;
+                }
+                TCCR2B |= (1 << CS20);
+            }
+            if (--near == 0) {
+                clkdiv = fast;
+                clk_set(clkdiv);
+            }
+        }
+        // Let this read finish so it isn't checked again; a held WAIT gives up
+        for (i = 0; i < UNTIL_TRIES && !GET_MREQ; i++)
+            ;
+    }
+    clk_stop();
+    CLK_LO;
+    clkdiv = fast;
+    uart_break_char = 0;
+    return hit;
+}
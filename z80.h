@@ -38,17 +38,59 @@ typedef struct {
         uint16_t end;
 } range;
 
-extern range breaks[];
-extern range watches[];
+#ifndef DEBUG_RANGES
+#define DEBUG_RANGES 4
+#endif
+
+/**
+ * Breakpoint or watch ranges of one type. The map has a bit for each port
+ * for IO types and for each 256-byte page for memory types, so addresses
+ * outside any range are rejected with a single bit test.
+ */
+typedef struct {
+        range ranges[DEBUG_RANGES];
+        uint8_t count;
+        uint8_t map[32];
+} debug_set;
+
+extern debug_set breaks[];
+extern debug_set watches[];
 extern uint8_t do_halt;
 extern const char debug_names[];
 
-#define INRANGE(ranges, type, addr) ((ranges)[(type)].start <= (addr) && (addr) <= (ranges)[type].end)
-#define ENABLED(ranges, type) ((ranges)[(type)].start <= (ranges)[(type)].end)
+#define MAPBIT(map, i) ((map)[(i) >> 3] & (1 << ((i) & 7)))
+#define IOTYPE(type) ((type) == IORD || (type) == IOWR)
+
+/**
+ * Check whether an address is in any range; type is normally a constant so
+ * the IO test folds away
+ */
+static inline uint8_t debug_match(debug_set *set, uint8_t type, uint16_t addr)
+{
+    if (IOTYPE(type))
+        return MAPBIT(set->map, addr & 0xff);
+    if (!MAPBIT(set->map, addr >> 8))
+        return 0;
+    for (uint8_t i = 0; i < set->count; i++)
+        if (set->ranges[i].start <= addr && addr <= set->ranges[i].end)
+            return 1;
+    return 0;
+}
+
+#define INRANGE(sets, type, addr) debug_match(&(sets)[(type)], (type), (addr))
+#define ENABLED(sets, type) ((sets)[(type)].count)
+
+uint8_t debug_add(debug_set *sets, uint8_t type, uint16_t start, uint16_t end);
+uint8_t debug_del(debug_set *sets, uint8_t type, uint16_t start);
+void debug_clear(debug_set *sets, uint8_t type);
 
 void z80_page(uint32_t p);
 void z80_reset(uint32_t addr);
+void z80_halt_task(void);
+void z80_break_task(void);
 void z80_run(void);
+uint32_t z80_run_cycles(uint32_t cycles);
+uint8_t z80_run_until(uint16_t addr);
 void z80_debug(uint32_t cycles);
 
 #endif
\ No newline at end of file